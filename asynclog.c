@@ -0,0 +1,370 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "asynclog.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LOGPENDMAX	(1024 * 1024)
+#define LOGBATCH	(64 * 1024)
+#define LOGFLUSHMS	1000
+#define LOGFRAMESZ	(64 * 1024)
+
+void logsink_pump(struct logsink *s)
+{
+	ssize_t writn;
+	char *note;
+
+	if (!s->pend.len && !s->dropped) return;
+
+	if (s->pend.len) {
+		writn = write(s->de.fd, s->pend.bf, s->pend.len);
+		if (writn < 0 && errno != EAGAIN && errno != EINTR) {
+			perror("writing to log writer");
+			s->dropped += s->pend.len;
+			writn = s->pend.len;
+		}
+		if (writn <= 0) return;
+
+		s->pend.len -= writn;
+		memmove(s->pend.bf, s->pend.bf + writn, s->pend.len);
+	}
+
+	if (s->pend.len || !s->dropped) return;
+
+	fprintf(stderr, "log writer fell behind; %llu bytes dropped\n",
+		s->dropped);
+	if (s->dropnote) {
+		xasprintf(&note, "\n[werm: %llu bytes of output not logged]\n",
+			  s->dropped);
+		fdb_apnd(&s->pend, note, -1);
+		free(note);
+	}
+	s->dropped = 0;
+}
+
+int logsink_write(struct logsink *s, const void *buf_, size_t len)
+{
+	const unsigned char *buf = buf_;
+	ssize_t writn;
+
+	if (s->de.fd < 0) return 0;
+
+	if (!s->async) {
+		full_write(&s->de, buf, len);
+		if (!s->tri.bm) return 1;
+
+		triidx_add(&s->tri, buf, len);
+		if (s->tri.unsaved >= LOGBATCH) triidx_save(&s->tri, s->de.fd);
+		return 1;
+	}
+
+	logsink_pump(s);
+
+	if (!s->pend.len && !s->dropped) {
+		writn = write(s->de.fd, buf, len);
+		if (writn < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("writing to log writer");
+			writn = 0;
+		}
+		buf += writn;
+		len -= writn;
+	}
+	if (!len) return 1;
+
+	if (s->dropped || s->pend.len + len > LOGPENDMAX) {
+		s->dropped += len;
+		return 0;
+	}
+
+	fdb_apnd(&s->pend, buf, len);
+	return 1;
+}
+
+void logsink_fdset(struct logsink *s, fd_set *wfds, int *highest_fd)
+{
+	if (!s->async || (!s->pend.len && !s->dropped)) return;
+
+	FD_SET(s->de.fd, wfds);
+	if (s->de.fd > *highest_fd) *highest_fd = s->de.fd;
+}
+
+static long long nowms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+struct lgwr {
+	int in;
+	struct wrides out;
+	struct fdbuf b;
+
+	/* When the oldest byte in b was read */
+	long long sincems;
+
+	/* For compressed logs: the frame index, the offset in out of the
+	   current frame, and its compressed and uncompressed size so far. */
+	struct wrides zidx;
+	z_stream z;
+	unsigned long long frmoff, frmclen;
+	unsigned frmulen;
+
+	struct triidx tri;
+};
+
+static void lgwdefl(struct lgwr *w, unsigned char *in, unsigned len, int flsh)
+{
+	unsigned char ob[16 * 1024];
+	unsigned outsz;
+
+	w->z.next_in = in;
+	w->z.avail_in = len;
+	do {
+		w->z.next_out = ob;
+		w->z.avail_out = sizeof(ob);
+		if (Z_STREAM_ERROR == deflate(&w->z, flsh))
+			errx(1, "deflate: %s", w->z.msg);
+
+		outsz = sizeof(ob) - w->z.avail_out;
+		full_write(&w->out, ob, outsz);
+		w->frmclen += outsz;
+	} while (!w->z.avail_out);
+}
+
+static void lgwendfrm(struct lgwr *w)
+{
+	char ent[64];
+
+	if (!w->frmulen) return;
+
+	lgwdefl(w, 0, 0, Z_FINISH);
+	snprintf(ent, sizeof(ent), "%llu %llu %u\n",
+		 w->frmoff, w->frmclen, w->frmulen);
+	full_write(&w->zidx, ent, -1);
+
+	w->frmoff += w->frmclen;
+	w->frmclen = w->frmulen = 0;
+	deflateReset(&w->z);
+}
+
+static void lgwflush(struct lgwr *w, int fsyncb)
+{
+	unsigned off, n;
+
+	if (!w->b.len) return;
+
+	if (!w->zidx.fd) {
+		full_write(&w->out, w->b.bf, w->b.len);
+	}
+	else {
+		for (off = 0; off < w->b.len; off += n) {
+			n = LOGFRAMESZ - w->frmulen;
+			if (n > w->b.len - off) n = w->b.len - off;
+
+			lgwdefl(w, w->b.bf + off, n, Z_NO_FLUSH);
+			w->frmulen += n;
+			if (w->frmulen == LOGFRAMESZ) lgwendfrm(w);
+		}
+		if (w->frmulen) lgwdefl(w, 0, 0, Z_SYNC_FLUSH);
+	}
+
+	if (fsyncb && fsync(w->out.fd)) perror("fsync log");
+
+	if (w->tri.fd) {
+		triidx_add(&w->tri, w->b.bf, w->b.len);
+		triidx_save(&w->tri, w->out.fd);
+	}
+	w->b.len = 0;
+}
+
+/* Finds where the last finished frame ends, and truncates anything after it,
+   which would be a frame left unfinished when a previous writer died. gzip
+   could not read frames appended after it. */
+static void lgwzopen(struct lgwr *w)
+{
+	FILE *idx;
+	unsigned long long off, clen;
+	off_t sz;
+
+	if (deflateInit2(&w->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		errx(1, "deflateInit2: %s", w->z.msg);
+
+	idx = fdopen(dup(w->zidx.fd), "r");
+	if (!idx) err(1, "fdopen log index");
+	while (2 == fscanf(idx, "%llu %llu %*u\n", &off, &clen))
+		w->frmoff = off + clen;
+	fclose(idx);
+
+	sz = lseek(w->out.fd, 0, SEEK_END);
+	if (sz < 0) err(1, "seek log");
+	if (sz == w->frmoff) return;
+
+	fprintf(stderr, "discarding %llu bytes of unfinished frame in log\n",
+		(unsigned long long)sz - w->frmoff);
+	if (ftruncate(w->out.fd, w->frmoff)) err(1, "truncate log");
+}
+
+static _Noreturn void logwriter(struct lgwr *ws, int cnt, int fsyncb)
+{
+	struct pollfd pfds[cnt];
+	unsigned char buf[16 * 1024];
+	long long now, tmo;
+	ssize_t red;
+	int wi, opn;
+
+	for (;;) {
+		now = nowms();
+		tmo = -1;
+		opn = 0;
+
+		for (wi = 0; wi < cnt; wi++) {
+			pfds[wi].fd = ws[wi].in;
+			pfds[wi].events = POLLIN;
+			if (ws[wi].in >= 0) opn++;
+			if (!ws[wi].b.len) continue;
+
+			if (now - ws[wi].sincems >= LOGFLUSHMS)
+				lgwflush(ws + wi, fsyncb);
+			else if (tmo < 0 || tmo > ws[wi].sincems + LOGFLUSHMS - now)
+				tmo = ws[wi].sincems + LOGFLUSHMS - now;
+		}
+		if (!opn) exit(0);
+
+		if (0 > poll(pfds, cnt, tmo)) {
+			if (errno != EINTR) err(1, "poll in log writer");
+			continue;
+		}
+
+		for (wi = 0; wi < cnt; wi++) {
+			if (!pfds[wi].revents) continue;
+
+			red = read(ws[wi].in, buf, sizeof(buf));
+			if (red < 0 && errno == EINTR) continue;
+			if (red <= 0) {
+				lgwflush(ws + wi, fsyncb);
+				if (ws[wi].zidx.fd) lgwendfrm(ws + wi);
+				close(ws[wi].in);
+				ws[wi].in = -1;
+				continue;
+			}
+
+			if (!ws[wi].b.len) ws[wi].sincems = nowms();
+			fdb_apnd(&ws[wi].b, buf, red);
+			if (ws[wi].b.len >= LOGBATCH) lgwflush(ws + wi, fsyncb);
+		}
+	}
+}
+
+void start_logwriter(Dtachctx dc, struct logsink **snks, int cnt, int fsyncb)
+{
+	struct lgwr *ws = calloc(cnt, sizeof(*ws));
+	int si, fd, keep, pip[2], nullfd;
+	pid_t pid;
+
+	for (si = 0; si < cnt; si++) {
+		ws[si].in = -1;
+		ws[si].out.fd = snks[si]->de.fd;
+		ws[si].zidx.fd = snks[si]->zidx;
+		ws[si].tri = snks[si]->tri;
+	}
+
+	for (si = 0; si < cnt; si++) {
+		if (pipe(pip)) { perror("pipe for log writer"); goto cleanup; }
+
+		/* A larger pipe absorbs bursts while the writer is blocked on
+		   the filesystem. Failure is OK. */
+		fcntl(pip[1], F_SETPIPE_SZ, LOGPENDMAX);
+		fcntl(pip[1], F_SETFL, fcntl(pip[1], F_GETFL) | O_NONBLOCK);
+		fcntl(pip[1], F_SETFD, FD_CLOEXEC);
+
+		ws[si].in = pip[0];
+		snks[si]->de.fd = pip[1];
+	}
+
+	/* Fork twice so the writer is not our child. The master treats an
+	   interrupted select as a sign its subprocess exited. */
+	pid = fork();
+	if (pid < 0) { perror("fork for log writer"); goto cleanup; }
+	if (pid) {
+		while (0 > waitpid(pid, 0, 0) && errno == EINTR) {}
+
+		for (si = 0; si < cnt; si++) {
+			close(ws[si].in);
+			close(ws[si].out.fd);
+			if (ws[si].zidx.fd) close(ws[si].zidx.fd);
+			if (ws[si].tri.fd) close(ws[si].tri.fd);
+			snks[si]->tri.fd = 0;
+			snks[si]->async = 1;
+		}
+		free(ws);
+		return;
+	}
+
+	if (fork()) _exit(0);
+
+	set_argv0(dc, 'l');
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	/* Do not hold the control socket or pty open, so whether the session
+	   is in use can be told accurately. */
+	for (fd = getdtablesize(); fd-- > 0;) {
+		keep = fd == 2;
+		for (si = 0; si < cnt; si++)
+			keep |=	fd == ws[si].in || fd == ws[si].out.fd ||
+				fd == ws[si].zidx.fd || fd == ws[si].tri.fd;
+		if (!keep) close(fd);
+	}
+	nullfd = open("/dev/null", O_RDWR);
+	if (nullfd >= 0) {
+		dup2(nullfd, 0);
+		dup2(nullfd, 1);
+		if (nullfd > 2) close(nullfd);
+	}
+
+	for (si = 0; si < cnt; si++) {
+		if (ws[si].zidx.fd)	lgwzopen(ws + si);
+		if (ws[si].tri.fd)	triidx_load(&ws[si].tri, ws[si].out.fd,
+						    ws[si].zidx.fd);
+	}
+
+	logwriter(ws, cnt, fsyncb);
+
+cleanup:
+	/* Keep logging synchronously. */
+	for (si = 0; si < cnt; si++) {
+		if (ws[si].in >= 0) {
+			close(ws[si].in);
+			close(snks[si]->de.fd);
+			snks[si]->de.fd = ws[si].out.fd;
+		}
+		if (!ws[si].zidx.fd) continue;
+
+		close(ws[si].zidx.fd);
+		close(ws[si].out.fd);
+		snks[si]->de.fd = -1;
+		if (ws[si].tri.fd) close(ws[si].tri.fd);
+		snks[si]->tri.fd = 0;
+	}
+	free(ws);
+}
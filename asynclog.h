@@ -0,0 +1,70 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef ASYNCLOG_H
+#define ASYNCLOG_H
+
+#include "outstreams.h"
+#include "dtachctx.h"
+#include "logidx.h"
+
+#include <sys/select.h>
+
+/* Destination of a scrollback log. Unless async is set, writes go to de
+ * directly and may block. When async is set, de is the non-blocking write end of
+ * a pipe read by the log writer process, which does the file I/O in batches.
+ * The master then never waits on the filesystem. */
+struct logsink {
+	struct wrides de;
+
+	/* Output the pipe did not accept yet. Limited to LOGPENDMAX bytes. */
+	struct fdbuf pend;
+
+	/* Number of bytes discarded because pend was full. Nothing new is
+	 * accepted until pend is drained, then a notice is put in the log. */
+	unsigned long long dropped;
+
+	unsigned async		: 1;
+
+	/* Put a human-readable notice in the log when bytes are dropped. Not
+	 * set for raw logs. */
+	unsigned dropnote	: 1;
+
+	/* If non-zero, the log is compressed and this is its frame index. The
+	 * log is a series of gzip members, called frames, each holding
+	 * LOGFRAMESZ bytes of output except for the last. The index has a line
+	 * for each finished frame: its offset in the log, its compressed size
+	 * and its uncompressed size, in decimal, separated by spaces. The
+	 * unfinished frame at the end is flushed with Z_SYNC_FLUSH at each
+	 * batch, so its contents can be read with a streaming decompressor. */
+	int zidx;
+
+	/* Trigram index of the log. Kept up to date by the writer process, or
+	 * if there is none, by logsink_write after triidx_load is called. */
+	struct triidx tri;
+};
+
+/* Writes to the log, or queues the bytes if the writer process is busy. Returns
+ * 0 if the bytes were dropped. Unless a write is longer than LOGPENDMAX, either
+ * all of it is kept or none of it. */
+int logsink_write(struct logsink *s, const void *buf, size_t len);
+
+/* Sends pending bytes to the writer process. Call when de is writable. */
+void logsink_pump(struct logsink *s);
+
+/* Adds de to wfds if there are pending bytes, and raises *highest_fd to it. */
+void logsink_fdset(struct logsink *s, fd_set *wfds, int *highest_fd);
+
+/* Forks the log writer process and makes the given sinks async. Each sink must
+ * have its log file open in de. The writer batches output and writes it when
+ * LOGBATCH bytes are buffered or LOGFLUSHMS milliseconds have passed. If fsyncb
+ * is set, the log file is fsync'd after each batch. The writer also updates the
+ * trigram index of each sink that has one. Compressed logs are only
+ * written by the writer process, so if it cannot be started they are closed
+ * and nothing more is logged to them. */
+void start_logwriter(Dtachctx dc, struct logsink **snks, int cnt, int fsyncb);
+
+#endif
@@ -0,0 +1,330 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "authtab.h"
+#include "outstreams.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TABSZ		(AUTHTABSLOTS * sizeof(struct authent))
+
+static struct authent *tab;
+static int tabfd = -1;
+
+/* The keys read from keyspath, whose stat was keysst then, or zeroed if it
+   could not be read. */
+static char *keyspath;
+static struct stat keysst;
+static unsigned char (*keys)[PUBKEY_BYTESZ];
+static unsigned nkeys;
+
+int authtab_open(const char *path)
+{
+	struct stat st;
+	void *m;
+
+	if (tab) return 1;
+
+	tabfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (tabfd < 0) { warn("open %s", path); return 0; }
+
+	if (fstat(tabfd, &st)) { warn("fstat %s", path); goto er; }
+	if (st.st_size < (off_t)TABSZ && ftruncate(tabfd, TABSZ)) {
+		warn("ftruncate %s", path);
+		goto er;
+	}
+
+	m = mmap(0, TABSZ, PROT_READ | PROT_WRITE, MAP_SHARED, tabfd, 0);
+	if (m == MAP_FAILED) { warn("mmap %s", path); goto er; }
+
+	tab = m;
+	return 1;
+
+er:
+	close(tabfd);
+	tabfd = -1;
+	return 0;
+}
+
+static int tablock(int type)
+{
+	struct flock l = {.l_type = type, .l_whence = SEEK_SET};
+
+	while (fcntl(tabfd, F_SETLKW, &l))
+		if (errno != EINTR) { warn("lock auth table"); return 0; }
+
+	return 1;
+}
+
+static int expired(int64_t t, time_t now)
+{
+	return now - t > AUTH_EXPIRE_SECONDS;
+}
+
+/* When e was last used, or -1 if it is free. */
+static int64_t lastuse(const struct authent *e, time_t now)
+{
+	if (expired(e->authat, now) && expired(e->chalat, now)) return -1;
+	return e->authat > e->chalat ? e->authat : e->chalat;
+}
+
+static uint32_t cookhash(const char *cook)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *cook; cook++) h = (h ^ (unsigned char)*cook) * 16777619u;
+	return h;
+}
+
+/* Returns the entry for cook. If there is none, returns null, or if add is set,
+   claims the free or least recently used entry where cook may be kept. An entry
+   that is still authenticated is only claimed if add is 2, for a session being
+   authenticated, so a client asking for challenges cannot push sessions out;
+   null is returned if there is no other. */
+static struct authent *tabent(const char *cook, time_t now, int add)
+{
+	struct authent *e, *old = 0;
+	uint32_t h = cookhash(cook);
+	int i;
+
+	for (i = 0; i < AUTHTABPROBE; i++) {
+		e = tab + (h + i) % AUTHTABSLOTS;
+
+		if (lastuse(e, now) >= 0 &&
+		    !strncmp(e->cook, cook, sizeof(e->cook)))
+			return e;
+
+		if (add < 2 && !expired(e->authat, now)) continue;
+		if (!old || lastuse(e, now) < lastuse(old, now)) old = e;
+	}
+
+	if (!add || !old) return 0;
+
+	if (lastuse(old, now) >= 0) warnx("auth table full, dropping a session");
+
+	memset(old, 0, sizeof(*old));
+	strncpy(old->cook, cook, sizeof(old->cook) - 1);
+	return old;
+}
+
+int authtab_check(const char *cook, time_t now, int doallow,
+		  unsigned char *chal)
+{
+	struct authent *e;
+	int pend = 1;
+
+	memset(chal, 0, CHALLN_BYTESZ);
+
+	if (!tab || !tablock(F_WRLCK)) return 1;
+
+	e = tabent(cook, now, 0);
+	if (e && !expired(e->authat, now)) pend = 0;
+
+	if (doallow) {
+		if (!e) e = tabent(cook, now, 2);
+		e->authat = now;
+
+		/* The challenge has been used, so make a new one next time. */
+		e->chalat = 0;
+		pend = 0;
+	}
+	if (!pend) goto unlock;
+
+	if (!e) e = tabent(cook, now, 1);
+	if (!e) {
+		warnx("auth table full, no challenge for new session");
+		goto unlock;
+	}
+	if (expired(e->chalat, now)) {
+		if (sizeof(e->chal) != getrandom(e->chal, sizeof(e->chal), 0)) {
+			warn("getrandom for challenge");
+			goto unlock;
+		}
+		e->chalat = now;
+	}
+	memcpy(chal, e->chal, CHALLN_BYTESZ);
+
+unlock:
+	tablock(F_UNLCK);
+	return pend;
+}
+
+const char *authkeys_path(void)
+{
+	static char *p;
+
+	if (p) return p;
+	p = getenv("WERMAUTHKEYS");
+	if (p) return p=strdup(p);
+	xasprintf(&p, "%s/.ssh/werm_authorized_keys", getenv("HOME"));
+	return p;
+}
+
+static int samefile(const struct stat *a, const struct stat *b)
+{
+	return	a->st_dev == b->st_dev
+	&&	a->st_ino == b->st_ino
+	&&	a->st_size == b->st_size
+	&&	a->st_mtim.tv_sec == b->st_mtim.tv_sec
+	&&	a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+void authkeys_load(const char *path)
+{
+	struct stat sb;
+	FILE *f;
+	char *ln = 0;
+	size_t lncap = 0;
+	int bi, hi, lo;
+
+	if (stat(path, &sb)) memset(&sb, 0, sizeof(sb));
+	if (keyspath && !strcmp(keyspath, path) && samefile(&sb, &keysst))
+		return;
+
+	free(keyspath);
+	keyspath = strdup(path);
+	keysst = sb;
+	nkeys = 0;
+
+	f = fopen(path, "r");
+	if (!f) { warn("open wermauthkeys file %s", path); return; }
+
+	while (0 < getline(&ln, &lncap, f)) {
+		keys = realloc(keys, sizeof(*keys) * (nkeys + 1));
+
+		for (bi = 0; bi < PUBKEY_BYTESZ; bi++) {
+			if (0 > (hi = hexval(ln[bi*2 + 0]))) break;
+			if (0 > (lo = hexval(ln[bi*2 + 1]))) break;
+			keys[nkeys][bi] = hi << 4 | lo;
+		}
+
+		if (bi == PUBKEY_BYTESZ) nkeys++;
+	}
+
+	free(ln);
+	fclose(f);
+}
+
+int authkeys_has(const char *path, const void *pubkey)
+{
+	unsigned i;
+
+	authkeys_load(path);
+
+	for (i = 0; i < nkeys; i++)
+		if (!memcmp(keys[i], pubkey, PUBKEY_BYTESZ)) return 1;
+
+	return 0;
+}
+
+static void tstkeyln(FILE *f, const unsigned char *key)
+{
+	int bi;
+
+	for (bi = 0; bi < PUBKEY_BYTESZ; bi++)
+		fprintf(f, "%02x", key[bi]);
+	fputc('\n', f);
+}
+
+void test_authtab(void)
+{
+	char dir[] = "/tmp/authtabXXXXXX", *fn, *kfn;
+	unsigned char chal[CHALLN_BYTESZ], chal2[CHALLN_BYTESZ];
+	unsigned char zero[CHALLN_BYTESZ] = {0}, key[PUBKEY_BYTESZ];
+	time_t now = 1700000000;
+	struct authent *e;
+	uint32_t h;
+	FILE *kf;
+	int i, kept;
+
+	puts("AUTH TABLE");
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	xasprintf(&fn, "%s/authtab", dir);
+	xasprintf(&kfn, "%s/keys", dir);
+
+	printf("opened: %d\n", authtab_open(fn));
+
+	printf("new session pending: %d\n", authtab_check("abc", now, 0, chal));
+	printf("challenge made: %d\n", !!memcmp(chal, zero, CHALLN_BYTESZ));
+	authtab_check("abc", now + 5, 0, chal2);
+	printf("same challenge: %d\n", !memcmp(chal, chal2, CHALLN_BYTESZ));
+
+	printf("allowed pending: %d\n", authtab_check("abc", now + 10, 1, chal));
+	printf("then pending: %d\n", authtab_check("abc", now + 20, 0, chal));
+	printf("challenge zeroed: %d\n", !memcmp(chal, zero, CHALLN_BYTESZ));
+	printf("other session pending: %d\n",
+	       authtab_check("abd", now + 20, 0, chal));
+
+	printf("expired pending: %d\n", authtab_check(
+		"abc", now + 11 + AUTH_EXPIRE_SECONDS, 0, chal2));
+	printf("new challenge: %d\n", memcmp(chal2, zero, CHALLN_BYTESZ) &&
+				      memcmp(chal2, chal, CHALLN_BYTESZ));
+
+	h = cookhash("crowded");
+	for (i = 0; i < AUTHTABPROBE; i++) {
+		e = tab + (h + i) % AUTHTABSLOTS;
+		memset(e, 0, sizeof(*e));
+		snprintf(e->cook, sizeof(e->cook), "kept%d", i);
+		e->authat = now + 20;
+	}
+	printf("crowded pending: %d\n",
+	       authtab_check("crowded", now + 30, 0, chal));
+	printf("crowded challenge zeroed: %d\n",
+	       !memcmp(chal, zero, CHALLN_BYTESZ));
+	for (i = 0, kept = 0; i < AUTHTABPROBE; i++)
+		kept += tab[(h + i) % AUTHTABSLOTS].authat == now + 20;
+	printf("sessions kept: %d\n", kept);
+	printf("crowded allowed pending: %d\n",
+	       authtab_check("crowded", now + 30, 1, chal));
+
+	for (i = 0; i < PUBKEY_BYTESZ; i++) key[i] = i * 7;
+	if (!(kf = fopen(kfn, "w"))) err(1, "fopen %s", kfn);
+	fputs("not a key\n", kf);
+	tstkeyln(kf, key);
+	fclose(kf);
+	printf("key listed: %d\n", authkeys_has(kfn, key));
+
+	key[PUBKEY_BYTESZ-1] ^= 1;
+	printf("other key listed: %d\n", authkeys_has(kfn, key));
+	if (!(kf = fopen(kfn, "a"))) err(1, "fopen %s", kfn);
+	tstkeyln(kf, key);
+	fclose(kf);
+	printf("after adding it: %d\n", authkeys_has(kfn, key));
+
+	munmap(tab, TABSZ);
+	close(tabfd);
+	tab = 0;
+	tabfd = -1;
+	free(keyspath);
+	free(keys);
+	keyspath = 0;
+	keys = 0;
+	nkeys = 0;
+
+	unlink(fn);
+	unlink(kfn);
+	rmdir(dir);
+	free(fn);
+	free(kfn);
+}
@@ -0,0 +1,67 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef AUTHTAB_H
+#define AUTHTAB_H
+
+#include "tmconst"
+
+#include <stdint.h>
+#include <time.h>
+
+/* Table of authentication sessions, "authtab" under state_dir(), keyed by the
+ * session cookie. The spawner maps it before forking so each request handler
+ * uses it without opening anything. It is a hash table of AUTHTABSLOTS entries,
+ * and a cookie is kept in one of the AUTHTABPROBE entries after the one it
+ * hashes to. An entry whose authentication and challenge are both older than
+ * AUTH_EXPIRE_SECONDS is free, so nothing needs to remove expired sessions.
+ * When those entries are all in use, an authenticated session is never dropped
+ * to keep a challenge.
+ *
+ * Changes are made under a POSIX record lock on the whole file, which, unlike
+ * flock, is held by a process rather than by the open file it shares with the
+ * spawner. */
+#define AUTHTABSLOTS	4096
+#define AUTHTABPROBE	32
+
+struct authent {
+	char cook[32];
+
+	/* When the session was authenticated and when its challenge was made,
+	   in seconds since the Unix epoch, or zero if not. */
+	int64_t authat, chalat;
+
+	unsigned char chal[CHALLN_BYTESZ];
+};
+
+/* Maps the table at path for the calling process and any it forks later,
+ * creating it if needed. Does nothing if a table is already mapped. Returns 0 if
+ * there is no table. */
+int authtab_open(const char *path);
+
+/* Looks up the session with cookie cook at time now and returns whether it
+ * still needs to be authenticated. If it does, chal is set to its challenge,
+ * which is made if it has none, and is zeroed otherwise or if there is no room
+ * to keep one. If doallow is set, the
+ * session is authenticated first and its challenge, which has been used, is
+ * dropped. */
+int authtab_check(const char *cook, time_t now, int doallow,
+		  unsigned char *chal);
+
+/* Path to the file listing public keys allowed to authenticate, one per line as
+ * lowercase hex: $WERMAUTHKEYS or ~/.ssh/werm_authorized_keys */
+const char *authkeys_path(void);
+
+/* Reads the keys in the file at path if it changed since they were last read.
+ * Processes forked afterward get the keys read so far. */
+void authkeys_load(const char *path);
+
+/* Whether the file at path lists pubkey, which is PUBKEY_BYTESZ bytes. */
+int authkeys_has(const char *path, const void *pubkey);
+
+void test_authtab(void);
+
+#endif
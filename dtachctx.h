@@ -30,6 +30,14 @@ typedef struct dtach_ctx {
 
 	/* Indicates preamble has already been sent. */
 	unsigned sentpre	: 1;
+
+	/* Indicates the master is idle in the pool and waits to be claimed by a
+	   new session, which gives it a termid. */
+	unsigned pooled		: 1;
+
+	/* Escape sent by the attaching process to start receiving output, or
+	   null to send \\N. */
+	char *atchesc;
 } *Dtachctx;
 
 /* Prints attached client information as a Javascript value. It is an array of
@@ -38,4 +46,9 @@ typedef struct dtach_ctx {
    array. */
 void print_atch_clis(Dtachctx dc, struct fdbuf *b);
 
+/* Puts the endpoint IDs of the same clients in a session registry entry, which
+   the caller is changing. */
+struct sesent;
+void put_atch_clis(Dtachctx dc, struct sesent *e);
+
 #endif
@@ -4,13 +4,20 @@
  * license that can be found in the LICENSE file or at
  * https://developers.google.com/open-source/licenses/bsd */
 
+#include "authtab.h"
 #include "http.h"
 #include "outstreams.h"
 #include "shared.h"
 
 #include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
-#include <utime.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -22,18 +29,27 @@
 #include <openssl/err.h>
 #include <unistd.h>
 
-static char reqln[4096], *reqcr;
+/* The line being parsed, and how much of it is left after reqcr. Lines are
+   null-terminated in place in the connection buffer. */
+static char *reqln, *reqcr;
 static unsigned llen;
 
-static int readreqln(FILE *f)
+/* Next line of the request head ending at hdend, which is after a blank line,
+   or null once the blank line is reached. */
+static char *nextln, *hdend;
+
+static int readreqln(void)
 {
-	if (!fgets(reqln, sizeof(reqln), f)) return 0;
-	llen = strlen(reqln);
-	if (llen < 2) return 0;
+	char *e;
+
+	if (!nextln || nextln >= hdend) return 0;
+
+	e = memmem(nextln, hdend - nextln, "\r\n", 2);
+	*e = 0;
 
-	if (reqln[--llen] != '\n' || reqln[--llen] != '\r') return 0;
-	reqln[llen] = 0;
-	reqcr = reqln;
+	reqln = reqcr = nextln;
+	llen = e - nextln;
+	nextln = e + 2;
 
 	return 1;
 }
@@ -157,101 +173,29 @@ cleanup:
 	return !ers;
 }
 
-static int fixedread(int fh, unsigned bytes, unsigned char *dest)
-{
-	int redn;
-	for (;;) {
-		if (!bytes) return 1;
-
-		redn = read(fh, dest, bytes);
-		if (!redn) return 0;
-		if (redn > 0) { dest += redn; bytes -= redn; continue; }
-		if (errno == EINTR) continue;
-		perror("reading file");
-		return 0;
-	}
-}
-
+/* Sessions used to be kept as files with this prefix in state_dir(). */
 #define AUTH_PREF "auth."
 
 void authn_state(Httpreq *rq, int doallow)
 {
-	struct fdbuf normpat = {0};
-	struct stat stb;
+	char *path;
 	time_t now;
-	int chalh = -1, randh = -1, haschal = 0;
-	const char *sccr = rq->sescook;
 
 	rq->pendauth = 1;
+	memset(rq->chal, 0, CHALLN_BYTESZ);
 
-	fdb_apnd(&normpat, state_dir(), -1);
-	fdb_apnc(&normpat, '/');
-	fdb_apnd(&normpat, AUTH_PREF, -1);
-
-	for (;;) {
-		fdb_apnc(&normpat, *sccr == '/' ? '_' : *sccr);
-
-		/* Include null byte to terminate string */
-		if (!*sccr++) break;
-	}
+	xasprintf(&path, "%s/authtab", state_dir());
+	if (!authtab_open(path)) goto cleanup;
 
 	if (0 > time(&now)) {
 		perror("get current time");
 		goto cleanup;
 	}
 
-	if (0 > stat(cstr(&normpat), &stb)) {
-		if (errno != ENOENT) {
-			perror("stat authn file");
-			goto cleanup;
-		}
-	}
-	else
-		rq->pendauth = now - stb.st_mtime > AUTH_EXPIRE_SECONDS;
-
-	if (!rq->pendauth && !doallow) goto cleanup;
-
-	if (doallow) {
-		mknod(cstr(&normpat), S_IFREG | 0600, 0);
-		utime(cstr(&normpat), &(struct utimbuf){ now, now });
-	}
-
-	normpat.len--;
-	fdb_apnd(&normpat, ".chal", -1);
-
-	fprintf(stderr, "challenge file: %s allow? %d\n",
-		cstr(&normpat), doallow);
-	if (doallow) {
-		/* Challenge has already been used, so delete it so we make a
-		new one later. */
-		unlink(cstr(&normpat));
-		rq->pendauth = 0;
-		goto cleanup;
-	}
-
-	chalh = open(cstr(&normpat), O_RDONLY);
-	if (chalh >= 0) {
-		if (fixedread(chalh, CHALLN_BYTESZ, rq->chal)) {
-			haschal = 1;
-			goto cleanup;
-		}
-		close(chalh);
-	}
-
-	chalh = open(cstr(&normpat), O_TRUNC | O_WRONLY | O_CREAT, 0600);
-	if (chalh < 0) { perror("open chal file for writing"); goto cleanup; }
-	randh = open("/dev/random", O_RDONLY);
-
-	if (0>chalh || 0>randh || !fixedread(randh, CHALLN_BYTESZ, rq->chal))
-		goto cleanup;
-	haschal = 1;
-	full_write(&(struct wrides){chalh}, rq->chal, CHALLN_BYTESZ);
+	rq->pendauth = authtab_check(rq->sescook, now, doallow, rq->chal);
 
 cleanup:
-	if (chalh >= 0) close(chalh);
-	if (randh >= 0) close(randh);
-	if (!haschal) memset(rq->chal, 0, CHALLN_BYTESZ);
-	fdb_finsh(&normpat);
+	free(path);
 }
 
 int require_auth(void)
@@ -284,15 +228,146 @@ static int extractsescook(Httpreq *rq)
 	return 1;
 }
 
-void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
+void http_compact(struct httpconn *c)
+{
+	if (!c->off) return;
+
+	memmove(c->b, c->b + c->off, c->len - c->off);
+	c->len -= c->off;
+	c->off = 0;
+}
+
+/* Reads more of the connection into its buffer, first dropping what has been
+   handled. Returns 0 at EOF or on error. */
+static int fillconn(struct httpconn *c)
 {
-	char *rc, *qstart;
+	ssize_t redn;
+
+	http_compact(c);
+	if (c->len == sizeof(c->b)) return 0;
+
+	do redn = read(c->fd, c->b + c->len, sizeof(c->b) - c->len);
+	while (redn < 0 && errno == EINTR);
+
+	if (redn < 0) perror("read request");
+	if (redn <= 0) return 0;
+
+	c->len += redn;
+	return 1;
+}
+
+/* Admission slots shared by the spawner and the processes it forks. Each is
+   zero if free, or the time it was taken in the upper 32 bits and the pid that
+   took it in the lower. */
+static uint64_t *admslots;
+static uint64_t admheld, *admheldat;
+
+void admit_maint(void)
+{
+	static int tried;
+	void *m;
+
+	if (tried) return;
+	tried = 1;
+
+	m = mmap(0, sizeof(*admslots) * ADMITSLOTS, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) perror("mmap admission slots");
+	else admslots = m;
+}
+
+/* Whether the process in a taken slot no longer needs it. */
+static int admstale(uint64_t sl, time_t now)
+{
+	pid_t pid = sl & 0xffffffff;
+
+	if ((time_t)(sl >> 32) + ADMITSTALE <= now) return 1;
+	return kill(pid, 0) && errno == ESRCH;
+}
+
+/* Takes an admission slot for this process. Visible tabs take from the top
+   down, so the bottom ADMITHIDDEN, which are all hidden tabs may use, are the
+   last they fill. Returns 0 if none is free. Everything is admitted if the
+   slots are not mapped. */
+static int admit_take(int hidden)
+{
+	time_t now = time(0);
+	uint64_t cur, mine = (uint64_t)now << 32 | (uint32_t)getpid();
+	int i = hidden ? ADMITHIDDEN : ADMITSLOTS;
+
+	if (!admslots) return 1;
+	admit_done();
+
+	while (i--) {
+		cur = __atomic_load_n(admslots + i, __ATOMIC_ACQUIRE);
+		if (cur && !admstale(cur, now)) continue;
+		if (!__sync_bool_compare_and_swap(admslots + i, cur, mine))
+			continue;
+
+		admheld = mine;
+		admheldat = admslots + i;
+		return 1;
+	}
+
+	return 0;
+}
+
+void admit_done(void)
+{
+	if (!admheldat) return;
+
+	/* The slot may have been taken back as stale and be someone else's. */
+	__sync_bool_compare_and_swap(admheldat, admheld, 0);
+	admheldat = 0;
+}
+
+/* Whether the query has hidden=1, which the client adds while its tab is not
+   visible. */
+static int hiddentab(const char *q)
+{
+	while (q && *q) {
+		if (!strncmp(q, "hidden=1", 8) && (!q[8] || q[8] == '&'))
+			return 1;
+		q = strchrnul(q, '&');
+		if (*q) q++;
+	}
+	return 0;
+}
+
+int http_parse_req(struct httpconn *c, Httpreq *rq, struct wrides *respout)
+{
+	char *rc, *qstart, *head;
 	int connectionupgr = 0, goodwsver = 0, upgradews = 0, wsconds = -1;
 	struct fdbuf respbuf = {0};
+	unsigned skipn;
+
+	/* Skip the body of the last request, which no handler reads. */
+	skipn = c->len - c->off;
+	if (skipn > c->skip) skipn = c->skip;
+	c->off += skipn;
+	c->skip -= skipn;
+	if (c->skip) return 0;
+
+	head = c->b + c->off;
+	hdend = memmem(head, c->len - c->off, "\r\n\r\n", 4);
+	if (!hdend) {
+		if (c->off || c->len < sizeof(c->b)) return 0;
+
+		/* The head does not fit, so will not be read. */
+		nextln = 0;
+		c->off = c->len;
+		goto badreq;
+	}
+	hdend += 2;
+	nextln = head;
+	c->off = hdend + 2 - c->b;
+
+	/* A key is only accepted for the request that sent it. */
+	*acceptwskey = 0;
 
 	if (require_auth()) rq->pendauth = 1;
 
-	if (!readreqln(src)) goto badreq;
+	if (!readreqln()) goto badreq;
 
 	if	(	consumereqln("POST "))		rq->rqtype = 'P';
 	else if	(	consumereqln("GET "))		rq->rqtype = 'G';
@@ -312,19 +387,14 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
 
 	qstart = strchr(reqcr, '?');
 	if (!qstart)
-		qstart = reqcr + llen;
+		rq->query = reqcr + llen;
 	else {
 		*qstart = 0;
-		strncpy(rq->query, qstart+1, sizeof(rq->query));
+		rq->query = qstart + 1;
 	}
+	rq->resource = reqcr;
 
-	if (qstart - reqcr > sizeof(rq->resource) - 1) goto badreq;
-	strcpy(rq->resource, reqcr);
-
-	for (;;) {
-		readreqln(src);
-		if (!llen) break;
-
+	while (readreqln()) {
 		for (rc = reqln; *rc && *rc != ':'; rc++) lcase(rc);
 
 		if (consumereqln("sec-fetch-site:")) {
@@ -348,6 +418,10 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
 			if (hastok("13")) goodwsver = 1;
 			continue;
 		}
+		if (consumereqln("content-length:")) {
+			c->skip = strtoul(reqcr, 0, 10);
+			continue;
+		}
 		if (consumereqln("sec-websocket-key:")) {
 			if (!procwskeyhdr(reqcr, respout)) goto seterr;
 			continue;
@@ -370,6 +444,13 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
 	if (rq->rqtype != 'G')	goto methoderr;
 	if (rq->pendauth) { resp_dynamc(respout, 't', 401, 0, 0); goto seterr; }
 
+	/* Refuse quickly rather than queue when many clients reconnect at
+	   once. */
+	if (!admit_take(hiddentab(rq->query))) {
+		resp_dynamc(respout, 't', 503, "too many connecting\n", 20);
+		goto seterr;
+	}
+
 	rq->validws = 1;
 	fdb_apnd(&respbuf,	"HTTP/1.1 101 Switching Protocols\r\n"
 				"Upgrade: websocket\r\n"
@@ -397,6 +478,21 @@ seterr:
 
 cleanup:
 	fdb_finsh(&respbuf);
+	return 1;
+}
+
+void http_read_req(struct httpconn *c, Httpreq *rq, struct wrides *respout)
+{
+	while (!http_parse_req(c, rq, respout)) {
+		if (fillconn(c)) continue;
+
+		/* A connection closed between requests is not an error to
+		   report. */
+		if (c->len > c->off && !c->skip)
+			resp_dynamc(respout, 't', 400, 0, 0);
+		rq->error = 1;
+		return;
+	}
 }
 
 static void dumpreq(Httpreq *rq)
@@ -409,18 +505,29 @@ static void dumpreq(Httpreq *rq)
 	       rq->restrictfetchsite, rq->validws, rq->rqtype);
 }
 
-static void resettmpfile(FILE **f)
+/* Appends s to what the connection has received. */
+static void tstfeed(struct httpconn *c, const char *s)
 {
-	if (*f) {
-		if (ferror(*f)) { perror("test temp file"); exit(1); }
-		fclose(*f);
-	}
-	*f = tmpfile();
+	size_t sz = strlen(s);
+
+	http_compact(c);
+	if (sz > sizeof(c->b) - c->len) abort();
+	memcpy(c->b + c->len, s, sz);
+	c->len += sz;
 }
 
-void resp_dynamc(struct wrides *de, char hdr, int code, void *p, size_t sz)
+static void tstparse(struct httpconn *c, struct wrides *de)
+{
+	Httpreq rq = {0};
+
+	if (!http_parse_req(c, &rq, de)) { puts("needs more"); return; }
+	dumpreq(&rq);
+}
+
+/* Appends the status line and headers that do not depend on how the body is
+   sent. */
+static void resphdr(struct fdbuf *b, char hdr, int code)
 {
-	struct fdbuf b = {de, 512};
 	const char *codest, *contype;
 	int utf8, xfdeny;
 
@@ -433,6 +540,7 @@ void resp_dynamc(struct wrides *de, char hdr, int code, void *p, size_t sz)
 	break;	case 404: xfdeny=0; codest="404 Not Found";
 	break;	case 405: xfdeny=0; codest="405 Method Not Allowed";
 	break;	case 500: xfdeny=0; codest="500 Internal Server Error";
+	break;	case 503: xfdeny=0; codest="503 Service Unavailable";
 	}
 
 	switch (hdr) {
@@ -442,18 +550,33 @@ void resp_dynamc(struct wrides *de, char hdr, int code, void *p, size_t sz)
 	break;	case 'c': utf8=1; contype="text/css";
 	break;	case 'j': utf8=1; contype="application/javascript";
 	break;	case 'f': utf8=0; contype="application/x-wermfont";
+	break;	case 'b': utf8=0; contype="application/octet-stream";
+	break;	case 'e': utf8=1; contype="text/event-stream";
 	}
 
-	fdb_apnd(&b, "HTTP/1.1 ", -1);
-	fdb_apnd(&b, codest, -1);
-	fdb_apnd(&b, "\r\n", 2);
-	if (xfdeny) fdb_apnd(&b, "X-Frame-Options: DENY\r\n", -1);
+	fdb_apnd(b, "HTTP/1.1 ", -1);
+	fdb_apnd(b, codest, -1);
+	fdb_apnd(b, "\r\n", 2);
+	if (xfdeny) fdb_apnd(b, "X-Frame-Options: DENY\r\n", -1);
+
+	fdb_apnd(b, "Connection: keep-alive\r\n", -1);
+	fdb_apnd(b, "Content-Type: ", -1);
+	fdb_apnd(b, contype, -1);
+	if (utf8) fdb_apnd(b, "; charset=utf-8", -1);
+	fdb_apnd(b, "\r\n", -1);
+	if (hdr == 'e') fdb_apnd(b, "Cache-Control: no-cache\r\n", -1);
+	if (code == 503) {
+		fdb_apnd(b, "Retry-After: ", -1);
+		fdb_itoa(b, ADMITRETRY);
+		fdb_apnd(b, "\r\n", -1);
+	}
+}
 
-	fdb_apnd(&b, "Connection: keep-alive\r\n", -1);
-	fdb_apnd(&b, "Content-Type: ", -1);
-	fdb_apnd(&b, contype, -1);
-	if (utf8) fdb_apnd(&b, "; charset=utf-8", -1);
-	fdb_apnd(&b, "\r\n", -1);
+void resp_dynamc(struct wrides *de, char hdr, int code, void *p, size_t sz)
+{
+	struct fdbuf b = {de, 512};
+
+	resphdr(&b, hdr, code);
 	fdb_apnd(&b, "Content-Length: ", -1);
 	fdb_itoa(&b, sz);
 	fdb_apnd(&b, "\r\n\r\n", -1);
@@ -462,21 +585,34 @@ void resp_dynamc(struct wrides *de, char hdr, int code, void *p, size_t sz)
 	full_write(de, p, sz);
 }
 
-void auth_maint(void)
+void resp_chunkd(struct wrides *de, char hdr, int code)
+{
+	struct fdbuf b = {de, 512};
+
+	resphdr(&b, hdr, code);
+	fdb_apnd(&b, "Transfer-Encoding: chunked\r\n\r\n", -1);
+	fdb_finsh(&b);
+}
+
+void resp_chunk(struct wrides *de, const void *p, size_t sz)
+{
+	char szln[32];
+
+	/* A zero-length chunk would end the response early. */
+	if (!sz && p) return;
+
+	snprintf(szln, sizeof(szln), "%zx\r\n", sz);
+	full_write(de, szln, -1);
+	full_write(de, p, sz);
+	full_write(de, "\r\n", 2);
+}
+
+/* Removes the files sessions were kept in before the auth table. */
+static void rmauthfiles(void)
 {
-	static int inter;
 	struct fdbuf flpa = {0};
 	DIR *d = 0;
 	struct dirent *e;
-	struct stat sb;
-	time_t now;
-
-	if (inter++ & 0x1ff) return;
-
-	if (0 > time(&now)) {
-		perror("get current time");
-		goto cleanup;
-	}
 
 	d = opendir(state_dir());
 	if (!d) {
@@ -497,109 +633,202 @@ void auth_maint(void)
 		fdb_apnc(&flpa, '/');
 		fdb_apnd(&flpa, e->d_name, -1);
 
-		if (0 > stat(cstr(&flpa), &sb)) {
-			perror("stat an auth file");
-			goto ferr;
-			continue;
-		}
-		if (now - sb.st_mtime <= AUTH_EXPIRE_SECONDS) continue;
-
 		if (0 > unlink(cstr(&flpa))) {
-			perror("unlink stale auth file");
-			goto ferr;
+			perror("unlink old auth file");
+			fprintf(stderr, "\tpath: %s\n", cstr(&flpa));
 		}
-
-		continue;
-
-	ferr:	fprintf(stderr, "\tpath: %s\n", cstr(&flpa));
 	}
 
 	if (errno) perror("readdir on state_dir");
 
-cleanup:
 	fdb_finsh(&flpa);
 	if (0 > closedir(d)) perror("close state_dir");
 }
 
+void auth_maint(void)
+{
+	static int started;
+	char *path;
+
+	if (!started) {
+		started = 1;
+		rmauthfiles();
+	}
+
+	if (!require_auth()) return;
+
+	/* Map the table and read the keys here so children have them. */
+	xasprintf(&path, "%s/authtab", state_dir());
+	authtab_open(path);
+	free(path);
+
+	authkeys_load(authkeys_path());
+}
+
+/* Attaches to a master that reads the attach request and sends nothing, as one
+   resuming a client that missed no output. */
+static void tstidleatch(void)
+{
+	struct dtach_ctx dc = {0};
+	struct sockaddr_un sa = {AF_UNIX};
+	char dir[] = "/tmp/werm.idleatch.XXXXXX", esc[64] = {0};
+	int ls, s, ms;
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/sock", dir);
+	ls = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ls < 0 || bind(ls, (void *)&sa, sizeof(sa)) || listen(ls, 1))
+		err(1, "listen %s", sa.sun_path);
+
+	dc.sockpath = sa.sun_path;
+	dc.atchesc = "\\R00000000000000010000000000000000";
+	s = attach_connect(&dc);
+	if (s < 0) err(1, "attach_connect");
+
+	ms = accept(ls, 0, 0);
+	if (ms < 0 || read(ms, esc, sizeof(esc) - 1) < 0) err(1, "accept");
+	printf("master has: %s\n", esc);
+
+	close(ms);
+	close(s);
+	close(ls);
+	unlink(sa.sun_path);
+	rmdir(dir);
+}
+
 void test_http(void)
 {
 	struct wrides de = {1, "httpresp"};
-	FILE *src = tmpfile();
-	Httpreq rq;
+	static struct httpconn c = {-1};
 
 	puts("TRIVIAL RESOURCE AND BLANK QUERY");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\n", src);
-	fputs("\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\n");
+	tstfeed(&c, "\r\n");
+	tstparse(&c, &de);
 
 	puts("INTERESTING PATH+QUERY");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET /asdf?xyz=a%3fb%20c HTTP/1.1\r\n", src);
-	fputs("\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET /asdf?xyz=a%3fb%20c HTTP/1.1\r\n");
+	tstfeed(&c, "\r\n");
+	tstparse(&c, &de);
 
 	puts("TEST ACCEPT-KEY CALCULATION");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nUser-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36 Edg/120.0.0.0\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nAccept-Encoding: gzip, deflate, br\r\nAccept-Language: en-US,en;q=0.9,ja;q=0.8,zh-TW;q=0.7,zh;q=0.6\r\nSec-WebSocket-Key: WTh9rpWlwlBcMRUQqbXuFg==\r\nSec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nUser-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36 Edg/120.0.0.0\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nAccept-Encoding: gzip, deflate, br\r\nAccept-Language: en-US,en;q=0.9,ja;q=0.8,zh-TW;q=0.7,zh;q=0.6\r\nSec-WebSocket-Key: WTh9rpWlwlBcMRUQqbXuFg==\r\nSec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n\r\n");
+	tstparse(&c, &de);
 
 	puts("TEST ACCEPT-KEY AGAIN");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: j/26SYgMGzb8gVdanOs/2A==\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: j/26SYgMGzb8gVdanOs/2A==\r\n\r\n");
+	tstparse(&c, &de);
 
 	puts("EXAMPLE FROM RFC-6455");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n");
+	tstparse(&c, &de);
 
 	puts("UNSUPPORTED METHOD POST");
-	memset(&rq, 0, sizeof(rq));
-	fputs("POST /?termid=x.y HTTP/1.1\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "POST /?termid=x.y HTTP/1.1\r\n\r\n");
+	tstparse(&c, &de);
 
 	puts("WEBSOCKET UPGRADE: KEY TOO SHORT");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25j\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25j\r\n\r\n");
+	tstparse(&c, &de);
 
 	puts("WEBSOCKET UPGRADE: INVALID VERSION");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 14\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 14\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n");
+	tstparse(&c, &de);
 
 	puts("WEBSOCKET UPGRADE: INVALID CONNECTION HDR");
-	memset(&rq, 0, sizeof(rq));
-	fputs("GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Oopgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: j/26SYgMGzb8gVdanOs/2A==\r\n\r\n", src);
-	fseek(src, 0, SEEK_SET);
-	http_read_req(src, &rq, &de);
-	dumpreq(&rq);
-	resettmpfile(&src);
+	tstfeed(&c, "GET / HTTP/1.1\r\nHost: localhost:8090\r\nConnection: Oopgrade\r\nUpgrade: websocket\r\nOrigin: http://localhost:8090\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: j/26SYgMGzb8gVdanOs/2A==\r\n\r\n");
+	tstparse(&c, &de);
+
+	puts("PIPELINED REQUESTS");
+	tstfeed(&c, "GET /a HTTP/1.1\r\n\r\nHEAD /b?c HTTP/1.1\r\n\r\nGET /c");
+	tstparse(&c, &de);
+	tstparse(&c, &de);
+	tstparse(&c, &de);
+	tstfeed(&c, " HTTP/1.1\r\n\r");
+	tstparse(&c, &de);
+	tstfeed(&c, "\n");
+	tstparse(&c, &de);
+
+	puts("BODY SKIPPED");
+	tstfeed(&c, "POST /p HTTP/1.1\r\nContent-Length: 9\r\n\r\nbody");
+	tstparse(&c, &de);
+	tstparse(&c, &de);
+	tstfeed(&c, " textGET /after HTTP/1.1\r\n\r\n");
+	tstparse(&c, &de);
+
+	puts("BYTES LEFT AFTER UPGRADE");
+	tstfeed(&c, "GET / HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\nframe");
+	tstparse(&c, &de);
+	printf("left: %.*s\n", (int)(c.len - c.off), c.b + c.off);
+	c.off = c.len;
+
+	puts("HEAD TOO LARGE");
+	http_compact(&c);
+	memset(c.b, 'x', sizeof(c.b));
+	c.len = sizeof(c.b);
+	tstparse(&c, &de);
+	printf("left: %u\n", c.len - c.off);
+
+	puts("ADMISSION");
+	{
+		static uint64_t slots[ADMITSLOTS];
+		const char *upg = "Connection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		/* pid 1 never exits, so only age frees these. */
+		uint64_t busy = (uint64_t)time(0) << 32 | 1;
+		int i;
+
+		admslots = slots;
+		for (i = 0; i < ADMITSLOTS - 1; i++) slots[i] = busy;
+
+		puts("hidden tab, only upper slot free:");
+		tstfeed(&c, "GET /?hidden=1 HTTP/1.1\r\n");
+		tstfeed(&c, upg);
+		tstparse(&c, &de);
+		c.off = c.len;
+
+		puts("visible tab takes it:");
+		tstfeed(&c, "GET /?hidden=10&x=hidden=1 HTTP/1.1\r\n");
+		tstfeed(&c, upg);
+		tstparse(&c, &de);
+		c.off = c.len;
+		printf("taken by self: %d\n",
+		       (pid_t)slots[ADMITSLOTS - 1] == getpid());
+
+		puts("released, then taken by another, and all are taken:");
+		admit_done();
+		printf("freed: %d\n", !slots[ADMITSLOTS - 1]);
+		slots[ADMITSLOTS - 1] = busy;
+		tstfeed(&c, "GET /?termid=a HTTP/1.1\r\n");
+		tstfeed(&c, upg);
+		tstparse(&c, &de);
+		c.off = c.len;
+
+		puts("stale slot reused by hidden tab:");
+		slots[0] = (uint64_t)(time(0) - ADMITSTALE) << 32 | 1;
+		tstfeed(&c, "GET /?a=b&hidden=1 HTTP/1.1\r\n");
+		tstfeed(&c, upg);
+		tstparse(&c, &de);
+		c.off = c.len;
+		printf("taken by self: %d\n", (pid_t)slots[0] == getpid());
+		admit_done();
+		printf("freed: %d\n", !slots[0]);
+
+		puts("attaching to a session that sends nothing frees it:");
+		tstfeed(&c, "GET /?termid=a&resume=1.0 HTTP/1.1\r\n");
+		tstfeed(&c, upg);
+		tstparse(&c, &de);
+		c.off = c.len;
+		printf("taken by self: %d\n", (pid_t)slots[0] == getpid());
+		tstidleatch();
+		printf("freed: %d\n", !slots[0]);
+
+		admslots = 0;
+	}
 
-	fclose(src);
+	puts("CHUNKED RESPONSE");
+	resp_chunkd(&de, 't', 200);
+	resp_chunk(&de, "first\n", 6);
+	resp_chunk(&de, "", 0);
+	resp_chunk(&de, "0123456789abcdefg", 17);
+	resp_chunk(&de, 0, 0);
 }
@@ -13,8 +13,28 @@
 #define B64LEN(byts) (((byts) + 2) / 3 * 4)
 #define SHA1SZ 20
 
+/* Bytes of a connection that have been read but not yet handled. A request head
+   must fit in b to be parsed. */
+#define HTTPCONNSZ 8192
+
+struct httpconn {
+	/* Where the connection is read from. */
+	int fd;
+
+	/* b[off] through b[len-1] have not been handled. skip is how much of
+	   the body of the last request is yet to be dropped. */
+	unsigned len, off, skip;
+
+	char b[HTTPCONNSZ];
+};
+
 typedef struct {
-	char resource[32], query[2048], sescook[32];
+	/* Path and query, without the '?', of the request line. These point
+	   into the httpconn buffer and are valid until it is next filled or
+	   compacted. */
+	char *resource, *query;
+
+	char sescook[32];
 
 	unsigned char chal[CHALLN_BYTESZ];
 
@@ -40,9 +60,22 @@ typedef struct {
 	unsigned pendauth : 1;
 } Httpreq;
 
-/* Process request header from |src|.
+/* Parses the request head at the start of what c has received, in place, and
+   consumes it. The body of the previous request, whose length was in its
+   Content-Length header, is dropped first. Returns 0 without changing rq if the
+   head has not been fully received, and 1 otherwise.
    respout - where HTTP errors and websocket upgrade responses are printed */
-void http_read_req(FILE *src, Httpreq *rq, struct wrides *errresp);
+int http_parse_req(struct httpconn *c, Httpreq *rq, struct wrides *respout);
+
+/* Reads from c->fd until a request head can be parsed with http_parse_req.
+   Sets rq->error if the connection closes first, and only reports this to
+   respout if part of a request was received. Bytes after the head, such as
+   the next pipelined request or websocket frames sent after an upgrade, are
+   left in c. */
+void http_read_req(struct httpconn *c, Httpreq *rq, struct wrides *respout);
+
+/* Moves the bytes in c that have not been handled to the start of its buffer. */
+void http_compact(struct httpconn *c);
 
 /* resp_dynamc writes an http response to fd from a block of memory with the
    given status code.
@@ -52,9 +85,20 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *errresp);
 	h - html
 	c - css
 	j - js
-	f - ttf */
+	f - ttf
+	b - binary data
+	e - server-sent events, which are sent with resp_chunkd */
 void resp_dynamc(struct wrides *de, char hdr, int code, void *b, size_t sz);
 
+/* Writes the header of a response whose body is sent in pieces with
+   resp_chunk, for when its length is not known up front. hdr and code are as
+   for resp_dynamc. */
+void resp_chunkd(struct wrides *de, char hdr, int code);
+
+/* Sends sz bytes of a response started with resp_chunkd. If b is null, ends the
+   response. */
+void resp_chunk(struct wrides *de, const void *b, size_t sz);
+
 /* Exercises http functionality and writes test output to stdout, to be compared
    with golden test data. */
 void test_http(void);
@@ -67,6 +111,27 @@ of the session ID'd by rq->sesshdr. If doallow is true, then it clears
 rq->pendauth and rq->chal, if they are set, and updates authn state. */
 void authn_state(Httpreq *rq, int doallow);
 
-/* Removes old authentication files. Should be called periodically to delete
-accumulating auth files. */
+/* At most ADMITSLOTS websocket upgrades are let in at once, each from when its
+   101 response is written until its session master has the attach request, so
+   a storm of reconnects is answered at once with 503 and Retry-After:
+   ADMITRETRY rather than left to queue on the spawner and session masters.
+   Clients that say their tab is hidden with hidden=1 in the query may use only
+   ADMITHIDDEN of the slots, which keeps the rest for visible tabs. A slot held
+   longer than ADMITSTALE seconds, or by a process that has exited, is free
+   again. */
+#define ADMITSLOTS	8
+#define ADMITHIDDEN	4
+#define ADMITSTALE	10
+#define ADMITRETRY	2
+
+/* Maps the admission slots so processes forked later share them. Until this
+   is called, every upgrade is admitted. Should be called by the spawner before
+   accepting. */
+void admit_maint(void);
+
+/* Frees the admission slot taken by this process, if any. */
+void admit_done(void);
+
+/* Maps the authentication table and rereads the authorized keys if they
+changed, so processes forked later have them. Should be called periodically. */
 void auth_maint(void);
@@ -5,120 +5,470 @@
  * https://developers.google.com/open-source/licenses/bsd */
 
 #include "inbound.h"
-#include <arpa/inet.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-static unsigned char buf[512];
-static unsigned bfi, bfsz;
-static unsigned char pongmsg[2] = {0x8a, 0x00};
+/* The buffer starts at INBMIN bytes and doubles each time a read fills it, up
+   to INBMAX, so a large paste is read in few syscalls while typing keeps a
+   small buffer. */
+#define INBMIN	4096
+#define INBMAX	(1 << 20)
 
-static void mkeaval(int c)
+/* Most payload pieces forwarded to the master with one writev. */
+#define INBIOV	64
+
+static unsigned char *buf;
+static unsigned bfi, bfsz, bfcap;
+
+/* Set if inbound_prime added bytes that have not been decoded. */
+static int primed;
+
+/* Where pong and close frames are written. */
+static struct wrides resp = {1};
+
+/* Counts of reads from stdin and writes to the master, for inbound_bench. */
+static unsigned nreads, nwrits;
+
+/* The frame whose payload is being read. */
+static struct {
+	/* Set once the header is read. */
+	int inframe;
+
+	/* Opcode, without the FIN and reserved bits, and whether FIN was set. */
+	unsigned char op, fin;
+
+	/* Payload bytes not yet read, and the index in mask of the key byte for
+	   the next one. */
+	uint64_t left;
+	unsigned char mask[4];
+	unsigned maskof;
+
+	/* Payload of a control frame, which is at most 125 bytes and is
+	   collected here as it may be split between reads. */
+	unsigned char ctl[125];
+	unsigned ctllen;
+} fr;
+
+/* The data message being received, for inbound_msgs. */
+static struct fdbuf msg;
+
+static void growbuf(unsigned want)
 {
-	ssize_t redn;
-	unsigned bleft = bfsz - bfi;
+	if (bfcap >= want) return;
 
-	if (c > sizeof(buf)) abort();
+	if (!bfcap) bfcap = INBMIN;
+	while (bfcap < want) bfcap *= 2;
 
-	if (bleft >= c) return;
+	buf = realloc(buf, bfcap);
+	if (!buf) { perror("realloc inbound buffer"); exit(1); }
+}
 
-	bfsz = bleft;
-	memmove(buf, buf+bfi, bfsz);
+/* Reads more of stdin after the bytes not yet decoded. Returns 0 at EOF or on
+   error. */
+static int fillbuf(void)
+{
+	ssize_t redn;
+
+	growbuf(INBMIN);
+
+	bfsz -= bfi;
+	memmove(buf, buf + bfi, bfsz);
 	bfi = 0;
 
-	do {
-		redn=read(0, buf + bfsz, sizeof(buf) - bfsz);
-		if (0 > redn) {
-			if (errno == EAGAIN) continue;
-			perror("read stdin mid-frame");
-			abort();
-		}
-		if (!redn) abort();
-		bfsz += redn;
+	redn = read(0, buf + bfsz, bfcap - bfsz);
+	nreads++;
+	if (redn < 0) {
+		if (errno == EINTR || errno == EAGAIN) return 1;
+		perror("read websocket frames");
+		return 0;
 	}
-	while (bfsz < c);
+	if (!redn) return 0;
+
+	bfsz += redn;
+	if (bfsz == bfcap && bfcap < INBMAX) growbuf(bfcap * 2);
+
+	return 1;
 }
 
-static unsigned char *forceinby(int c)
+/* XORs the n bytes at p with the key, starting at key byte fr.maskof. Works on
+   eight bytes at a time, for which the key is repeated twice. */
+static void unmask(unsigned char *p, size_t n)
 {
-	mkeaval(c);
-	bfi += c;
-	return buf + bfi - c;
+	unsigned char rot[8];
+	uint64_t key, w0, w1;
+	size_t i;
+
+	for (i = 0; i < 8; i++) rot[i] = fr.mask[(fr.maskof + i) & 3];
+	memcpy(&key, rot, 8);
+	fr.maskof = (fr.maskof + n) & 3;
+
+	for (; n >= 16; p += 16, n -= 16) {
+		memcpy(&w0, p, 8);
+		memcpy(&w1, p + 8, 8);
+		w0 ^= key;
+		w1 ^= key;
+		memcpy(p, &w0, 8);
+		memcpy(p + 8, &w1, 8);
+	}
+	if (n >= 8) {
+		memcpy(&w0, p, 8);
+		w0 ^= key;
+		memcpy(p, &w0, 8);
+		p += 8;
+		n -= 8;
+	}
+	for (i = 0; i < n; i++) p[i] ^= rot[i];
 }
 
-void fwrd_inbound_frames(int sock)
+/* Writes the n buffers in v to sock. Returns 0 on error. */
+static int writevall(int sock, struct iovec *v, int n)
 {
-	unsigned char mask[4];
-	uint64_t datalen;
-	uint32_t datalen32;
-	uint16_t datalen16;
-	int unmaski, datpart, unmaskof;
-	unsigned char *bfc;
+	ssize_t writn;
+
+	while (n) {
+		writn = writev(sock, v, n);
+		nwrits++;
+		if (writn < 0 && errno == EINTR) continue;
+		if (writn <= 0) {
+			perror("write websocket data to master");
+			return 0;
+		}
 
-	if (bfi != bfsz) abort();
+		while (n && writn >= v->iov_len) {
+			writn -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n) {
+			v->iov_base = (char *)v->iov_base + writn;
+			v->iov_len -= writn;
+		}
+	}
 
-	do {
-		bfc = forceinby(1);
+	return 1;
+}
 
-		/* We don't care whether continuation or FIN */
-		*bfc &= 0x7f;
+/* Reads a frame header at bfi if all of it has been received. Returns 0 if it
+   has not, 1 if it was read, and -1 if it is invalid. */
+static int readhdr(void)
+{
+	unsigned char *h = buf + bfi;
+	unsigned avail = bfsz - bfi, hsz, i;
 
-		switch (*bfc) {
-		default: break; /* close, pong, or reserved code */
-		case 0: case 1: case 2:
-			/* data */
+	if (avail < 2) return 0;
 
-			/* Payload len */
-			bfc = forceinby(1);
-			datalen = *bfc & 0x7f;
+	fr.left = h[1] & 0x7f;
+	hsz = 2 + (fr.left == 126 ? 2 : fr.left == 127 ? 8 : 0);
+	if (avail < hsz + 4) return 0;
 
-			/* Should always send mask */
-			if (!(*bfc & 0x80)) abort();
+	fr.op = h[0] & 0x0f;
+	fr.fin = !!(h[0] & 0x80);
+	if (fr.left >= 126) {
+		fr.left = 0;
+		for (i = 2; i < hsz; i++) fr.left = fr.left << 8 | h[i];
+	}
 
-			/* Client should not send large frames that require
-			 * extended payload length. */
-			if (datalen == 126) {
-				memcpy(&datalen16, forceinby(2), 2);
+	/* Clients must mask frames, and control frames are short. */
+	if (!(h[1] & 0x80)) {
+		fputs("unmasked websocket frame\n", stderr);
+		return -1;
+	}
+	if (fr.op >= 8 && fr.left > sizeof(fr.ctl)) {
+		fputs("websocket control frame too long\n", stderr);
+		return -1;
+	}
 
-				datalen = ntohs(datalen16);
-			}
-			else if (datalen == 127) {
-				memcpy(&datalen32, forceinby(4), 4);
-				datalen = ntohl(datalen32);
-				datalen <<= 32;
+	memcpy(fr.mask, h + hsz, 4);
+	fr.maskof = 0;
+	fr.ctllen = 0;
+	fr.inframe = 1;
+	bfi += hsz + 4;
 
-				memcpy(&datalen32, forceinby(4), 4);
-				datalen |= ntohl(datalen32);
-			}
+	return 1;
+}
 
-			/* Read the mask */
-			memcpy(mask, forceinby(4), 4);
+/* Responds to the control frame just read. Returns 0 if it closes the
+   websocket. */
+static int control(void)
+{
+	unsigned char rh[2] = {0x80 | fr.op, 0};
 
-			unmaskof = 0;
-			while (datalen) {
-				datpart = sizeof(buf);
-				if (datpart > datalen) datpart = datalen;
+	switch (fr.op) {
+	default: return 1; /* pong or reserved code */
+	case 8:
+		/* Echo the status code, if any, as the close response. */
+		if (fr.ctllen >= 2) rh[1] = 2;
+		full_write(&resp, rh, 2);
+		full_write(&resp, fr.ctl, rh[1]);
+		return 0;
+	case 9:
+		/* pinged, so respond with pong and the same data */
+		rh[0] = 0x8a;
+		rh[1] = fr.ctllen;
+		full_write(&resp, rh, 2);
+		full_write(&resp, fr.ctl, fr.ctllen);
+		return 1;
+	}
+}
 
-				bfc = forceinby(datpart);
-				for (unmaski = 0; unmaski < datpart; unmaski++) {
-					bfc[unmaski] ^= mask[unmaskof++];
-					unmaskof &= 3;
-				}
+/* Decodes the frames in the buffer, as far as they have been received, and
+   forwards data payloads to sock, or if onmsg is set, passes each complete
+   data message to it. Returns 0 if the websocket is closed or broken. */
+static int decode(int sock, void (*onmsg)(unsigned char *, size_t))
+{
+	struct iovec v[INBIOV];
+	int nv = 0, open = 1, hs;
+	unsigned take;
+
+	while (open && bfi < bfsz) {
+		if (!fr.inframe) {
+			hs = readhdr();
+			if (!hs) break;
+			if (hs < 0) { open = 0; break; }
+		}
 
-				full_write(&(struct wrides){sock}, bfc, datpart);
+		take = bfsz - bfi;
+		if (take > fr.left) take = fr.left;
+		unmask(buf + bfi, take);
 
-				datalen -= datpart;
+		/* Data frames and their continuations are all forwarded as
+		   they are, without regard to the fragment boundaries. */
+		if (fr.op >= 8) {
+			memcpy(fr.ctl + fr.ctllen, buf + bfi, take);
+			fr.ctllen += take;
+		}
+		else if (fr.op <= 2 && onmsg)
+			fdb_apnd(&msg, buf + bfi, take);
+		else if (fr.op <= 2 && take) {
+			if (nv == INBIOV) {
+				if (!writevall(sock, v, nv)) return 0;
+				nv = 0;
 			}
-		break;
-		case 9:
-			/* pinged, so respond with pong */
-			full_write(&(struct wrides){1},
-				   pongmsg, sizeof(pongmsg));
-		break;
+			v[nv].iov_base = buf + bfi;
+			v[nv++].iov_len = take;
+		}
+
+		bfi += take;
+		fr.left -= take;
+
+		if (fr.left) break;
+		fr.inframe = 0;
+		if (fr.op >= 8) open = control();
+		else if (fr.fin && onmsg) {
+			onmsg(msg.bf, msg.len);
+			msg.len = 0;
 		}
 	}
-	while (bfi < bfsz);
+
+	if (!writevall(sock, v, nv)) return 0;
+	return open;
+}
+
+void inbound_prime(const void *b, size_t sz)
+{
+	if (sz > INBMAX - bfsz) {
+		fputs("too many bytes sent before websocket upgrade\n", stderr);
+		exit(1);
+	}
+
+	growbuf(bfsz + sz);
+	memcpy(buf + bfsz, b, sz);
+	bfsz += sz;
+	primed = 1;
+}
+
+int inbound_pending(void)
+{
+	return primed;
+}
+
+int fwrd_inbound_frames(int sock)
+{
+	if (!primed && !fillbuf()) return 0;
+	primed = 0;
+
+	return decode(sock, 0);
+}
+
+int inbound_msgs(void (*onmsg)(unsigned char *m, size_t sz))
+{
+	if (!primed && !fillbuf()) return 0;
+	primed = 0;
+
+	return decode(-1, onmsg);
+}
+
+/* Appends a masked frame with opcode op and payload p of n bytes to b. */
+static size_t mkframe(unsigned char *b, int op, const void *p, size_t n)
+{
+	static const unsigned char key[4] = {0x37, 0xfa, 0x21, 0x3d};
+	size_t hsz = 2, i;
+
+	b[0] = op;
+	if (n < 126)
+		b[1] = 0x80 | n;
+	else if (n < 0x10000) {
+		b[1] = 0x80 | 126;
+		b[hsz++] = n >> 8;
+		b[hsz++] = n;
+	}
+	else {
+		b[1] = 0x80 | 127;
+		for (i = 8; i--;) b[hsz++] = (uint64_t)n >> i*8;
+	}
+
+	memcpy(b + hsz, key, 4);
+	hsz += 4;
+	for (i = 0; i < n; i++) b[hsz + i] = ((unsigned char *)p)[i] ^ key[i&3];
+
+	return hsz + n;
+}
+
+/* Runs fwrd_inbound_frames on the sz bytes at in, sent over a pipe, until it
+   returns 0, forwarding data to fd sock. Returns the number of calls. */
+static unsigned runpiped(const unsigned char *in, size_t sz, int sock)
+{
+	int p[2], stdinfd;
+	unsigned calls = 0;
+	pid_t cpid;
+
+	if (pipe(p)) { perror("pipe"); exit(1); }
+	if (0 > (cpid = fork())) { perror("fork"); exit(1); }
+	if (!cpid) {
+		close(p[0]);
+		full_write(&(struct wrides){p[1]}, in, sz);
+		_exit(0);
+	}
+
+	close(p[1]);
+	stdinfd = dup(0);
+	dup2(p[0], 0);
+	close(p[0]);
+
+	while (fwrd_inbound_frames(sock)) calls++;
+
+	dup2(stdinfd, 0);
+	close(stdinfd);
+	waitpid(cpid, 0, 0);
+
+	free(buf);
+	buf = 0;
+	bfi = bfsz = bfcap = 0;
+	memset(&fr, 0, sizeof(fr));
+
+	return calls;
+}
+
+static void tstmsg(unsigned char *m, size_t sz)
+{
+	printf("message: %.*s\n", (int)sz, (char *)m);
+}
+
+void test_inbound(void)
+{
+	static unsigned char in[1 << 17], big[70000], out[sizeof(big) + 1024];
+	unsigned char *c = in;
+	FILE *sink = tmpfile();
+	size_t i, outsz;
+
+	puts("INBOUND FRAMES");
+
+	for (i = 0; i < sizeof(big); i++) big[i] = 'a' + i % 26;
+
+	c += mkframe(c, 0x81, "typed ", 6);
+	c += mkframe(c, 0x01, "frag", 4);
+	c += mkframe(c, 0x89, "pingdata", 8);
+	c += mkframe(c, 0x80, "mented ", 7);
+	c += mkframe(c, 0x82, big, 300);
+	c += mkframe(c, 0x8a, "pong", 4);
+	c += mkframe(c, 0x82, big, sizeof(big));
+	c += mkframe(c, 0x88, "\003\350bye", 5);
+	c += mkframe(c, 0x81, "after close", 11);
+
+	/* Start with part of a header, as if it came with the upgrade
+	   request. */
+	resp.escannot = "inbresp";
+	inbound_prime(in, 3);
+	printf("pending: %d\n", inbound_pending());
+	printf("open: %d\n", fwrd_inbound_frames(fileno(sink)));
+	printf("pending: %d\n", inbound_pending());
+
+	runpiped(in + 3, c - in - 3, fileno(sink));
+	resp.escannot = 0;
+
+	rewind(sink);
+	outsz = fread(out, 1, sizeof(out), sink);
+	fclose(sink);
+
+	printf("forwarded %zu bytes: %.24s...%s\n", outsz, out,
+	       (char *)out + outsz - 6);
+	printf("big payload intact: %d\n",
+	       outsz == 17 + 300 + sizeof(big) &&
+	       !memcmp(out + 17 + 300, big, sizeof(big)));
+
+	/* Messages are only passed on once their last frame is received, and
+	   a ping may come between the frames of one. */
+	c = in;
+	c += mkframe(c, 0x01, "d1:first ", 9);
+	c += mkframe(c, 0x89, "", 0);
+	c += mkframe(c, 0x80, "message", 7);
+	c += mkframe(c, 0x81, "", 0);
+	c += mkframe(c, 0x82, "k0:", 3);
+	c += mkframe(c, 0x01, "unfinished", 10);
+	resp.escannot = "inbresp";
+	inbound_prime(in, c - in);
+	printf("open: %d\n", inbound_msgs(tstmsg));
+	resp.escannot = 0;
+
+	free(buf);
+	free(msg.bf);
+	buf = msg.bf = 0;
+	bfi = bfsz = bfcap = msg.len = msg.cap = 0;
+	memset(&fr, 0, sizeof(fr));
+}
+
+void inbound_bench(void)
+{
+	static const size_t sizes[] = {1, 3, 40, 200, 1500, 16384, 200000};
+	size_t insz = 0, payl = 0, i, rounds = 64;
+	unsigned char *in, *p;
+	struct timespec t0, t1;
+	double secs;
+	int sink;
+
+	p = malloc(sizes[6]);
+	for (i = 0; i < sizes[6]; i++) p[i] = ' ' + i % 95;
+
+	/* A mix of keystrokes and pastes of various sizes. */
+	in = malloc(rounds * (sizes[6] * 2));
+	for (i = 0; payl < rounds * sizes[6]; i++) {
+		insz += mkframe(in + insz, 0x81, p, sizes[i % 7]);
+		payl += sizes[i % 7];
+	}
+
+	sink = open("/dev/null", O_WRONLY);
+	if (sink < 0) { perror("open /dev/null"); exit(1); }
+
+	nreads = nwrits = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	runpiped(in, insz, sink);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("inbound frames: %zu frames, %zu payload bytes in %.3f s\n",
+	       i, payl, secs);
+	printf("  %.1f MB/s, %u reads, %u writes\n",
+	       payl / secs / 1e6, nreads, nwrits);
+
+	close(sink);
+	free(in);
+	free(p);
 }
@@ -6,6 +6,27 @@
 
 #include "outstreams.h"
 
-/* Forwards stdin, interpreted as websocket frames, to the given socket as
- * unframed data, otherwise uninterpreted. */
-void fwrd_inbound_frames(int sock);
+/* Reads stdin once and forwards the payloads of the websocket data frames
+ * received so far to the given socket as unframed data, otherwise
+ * uninterpreted. Frames may be split between calls in any way. Pings are
+ * answered with pongs on stdout. Returns 0 once the client closes the websocket,
+ * which is answered with a close frame, or the connection ends. */
+int fwrd_inbound_frames(int sock);
+
+/* Like fwrd_inbound_frames, but passes each data message to onmsg once all of
+ * its frames are received. m is only valid during the call. */
+int inbound_msgs(void (*onmsg)(unsigned char *m, size_t sz));
+
+/* Adds sz bytes at b to what fwrd_inbound_frames handles, for frames received
+ * along with the websocket upgrade request. The next call decodes them without
+ * reading stdin. */
+void inbound_prime(const void *b, size_t sz);
+
+/* Whether inbound_prime added bytes that fwrd_inbound_frames has not handled. */
+int inbound_pending(void);
+
+void test_inbound(void);
+
+/* Measures how fast fwrd_inbound_frames forwards a mix of small and large
+ * frames sent over a pipe and prints the rate and syscall counts. */
+void inbound_bench(void);
@@ -0,0 +1,843 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "logidx.h"
+#include "http.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define TRIVER		2
+#define TRIPAGES	(TRIBITS / 8 / TRIPGSZ)
+
+/* Lines longer than this are only searched up to this length, and matching
+   lines are cut to SHOWMAX bytes in search results. */
+#define LINEMAX		4096
+#define SHOWMAX		300
+
+/* How many lines before and after each match are shown in search results. */
+#define CTXLINES	2
+
+/* How many spawner loop iterations between backfills. The loop runs about once
+   a second when idle. */
+#define MAINTIVL	600
+
+static int fold(int c) { return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c; }
+
+static uint32_t trihash(int a, int b, int c)
+{
+	return ((uint32_t)a << 16 | b << 8 | c) * 2654435761u >> 12;
+}
+
+struct logrd {
+	int fd, gz, eof;
+	off_t off;
+	z_stream z;
+	unsigned char ib[64 * 1024];
+};
+
+struct logrd *logrd_open(int fd, int gz, off_t off)
+{
+	struct logrd *r = calloc(1, sizeof(*r));
+
+	r->fd = fd;
+	r->gz = gz;
+	r->off = gz ? 0 : off;
+	if (gz && inflateInit2(&r->z, 15 + 32) != Z_OK) {
+		warnx("inflateInit2: %s", r->z.msg);
+		r->eof = 1;
+	}
+	return r;
+}
+
+void logrd_frame(struct logrd *r, off_t zoff)
+{
+	r->off = zoff;
+}
+
+unsigned long long logrd_seek(struct logrd *r, int zidx, unsigned long long off)
+{
+	unsigned long long zoff, clen, ulen, end = 0, uoff = 0, start = 0;
+	FILE *idx;
+	int fd;
+
+	/* The index may still be appended to, by the writer of an fd that shares
+	   this offset, but it is opened for appending. */
+	fd = dup(zidx);
+	idx = fd < 0 ? 0 : fdopen(fd, "r");
+	if (!idx) { if (fd >= 0) close(fd); return 0; }
+	rewind(idx);
+
+	while (3 == fscanf(idx, "%llu %llu %llu\n", &zoff, &clen, &ulen)) {
+		if (zoff != end || uoff + ulen > off) break;
+		end = zoff + clen;
+		uoff += ulen;
+		logrd_frame(r, end);
+		start = uoff;
+	}
+	fclose(idx);
+
+	return start;
+}
+
+/* Opens the log in fd to be read from uncompressed offset at, which for a
+   compressed log with frame index zidx is done from the frame holding at. The
+   number of bytes read before at is put in *drop. */
+static struct logrd *lgopenat(int fd, int zidx, unsigned long long at,
+			      unsigned long long *drop)
+{
+	struct logrd *r = logrd_open(fd, !!zidx, at);
+
+	*drop = zidx ? at : 0;
+	if (zidx > 0) *drop -= logrd_seek(r, zidx, at);
+	return r;
+}
+
+void logrd_close(struct logrd *r)
+{
+	if (r->gz) inflateEnd(&r->z);
+	free(r);
+}
+
+static ssize_t logrd_fill(struct logrd *r, unsigned char *b, size_t sz)
+{
+	ssize_t redn;
+
+	for (;;) {
+		redn = pread(r->fd, b, sz, r->off);
+		if (redn < 0 && errno == EINTR) continue;
+		if (redn < 0) perror("read log");
+		if (redn <= 0) { r->eof = 1; return 0; }
+
+		r->off += redn;
+		return redn;
+	}
+}
+
+ssize_t logrd_read(struct logrd *r, unsigned char *b, size_t sz)
+{
+	int zr;
+
+	if (!r->gz) return r->eof ? 0 : logrd_fill(r, b, sz);
+
+	while (!r->eof) {
+		if (!r->z.avail_in) {
+			r->z.avail_in = logrd_fill(r, r->ib, sizeof(r->ib));
+			r->z.next_in = r->ib;
+			if (!r->z.avail_in) break;
+		}
+
+		r->z.next_out = b;
+		r->z.avail_out = sz;
+		zr = inflate(&r->z, Z_NO_FLUSH);
+
+		/* Each frame is a gzip member. */
+		if (zr == Z_STREAM_END) inflateReset(&r->z);
+		else if (zr != Z_OK && zr != Z_BUF_ERROR) {
+			warnx("inflate log: %s", r->z.msg ? r->z.msg : "?");
+			r->eof = 1;
+		}
+
+		if (r->z.avail_out != sz) return sz - r->z.avail_out;
+	}
+
+	return 0;
+}
+
+static void pwrall(int fd, const void *buf_, size_t sz, off_t off)
+{
+	const unsigned char *buf = buf_;
+	ssize_t writn;
+
+	while (sz) {
+		writn = pwrite(fd, buf, sz, off);
+		if (writn < 0 && errno == EINTR) continue;
+		if (writn <= 0) { perror("write log index"); return; }
+
+		buf += writn;
+		sz -= writn;
+		off += writn;
+	}
+}
+
+/* Reads the header of the index in fd. Returns 0 if it is not a valid index. */
+static int trirdhdr(int fd, struct trihdr *h)
+{
+	if (sizeof(*h) != pread(fd, h, sizeof(*h), 0))	return 0;
+	if (memcmp(h->magic, "WTRI", 4))		return 0;
+	return h->ver == TRIVER;
+}
+
+static void trireset(struct triidx *t)
+{
+	memset(&t->h, 0, sizeof(t->h));
+	memcpy(t->h.magic, "WTRI", 4);
+	t->h.ver = TRIVER;
+	memset(t->bm, 0, TRIBITS / 8);
+	t->dirty = 0;
+	t->tailn = 0;
+
+	/* Pages never written read as zero, which keeps the file sparse. */
+	if (ftruncate(t->fd, 0)) perror("truncate log index");
+}
+
+/* Adds trigrams ending in buf, or if setbits is 0, only tracks the line ends
+   so the following bytes can be added. */
+static void trifeed(struct triidx *t, const unsigned char *buf, size_t len,
+		    int setbits)
+{
+	uint32_t h;
+	int c;
+
+	for (; len; len--, buf++) {
+		c = fold(*buf);
+		if (c == '\n') {
+			t->tailn = 0;
+			if (setbits) t->h.covlines++;
+			continue;
+		}
+		if (t->tailn < 2) { t->tail[t->tailn++] = c; continue; }
+
+		if (setbits) {
+			h = trihash(t->tail[0], t->tail[1], c);
+			if (!(t->bm[h >> 3] & 1 << (h & 7))) {
+				t->bm[h >> 3] |= 1 << (h & 7);
+				t->dirty |= 1u << (h / 8 / TRIPGSZ);
+			}
+		}
+		t->tail[0] = t->tail[1];
+		t->tail[1] = c;
+	}
+}
+
+void triidx_add(struct triidx *t, const void *buf, size_t len)
+{
+	const unsigned char *nl = memrchr(buf, '\n', len);
+
+	trifeed(t, buf, len, 1);
+	if (nl) t->h.lnstart = t->h.covered + (nl - (const unsigned char *)buf) + 1;
+	t->h.covered += len;
+	t->unsaved += len;
+}
+
+void triidx_save(struct triidx *t, int logfd)
+{
+	struct stat sb;
+	int pg;
+
+	for (pg = 0; pg < TRIPAGES; pg++) {
+		if (!(t->dirty & 1u << pg)) continue;
+		pwrall(t->fd, t->bm + pg*TRIPGSZ, TRIPGSZ, TRIPGSZ + pg*TRIPGSZ);
+	}
+	t->dirty = 0;
+	t->unsaved = 0;
+
+	if (fstat(logfd, &sb))	perror("stat log");
+	else			t->h.filesz = sb.st_size;
+
+	/* The header goes last, so a reader never sees it cover bits that are
+	   not written yet. */
+	pwrall(t->fd, &t->h, sizeof(t->h), 0);
+}
+
+void triidx_load(struct triidx *t, int logfd, int zidx)
+{
+	unsigned char b[16 * 1024];
+	struct logrd *r;
+	unsigned long long start, drop, keep;
+	ssize_t redn, k, kk;
+	int pass;
+
+	if (flock(t->fd, LOCK_EX)) perror("lock log index");
+
+	if (!t->bm) t->bm = calloc(1, TRIBITS / 8);
+
+	for (pass = 0; pass < 2; pass++) {
+		if (pass || !trirdhdr(t->fd, &t->h)) {
+			trireset(t);
+		}
+		else if (0 > pread(t->fd, t->bm, TRIBITS / 8, TRIPGSZ)) {
+			perror("read log index");
+			trireset(t);
+		}
+
+		/* The indexed part of the line that covered is in may begin
+		   trigrams that end after it. The newline before it is read
+		   too, so a log cut short at the start of the line is seen. */
+		start = t->h.lnstart ? t->h.lnstart - 1 : 0;
+		keep = t->h.covered - start;
+		t->tailn = 0;
+
+		r = lgopenat(logfd, zidx, start, &drop);
+		while (0 < (redn = logrd_read(r, b, sizeof(b)))) {
+			k = (unsigned long long)redn < drop ? redn : drop;
+			drop -= k;
+			kk = (unsigned long long)(redn - k) < keep ? redn - k : keep;
+			trifeed(t, b + k, kk, 0);
+			keep -= kk;
+			triidx_add(t, b + k + kk, redn - k - kk);
+		}
+		logrd_close(r);
+
+		if (!drop && !keep) break;
+		warnx("log is shorter than its index; reindexing");
+	}
+
+	triidx_save(t, logfd);
+}
+
+/* Checks the index in fd for the trigrams of lq, which is lowercase. Returns 1
+   if all are there, 0 if not, or -1 if fd is not a valid index. */
+static int trihas(int fd, const char *lq, struct trihdr *h)
+{
+	const unsigned char *q = (const unsigned char *)lq;
+	unsigned char byt;
+	uint32_t hs;
+
+	if (fd < 0 || !trirdhdr(fd, h)) return -1;
+
+	for (; q[0] && q[1] && q[2]; q++) {
+		hs = trihash(q[0], q[1], q[2]);
+		if (1 != pread(fd, &byt, 1, TRIPGSZ + (hs >> 3))) return 0;
+		if (!(byt & 1 << (hs & 7))) return 0;
+	}
+	return 1;
+}
+
+struct lgfile {
+	char *path;
+	time_t mtime;
+};
+
+static struct lgfile *lgfs;
+static int lgfcnt, lgfcap;
+
+/* Returns whether a path relative to the state dir is a log or history file:
+   YEAR/MONTH/DAY/name or YEAR/MONTH/hist/name. Raw logs and files belonging to
+   logs are not included. */
+static int islgfile(const char *rel)
+{
+	static const char *const skipsfx[] = {
+		".tri", ".idx", ".raw", ".raw.gz",
+		".rec", ".rec.gz", ".ckp", 0,
+	};
+	const char *const *sfx;
+	const char *nm;
+	size_t nmlen;
+
+	if (strspn(rel, "0123456789") != 4 || rel[4] != '/')	return 0;
+	rel += 5;
+	if (strspn(rel, "0123456789") != 2 || rel[2] != '/')	return 0;
+	rel += 3;
+	if (!strncmp(rel, "hist/", 5))				nm = rel + 5;
+	else if (strspn(rel, "0123456789") == 2 && rel[2] == '/')
+								nm = rel + 3;
+	else							return 0;
+
+	if (!*nm || *nm == '.' || strchr(nm, '/'))		return 0;
+
+	nmlen = strlen(nm);
+	for (sfx = skipsfx; *sfx; sfx++) {
+		if (nmlen > strlen(*sfx)
+		    && !strcmp(nm + nmlen - strlen(*sfx), *sfx)) return 0;
+	}
+	return 1;
+}
+
+static int lgfent(const char *fpath, const struct stat *sb, int typ,
+		  struct FTW *fw)
+{
+	if (typ != FTW_F || !S_ISREG(sb->st_mode))		return 0;
+	if (!islgfile(fpath + strlen(state_dir()) + 1))		return 0;
+
+	if (lgfcnt == lgfcap) {
+		lgfcap = lgfcap ? lgfcap * 2 : 64;
+		lgfs = realloc(lgfs, lgfcap * sizeof(*lgfs));
+	}
+	lgfs[lgfcnt].path = strdup(fpath);
+	lgfs[lgfcnt].mtime = sb->st_mtime;
+	lgfcnt++;
+	return 0;
+}
+
+static void lgflist(void)
+{
+	while (lgfcnt) free(lgfs[--lgfcnt].path);
+
+	if (nftw(state_dir(), lgfent, 16, FTW_PHYS))
+		warn("listing logs in %s", state_dir());
+}
+
+static int newerfirst(const void *a_, const void *b_)
+{
+	const struct lgfile *a = a_, *b = b_;
+
+	if (a->mtime != b->mtime) return a->mtime < b->mtime ? 1 : -1;
+	return strcmp(b->path, a->path);
+}
+
+static int isgz(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len > 3 && !strcmp(path + len - 3, ".gz");
+}
+
+/* Opens the frame index of the compressed log at path, or returns -1. */
+static int openidx(const char *path)
+{
+	char *fn;
+	int fd;
+
+	xasprintf(&fn, "%s.idx", path);
+	fd = open(fn, O_RDONLY);
+	free(fn);
+	return fd;
+}
+
+static void backfill1(const char *path)
+{
+	struct triidx t = {0};
+	struct trihdr h;
+	struct stat sb;
+	char *trifn;
+	int logfd, zidx = 0;
+
+	xasprintf(&trifn, "%s.tri", path);
+	logfd = open(path, O_RDONLY);
+	t.fd = open(trifn, O_RDWR | O_CREAT, 0600);
+
+	if (logfd < 0 || t.fd < 0)	{ warn("open %s", trifn);	goto cleanup; }
+
+	/* Being written by a session, which keeps it up to date. */
+	if (flock(t.fd, LOCK_EX | LOCK_NB))				goto cleanup;
+
+	if (fstat(logfd, &sb))		{ warn("stat %s", path);	goto cleanup; }
+	if (trirdhdr(t.fd, &h) && h.filesz == sb.st_size)		goto cleanup;
+
+	if (isgz(path)) zidx = openidx(path);
+	triidx_load(&t, logfd, zidx);
+
+cleanup:
+	if (zidx > 0)	close(zidx);
+	if (logfd >= 0)	close(logfd);
+	if (t.fd >= 0)	close(t.fd);
+	free(t.bm);
+	free(trifn);
+}
+
+void logindex_backfill(void)
+{
+	long ncpu;
+	int wi, fi;
+	pid_t pid;
+
+	lgflist();
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)		ncpu = 1;
+	if (ncpu > lgfcnt)	ncpu = lgfcnt;
+
+	for (wi = 0; wi < ncpu; wi++) {
+		pid = fork();
+		if (pid < 0) { perror("fork for log indexing"); break; }
+		if (pid) continue;
+
+		for (fi = wi; fi < lgfcnt; fi += ncpu) backfill1(lgfs[fi].path);
+		exit(0);
+	}
+
+	while (0 < wait(0) || errno == EINTR) {}
+}
+
+void logindex_maint(void)
+{
+	static unsigned calls;
+	int fd;
+
+	if (calls++ % MAINTIVL) return;
+
+	switch (fork()) {
+	case -1: perror("fork for log index maintenance");
+	default: return;
+	case 0: break;
+	}
+
+	/* Do not keep the listening sockets open. */
+	for (fd = getdtablesize(); fd-- > 3;) close(fd);
+	if (0 > nice(10)) perror("nice");
+
+	logindex_backfill();
+	exit(0);
+}
+
+/* Appends line number lno and the line, where sep is ':' for a match and '-'
+   for the lines around it. */
+static void shwline(struct fdbuf *ob, unsigned long long lno, char sep,
+		    const unsigned char *ln, unsigned len)
+{
+	unsigned i;
+
+	fdb_itoa(ob, lno);
+	fdb_apnc(ob, sep);
+	fdb_apnc(ob, ' ');
+	if (len > SHOWMAX) len = SHOWMAX;
+	for (i = 0; i < len; i++) {
+		if (ln[i] >= ' ' || ln[i] == '\t') fdb_apnc(ob, ln[i]);
+	}
+	fdb_apnc(ob, '\n');
+}
+
+struct scanst {
+	struct fdbuf *ob;
+	const char *hdr, *lq;
+	unsigned qlen;
+	int found, max;
+
+	/* How many lines after the last match are still to be shown, and the
+	   number of the last line shown. */
+	int after;
+	unsigned long long shown;
+
+	/* The last CTXLINES lines read, by line number modulo CTXLINES, and how
+	   many lines have been read. */
+	unsigned char ctx[CTXLINES][SHOWMAX];
+	unsigned ctxlen[CTXLINES];
+	unsigned long long nread;
+};
+
+static void scanline(struct scanst *s, unsigned long long lno,
+		     const unsigned char *ln, unsigned lnlen)
+{
+	unsigned char lc[LINEMAX];
+	unsigned long long first;
+	unsigned i;
+
+	for (i = 0; i < lnlen; i++) lc[i] = fold(ln[i]);
+
+	if (s->found < s->max && lnlen >= s->qlen
+	    && memmem(lc, lnlen, s->lq, s->qlen)) {
+		first = lno - (s->nread < CTXLINES ? s->nread : CTXLINES);
+		if (first <= s->shown) first = s->shown + 1;
+
+		if (!s->found++)		fdb_apnd(s->ob, s->hdr, -1);
+		else if (first > s->shown + 1)	fdb_apnd(s->ob, "--\n", -1);
+
+		for (; first < lno; first++)
+			shwline(s->ob, first, '-', s->ctx[first % CTXLINES],
+				s->ctxlen[first % CTXLINES]);
+		shwline(s->ob, lno, ':', ln, lnlen);
+		s->after = CTXLINES;
+		s->shown = lno;
+	}
+	else if (s->after) {
+		shwline(s->ob, lno, '-', ln, lnlen);
+		s->after--;
+		s->shown = lno;
+	}
+
+	if (lnlen > SHOWMAX) lnlen = SHOWMAX;
+	memcpy(s->ctx[lno % CTXLINES], ln, lnlen);
+	s->ctxlen[lno % CTXLINES] = lnlen;
+	s->nread++;
+}
+
+/* Appends lines of the log in fd that contain lq to ob, each with up to
+   CTXLINES lines before and after it. zidx is as for triidx_load. The log is
+   read from byte offset from, which starts line number lno, so no lines before
+   it are shown. The first match is preceded by hdr, and matches whose lines
+   around them are not adjacent are separated by "--". Returns the number of
+   matching lines, up to max. */
+static int scanlog(struct fdbuf *ob, const char *hdr, int fd, int zidx,
+		   unsigned long long from, unsigned long long lno,
+		   const char *lq, int max)
+{
+	unsigned char b[16 * 1024], ln[LINEMAX];
+	struct scanst s = {ob, hdr, lq, strlen(lq), 0, max};
+	unsigned lnlen = 0;
+	unsigned long long skip;
+	struct logrd *r;
+	ssize_t redn, bi;
+
+	r = lgopenat(fd, zidx, from, &skip);
+	lno++;
+
+	while ((s.found < max || s.after)
+	       && 0 < (redn = logrd_read(r, b, sizeof(b)))) {
+		bi = 0;
+		if (skip) {
+			bi = (unsigned long long)redn < skip ? redn : skip;
+			skip -= bi;
+		}
+
+		for (; bi < redn && (s.found < max || s.after); bi++) {
+			if (b[bi] != '\n') {
+				if (lnlen < LINEMAX) ln[lnlen++] = b[bi];
+				continue;
+			}
+
+			scanline(&s, lno++, ln, lnlen);
+			lnlen = 0;
+		}
+	}
+
+	if (lnlen) scanline(&s, lno, ln, lnlen);
+
+	logrd_close(r);
+	return s.found;
+}
+
+void logsearch(struct wrides *de, const char *q, int max)
+{
+	struct fdbuf ob = {0};
+	struct trihdr h;
+	struct stat sb;
+	char *lq, *c, *trifn, *hdr;
+	int fi, trifd, logfd, zidx, has, found = 0, srchd = 0, skipd = 0;
+	unsigned long long from, lno;
+
+	lq = strdup(q);
+	for (c = lq; *c; c++) *c = fold(*c);
+
+	resp_chunkd(de, 't', 200);
+
+	lgflist();
+	qsort(lgfs, lgfcnt, sizeof(*lgfs), newerfirst);
+
+	for (fi = 0; fi < lgfcnt && found < max; fi++) {
+		xasprintf(&trifn, "%s.tri", lgfs[fi].path);
+		trifd = open(trifn, O_RDONLY);
+		free(trifn);
+
+		zidx = 0;
+		logfd = open(lgfs[fi].path, O_RDONLY);
+		if (logfd < 0 || fstat(logfd, &sb)) goto nextfile;
+
+		/* Where the index lacks the query, only the part of the log
+		   written since it was last saved can match, which starts with
+		   the line the index ends in. */
+		from = lno = 0;
+		has = trihas(trifd, lq, &h);
+		if (!has) {
+			skipd++;
+			if (h.filesz == sb.st_size) goto nextfile;
+			from = h.lnstart;
+			lno = h.covlines;
+		}
+
+		if (isgz(lgfs[fi].path)) zidx = openidx(lgfs[fi].path);
+		xasprintf(&hdr, "--- %s ---\n",
+			  lgfs[fi].path + strlen(state_dir()) + 1);
+		found += scanlog(&ob, hdr, logfd, zidx, from, lno, lq,
+				 max - found);
+		free(hdr);
+		srchd++;
+
+		if (ob.len) { resp_chunk(de, ob.bf, ob.len); ob.len = 0; }
+
+	nextfile:
+		if (zidx > 0) close(zidx);
+		if (logfd >= 0) close(logfd);
+		if (trifd >= 0) close(trifd);
+	}
+
+	fdb_apnd(&ob, "--- ", -1);
+	fdb_itoa(&ob, found);
+	fdb_apnd(&ob, " matching lines; ", -1);
+	fdb_itoa(&ob, lgfcnt);
+	fdb_apnd(&ob, " files, ", -1);
+	fdb_itoa(&ob, skipd);
+	fdb_apnd(&ob, " excluded by index, ", -1);
+	fdb_itoa(&ob, srchd);
+	fdb_apnd(&ob, " read ---\n", -1);
+	resp_chunk(de, ob.bf, ob.len);
+	resp_chunk(de, 0, 0);
+
+	fdb_finsh(&ob);
+	free(lq);
+}
+
+static void tstquery(struct triidx *t, int logfd, const char *q)
+{
+	struct fdbuf ob = {&(struct wrides){1}};
+	struct trihdr h;
+	char *lq, *c;
+
+	lq = strdup(q);
+	for (c = lq; *c; c++) *c = fold(*c);
+
+	printf("query '%s' in index: %d\n", q, trihas(t->fd, lq, &h));
+	scanlog(&ob, "matches:\n", logfd, 0, 0, 0, lq, 3);
+	fdb_finsh(&ob);
+	free(lq);
+}
+
+/* Appends s to the compressed log in fd as one frame, and its entry to the
+   frame index in idxfd. */
+static void tstgzfrm(int fd, int idxfd, const char *s)
+{
+	unsigned char ob[256];
+	char ent[64];
+	z_stream z = {0};
+	off_t off = lseek(fd, 0, SEEK_END);
+	size_t clen;
+
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+		     Z_DEFAULT_STRATEGY);
+	z.next_in = (unsigned char *)s;
+	z.avail_in = strlen(s);
+	z.next_out = ob;
+	z.avail_out = sizeof(ob);
+	deflate(&z, Z_FINISH);
+	clen = sizeof(ob) - z.avail_out;
+	deflateEnd(&z);
+
+	pwrall(fd, ob, clen, off);
+	snprintf(ent, sizeof(ent), "%llu %zu %zu\n",
+		 (unsigned long long)off, clen, strlen(s));
+	pwrall(idxfd, ent, strlen(ent), lseek(idxfd, 0, SEEK_END));
+}
+
+static void tsthdr(struct triidx *t)
+{
+	printf("covered: %llu lines: %llu line start: %llu\n",
+	       (unsigned long long)t->h.covered,
+	       (unsigned long long)t->h.covlines,
+	       (unsigned long long)t->h.lnstart);
+}
+
+void test_logidx(void)
+{
+	FILE *lg = tmpfile(), *tr = tmpfile();
+	struct triidx t = {fileno(tr)}, t2 = {fileno(tr)};
+	int lgfd = fileno(lg);
+
+	puts("LOG INDEX");
+
+	fputs("$ make test\nall tests PASSED\n$ ls\nFoo.c  bar.c\npartial", lg);
+	fflush(lg);
+
+	triidx_load(&t, lgfd, 0);
+	printf("covered: %llu lines: %llu filesz: %llu\n",
+	       (unsigned long long)t.h.covered,
+	       (unsigned long long)t.h.covlines,
+	       (unsigned long long)t.h.filesz);
+
+	tstquery(&t, lgfd, "passed");
+	tstquery(&t, lgfd, "foo.C");
+	tstquery(&t, lgfd, "$ l");
+	tstquery(&t, lgfd, "make test");
+	tstquery(&t, lgfd, "PASSED $");
+	tstquery(&t, lgfd, "zzz");
+	tstquery(&t, lgfd, "ls");
+
+	puts("trigram spanning writes:");
+	fputs(" line\n", lg);
+	fflush(lg);
+	triidx_add(&t, " line\n", 6);
+	triidx_save(&t, lgfd);
+	tstquery(&t, lgfd, "al li");
+
+	puts("catch up on open:");
+	fputs("unindexed\n", lg);
+	fflush(lg);
+	triidx_load(&t2, lgfd, 0);
+	printf("covered: %llu lines: %llu\n",
+	       (unsigned long long)t2.h.covered,
+	       (unsigned long long)t2.h.covlines);
+	tstquery(&t2, lgfd, "unindexed");
+
+	puts("log truncated:");
+	if (ftruncate(lgfd, 12)) perror("truncate");
+	triidx_load(&t2, lgfd, 0);
+	printf("covered: %llu lines: %llu\n",
+	       (unsigned long long)t2.h.covered,
+	       (unsigned long long)t2.h.covlines);
+	tstquery(&t2, lgfd, "passed");
+
+	fclose(lg);
+	fclose(tr);
+	free(t.bm);
+	free(t2.bm);
+
+	lg = tmpfile();
+	tr = tmpfile();
+	lgfd = fileno(lg);
+	memset(&t, 0, sizeof(t));
+	t.fd = fileno(tr);
+
+	puts("search from the line the index ends in:");
+	fputs("one\ntwo part", lg);
+	fflush(lg);
+	triidx_load(&t, lgfd, 0);
+	tsthdr(&t);
+	fputs("ial\nthree\n", lg);
+	fflush(lg);
+	tstquery(&t, lgfd, "partial");
+	{
+		struct fdbuf ob = {&(struct wrides){1}};
+
+		scanlog(&ob, "matches after index:\n", lgfd, 0,
+			t.h.lnstart, t.h.covlines, "partial", 3);
+		fdb_finsh(&ob);
+	}
+
+	fclose(lg);
+	fclose(tr);
+	free(t.bm);
+
+	puts("lines around matches:");
+	lg = tmpfile();
+	lgfd = fileno(lg);
+	fputs("a\nb\nhit\nhit\nc\nd\ne\nf\ng\nhit\nh\ni\nhit\nj\n", lg);
+	fflush(lg);
+	{
+		struct fdbuf ob = {&(struct wrides){1}};
+
+		scanlog(&ob, "matches:\n", lgfd, 0, 0, 0, "hit", 3);
+		fdb_finsh(&ob);
+	}
+	fclose(lg);
+
+	puts("compressed log, read from the frame the index ends in:");
+	{
+		FILE *gz = tmpfile(), *gi = tmpfile(), *gt = tmpfile();
+		struct triidx t3 = {fileno(gt)}, t4 = {fileno(gt)};
+		struct fdbuf ob = {&(struct wrides){1}};
+		int gzfd = fileno(gz), gifd = fileno(gi);
+
+		tstgzfrm(gzfd, gifd, "alpha\nbeta gam");
+		tstgzfrm(gzfd, gifd, "ma\ndelta\nepsi");
+		triidx_load(&t3, gzfd, gifd);
+		tsthdr(&t3);
+
+		/* Damage the first frame, so reading it would fail. */
+		pwrall(gzfd, "\xff\xff\xff\xff\xff\xff", 6, 10);
+		tstgzfrm(gzfd, gifd, "lon\nzeta\n");
+		triidx_load(&t4, gzfd, gifd);
+		tsthdr(&t4);
+
+		scanlog(&ob, "matches after index:\n", gzfd, gifd,
+			t3.h.lnstart, t3.h.covlines, "epsilon", 3);
+		fdb_finsh(&ob);
+
+		fclose(gz);
+		fclose(gi);
+		fclose(gt);
+		free(t3.bm);
+		free(t4.bm);
+	}
+}
@@ -0,0 +1,106 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef LOGIDX_H
+#define LOGIDX_H
+
+#include "outstreams.h"
+
+#include <stdint.h>
+
+/* Trigram index of a scrollback log or history file. Each run of three bytes in
+ * a line, after folding ASCII letters to lowercase, sets one bit of a bitmap
+ * chosen by hashing it. A search skips a file whose bitmap lacks a bit for any
+ * trigram of the query. The index of file "x" is "x.tri". It is a header
+ * followed at offset TRIPGSZ by the bitmap, which is written a page at a time
+ * as bits are set, so the index is a sparse file while the log is small. */
+#define TRIBITS		(1 << 20)
+#define TRIPGSZ		4096
+
+struct trihdr {
+	/* "WTRI" and the format version */
+	char magic[4];
+	uint32_t ver;
+
+	/* How many bytes of the log, uncompressed, have been indexed, and how
+	   many lines they hold. lnstart is where the line that covered is in
+	   starts, which is covered if it is at the start of a line. */
+	uint64_t covered, covlines, lnstart;
+
+	/* Size on disk of the log when the header was written. If the log is
+	   a different size now, bytes after covered are not indexed yet. */
+	uint64_t filesz;
+};
+
+struct triidx {
+	/* Zero if the log is not indexed. */
+	int fd;
+
+	struct trihdr h;
+
+	/* TRIBITS bits, or null until triidx_load is called. */
+	unsigned char *bm;
+
+	/* Has a bit for each page of bm changed since the last save. */
+	uint32_t dirty;
+
+	/* Up to the last two bytes of the unfinished line, which start
+	   trigrams that end in the next write. */
+	unsigned char tail[2];
+	unsigned tailn;
+
+	/* Bytes added since the last save. */
+	unsigned unsaved;
+};
+
+/* Reads the index in t->fd and indexes any part of the log in logfd that it
+ * does not cover yet. zidx is 0 if the log is not compressed, and otherwise the
+ * fd of its frame index, or -1 if it has none and must be read from the start.
+ * The index is locked so the backfill process leaves it alone while it is
+ * being written. */
+void triidx_load(struct triidx *t, int logfd, int zidx);
+
+/* Adds bytes appended to the log. Nothing is written until triidx_save. */
+void triidx_add(struct triidx *t, const void *buf, size_t len);
+
+/* Writes changed pages and the header to the index. */
+void triidx_save(struct triidx *t, int logfd);
+
+/* Indexes the logs and history files under state_dir() that have no index or
+ * have grown since they were indexed, using a process per CPU. Files whose
+ * index is locked by a session are skipped. */
+void logindex_backfill(void);
+
+/* Called in the spawner loop. Starts a backfill process every so often. */
+void logindex_maint(void);
+
+/* Writes an HTTP response to de with lines of logs and history files that
+ * contain q, ignoring ASCII case, newest files first, each with a few lines
+ * around it. At most max matching lines are given. The response is streamed as each file is searched. */
+void logsearch(struct wrides *de, const char *q, int max);
+
+/* Reads a log from a given offset, decompressing it if needed. A compressed log
+ * is read from the start, and its unfinished frame is read as far as it has
+ * been flushed. */
+struct logrd;
+struct logrd *logrd_open(int fd, int gz, off_t off);
+
+/* Makes a compressed log be read from the frame at zoff, before anything is
+ * read. The caller skips to the wanted byte in it. */
+void logrd_frame(struct logrd *r, off_t zoff);
+
+/* Makes a compressed log be read from the frame holding uncompressed offset
+ * off, found in the frame index in zidx, before anything is read. Returns the
+ * uncompressed offset where that frame starts, or 0 if zidx is not valid. */
+unsigned long long logrd_seek(struct logrd *r, int zidx, unsigned long long off);
+
+/* Reads decompressed bytes. Returns 0 at the end of the log. */
+ssize_t logrd_read(struct logrd *r, unsigned char *b, size_t sz);
+void logrd_close(struct logrd *r);
+
+void test_logidx(void);
+
+#endif
@@ -50,10 +50,10 @@ var	t, tel, gl, gwid, ghei, cops, ftd, ftx, vbu, shpr, dw, dh,
 	log_macks,
 	log_packin, capsonwhile, topr = deqmk(),
 	term_ready,
-	sock,
+	sock, replaying, gotstate,
 	pend_send = [],
-	pend_display = [],
-	pend_escape = '', termid,
+	inby = new Uint8Array(4096), inbyn = 0, tmu8enc = new TextEncoder(),
+	pend_escape = '', termid, outep = 0, outseq = 0, kanl, diffmode,
 	params, dead_key_hist, keep_row_ttl, row_ttl, locked_ttl,
 	repeat_cnt, repsignal, repeat_boxes = [], macro_map,
 	barrier_dig = [], barrdiv, font_key,
@@ -688,26 +688,165 @@ function newcred()
 	});
 }
 
-function display(s)
+/* Makes room for at least n more bytes in inby. */
+function inbyrsrv(n)
 {
-	var next_esc, pend_i, c, pend_remain, nli, escpylo, coldex,
-		esclen, toesc;
+	var nb;
 
-	function pend(di) { return pend_display[pend_i + di]; }
-	function is_utf_trail(di) {
-		if (0x80 == (pend(di) & 0xc0)) return true;
-		console.warn('not a utf8 trailing byte in print data');
-		tputc(t, ORD('?'));
-		draw(t);
-		return false;
+	if (inbyn + n <= inby.length) return;
+
+	nb = new Uint8Array(Math.max(inby.length * 2, inbyn + n));
+	nb.set(inby.subarray(0, inbyn));
+	inby = nb;
+}
+
+/* Returns the number of leading bytes in inby that can be given to the
+   terminal engine, which excludes a trailing UTF-8 sequence that has not been
+   fully received yet. twrite does not carry partial sequences between calls. */
+function inbycomplete()
+{
+	var i = inbyn, b, need;
+
+	while (i > 0 && inbyn - i < 4) {
+		b = inby[--i];
+		if (0x80 == (b & 0xc0)) continue;
+
+		if	(0xf0 == (b & 0xf8))	need = 4;
+		else if	(0xe0 == (b & 0xf0))	need = 3;
+		else if	(0xc0 == (b & 0xe0))	need = 2;
+		else				return inbyn;
+
+		return inbyn - i < need ? i : inbyn;
 	}
 
+	return inbyn;
+}
+
+function ctlmsg(nm, escpylo)
+{
+	var oc = 0, os = 0;
+
+	switch (nm) {
+	case 'state':
+		console.log(	'got new term state from server;',
+				'JSON size: ', escpylo.length);
+		escpylo		= JSON.parse(escpylo);
+		gotstate	= 1;
+		bufsa		= escpylo.bs;
+		bufsfreehead	= escpylo.fh;
+		t		= escpylo.t;
+		outep		= escpylo.ep;
+		outseq		= escpylo.sq;
+		term4cli();
+		topr		= deqmk();
+
+		/* Output received before the state is already reflected in
+		   it. */
+		inbyn		= 0;
+
+		bufsa.forEach(function(a, ai)
+		{
+			if (typeof a == 'object') {
+				bufsa[ai] = new Int32Array(a);
+				os += bufsa[ai].length;
+				oc += 1;
+			}
+		});
+		console.log('no. objects:', oc, 'no. words:', os);
+
+		/* Cached lines may not match the new state. */
+		sbleave();
+
+		/* When re-establishing a connection, we need to set
+		terminal size AFTER receiving a new state. Before the
+		server receives \i{endptid}, it will not send subproc
+		activity to the client, so I believe sending the
+		terminal size too soon after \i{endptid} will cause the
+		terminal redraw to never be sent. */
+		if (!replaying) imposetsize();
+		break;
+
+	case 'diff':
+		applydiff(JSON.parse(escpylo));
+		break;
+
+	case 'sbpage':
+		escpylo	= JSON.parse(escpylo);
+		sbfirst	= escpylo.first;
+		escpylo.lines.forEach(function(l, li)
+		{
+			sbcache.set(escpylo.from + li, new Int32Array(l));
+		});
+		if (sbtop < 0) break;
+		if (sbtop < sbfirst) sbtop = sbfirst;
+		sbdraw();
+		break;
+
+	case 'title':
+		row_ttl = escpylo;
+		locked_ttl = !!row_ttl;
+		set_title();
+		break;
+
+	case 'auxjs':
+		loadauxjs(escpylo);
+		break;
+
+	case 'appendid':
+		termid += escpylo;
+		history.replaceState({}, '', '/?termid=' + termid);
+		break;
+
+	default:
+		console.warn('unknown message from server:', nm);
+	}
+}
+
+/* Applies a \@diff message sent in diff mode (see diff4cli in session.c). The
+   changed rows are decoded into the screen as they are, without running any
+   output through the engine. */
+function applydiff(f)
+{
+	var r;
+
+	if (f.c != term(t,col) || f.r != term(t,row)) tresize(t, f.c, f.r);
+
+	f.l.forEach(function(l)
+	{
+		if (l[0] < 0 || l[0] >= term(t,row)) return;
+		r = jsobj_alloc(new Int32Array(l));
+		sbrunpack(t, r, 1, l[0]);
+		tmfree(r);
+		fld(term(t,dirty), l[0]) = 1;
+	});
+
+	curs_x(term(t,curs))	= Math.min(f.x, term(t,col) - 1);
+	curs_y(term(t,curs))	= Math.min(f.y, term(t,row) - 1);
+	term(t,mode)		= f.m;
+	term(t,cursor)		= f.cu;
+	if ((r = term(t,sbring))) sbr_first(r) = f.sb - sbr_cnt(r);
+}
+
+/* Decodes output from the server and feeds it to the terminal engine. Output
+   bytes arrive as printable ASCII, with other bytes escaped as \xx in hex, and
+   newlines separating chunks, which are ignored. Lines of the form \@name:...
+   carry control messages. Decoded bytes are collected in the reusable inby
+   buffer and loaded into the engine's input deq in bulk.
+
+   If srv is set, s came from the session, and outseq is advanced by the number
+   of output characters in it, which is how far the session has to resend on
+   reconnect. The \@state message accounts for all output before it, and the
+   newline ending a keep-alive (kanl) is not output. */
+function display(s, srv)
+{
+	var si, sl, c, nli, nm, coldex, fedn, sur, ost = 0, ctl = 0;
+
 	function hex_val(i)
 	{
-		var c = s.charAt(i);
-		if (c >= '0' && c <= '9') return s.charCodeAt(i) - 48;
-		if (c >= 'a' && c <= 'f') return s.charCodeAt(i) - 87;
-		throw `invalid hex at ${i} in ${s}: ${c}`
+		var c = s.charCodeAt(i);
+		if (c >= 0x30 && c <= 0x39) return c - 0x30;
+		if (c >= 0x61 && c <= 0x66) return c - 0x57;
+		throw `invalid hex at ${i} in ${s}: ${s.charAt(i)}`
 	}
 
 	if (log_display) {
@@ -720,148 +859,80 @@ function display(s)
 		pend_escape = '';
 	}
 
-	while (true) {
-		next_esc = s.indexOf('\\');
-		if (next_esc === -1) next_esc = s.length;
-		/* |toesc| check below is to not allow empty strings
-		   onto pend_display, as we would otherwise be unable to
-		   interpret utf-8 multibyte chars later on, as these
-		   must be contiguous byte values in the array. We don't
-		   want dtach and related stuff to become utf-8 aware so
-		   we handle that awkardness here. */
-		if (next_esc > 0) {
-			toesc = s.substr(0, next_esc)
-				.replaceAll('\n', '');
-			if (toesc) pend_display.push(toesc);
-			s = s.substr(next_esc);
-		}
+	sl = s.length;
 
-		if (!s) break;
+	/* At most three UTF-8 bytes per UTF-16 code unit */
+	inbyrsrv(sl * 3);
 
-		nli = s.indexOf('\n');
-		if (nli == -1) {
-			// Escape may be incomplete, since we haven't
-			// received a full line from the server.
-			pend_escape = s;
-			break;
-		}
-
-		if (s.startsWith('\\@')) {
-			coldex = s.indexOf(':');
-			escpylo = s.substring(coldex+1, nli);
-			esclen = nli + 1;
-		} else esclen = 3;
-
-		if (s.startsWith('\\@state:')) {
-			console.log(	'got new term state from server;',
-					'JSON size: ', escpylo.length);
-			escpylo		= JSON.parse(escpylo);
-			bufsa		= escpylo.bs;
-			bufsfreehead	= escpylo.fh;
-			t		= escpylo.t;
-			term4cli();
-			topr		= deqmk();
-			escpylo.oc = 0;
-			escpylo.os = 0;
-			bufsa.forEach(function(a, ai)
-			{
-				if (typeof a == 'object') {
-					bufsa[ai] = new Int32Array(a);
-					escpylo.os += bufsa[ai].length;
-					escpylo.oc += 1;
-				}
-			});
-			console.log(	'no. objects:',	escpylo.oc,
-					'no. words:',	escpylo.os);
-
-			/* When re-establishing a connection, we need to set
-			terminal size AFTER receiving a new state. Before the
-			server receives \i{endptid}, it will not send subproc
-			activity to the client, so I believe sending the
-			terminal size too soon after \i{endptid} will cause the
-			terminal redraw to never be sent. */
-			imposetsize();
-		}
-		else if (s.startsWith('\\@title:')) {
-			row_ttl = escpylo;
-			locked_ttl = !!row_ttl;
-			set_title();
-		}
-		else if (s.startsWith('\\@auxjs:')) {
-			loadauxjs(escpylo);
-		}
-		else if (s.startsWith('\\@appendid:')) {
-			termid += escpylo;
-			history.replaceState(
-				{}, '', '/?termid=' + termid);
-		}
-		else if (s.startsWith('\\!'))
-			console.debug('received keepalive response');
-		else
-			pend_display.push(hex_val(1) * 16 + hex_val(2));
+	for (si = 0; si < sl; si++) {
+		c = s.charCodeAt(si);
 
-		s = s.substr(esclen);
-	}
-
-	if (!term_ready) return;
-
-	for (pend_i = 0; pend_i < pend_display.length; pend_i++) {
-		if (typeof pend(0) === 'string') {
-			topr = deqpshutf8(topr, pend(0), -1);
+		if (c == 0x0a) {
+			if (kanl) { kanl = 0; ctl++; }
 			continue;
 		}
 
-		if (pend(0) < 0x80) {
-			topr = deqpushbyt(topr, pend(0));
+		if (c < 0x80 && c != 0x5c) {
+			inby[inbyn++] = c;
 			continue;
 		}
 
-		c = 0;
-		pend_remain = pend_display.length - pend_i;
-		if (pend_remain < 2) break;
-		if (!is_utf_trail(1)) continue;
-		c += pend(1) & ~0xc0;
-
-		if (0xc0 == (pend(0) & 0xe0)) {
-			c += (pend(0) & ~0xe0) << 6;
-			topr = deqpushcop(topr, c);
-			pend_i+=1;
+		if (c != 0x5c) {
+			/* Not sent by the server, but local notices may
+			   contain arbitrary text. */
+			sur = c >= 0xd800 && c < 0xdc00 ? 2 : 1;
+			inbyn += tmu8enc.encodeInto(
+				s.substr(si, sur), inby.subarray(inbyn)).written;
+			si += sur - 1;
 			continue;
 		}
 
-		c <<= 6;
-		if (pend_remain < 3) break;
-		if (!is_utf_trail(2)) continue;
-		c += pend(2) & ~0xc0;
-
-		if (0xe0 == (pend(0) & 0xf0)) {
-			c += (pend(0) & ~0xf0) << 12;
-			topr = deqpushcop(topr, c);
-			pend_i+=2;
-			continue;
-		}
+		/* Escape may be incomplete, since we haven't received the
+		   rest of it from the server. */
+		if (si + 1 == sl) { pend_escape = s.substr(si); break; }
+
+		switch (s.charAt(si + 1)) {
+		case '@':
+			nli = s.indexOf('\n', si);
+			if (nli == -1) { pend_escape = s.substr(si); si = sl; break; }
+
+			coldex = s.indexOf(':', si);
+			nm = s.substring(si + 2, coldex);
+			ctlmsg(nm, s.substring(coldex + 1, nli));
+			if (nm == 'state')	{ ost = nli + 1; ctl = 0; }
+			else			ctl += nli + 1 - si;
+			si = nli;
+			break;
 
-		c <<= 6;
-		if (pend_remain < 4) break;
-		if (!is_utf_trail(3)) continue;
-		c += pend(3) & ~0xc0;
+		case '!':
+			console.debug('received keepalive response');
+			si++;
+			ctl += 2;
+			kanl = 1;
+			break;
 
-		if (0xf0 == (pend(0) & 0xf8)) {
-			c += (pend(0) & ~0xf8) << 18;
-			topr = deqpushcop(topr, c);
-			pend_i+=3;
-			continue;
+		default:
+			if (si + 2 >= sl) { pend_escape = s.substr(si); si = sl; break; }
+			inby[inbyn++] = hex_val(si + 1) * 16 + hex_val(si + 2);
+			si += 2;
 		}
-
-		console.warn('not a valid utf8 sequence');
-		topr = deqpushbyt(topr, ORD('?'));
 	}
 
-	twrite(t, topr, -1, 0);
-	draw(t);
-	deqclear(topr);
+	if (srv) outseq += sl - pend_escape.length - ost - ctl;
+
+	if (!term_ready) return;
 
-	pend_display = pend_display.slice(pend_i);
+	fedn = inbycomplete();
+	if (fedn) {
+		topr = deqldbyts(topr, inby, fedn);
+		twrite(t, topr, -1, 0);
+		deqclear(topr);
+
+		inby.copyWithin(0, fedn, inbyn);
+		inbyn -= fedn;
+	}
+	if (sbtop < 0)	draw(t);
+	else		sbdraw();
 
 	if (locked_ttl || keep_row_ttl) return;
 
@@ -873,6 +944,46 @@ function display(s)
 	}, 2000);
 }
 
+/* Benchmark of the output path through display(), run by opening the page with
+   benchdisp=REPS added to the query args of a replay (see replay). The whole
+   recorded session is fetched from /replay as fast as it can be sent, in the
+   form a session sends output, and each message in it, the output of one read
+   from the pty, is passed to display() REPS times over. The time per message
+   and per byte is printed to the terminal and the JS console. */
+function benchdisp(reps)
+{
+	replaying = 1;
+	fetch('/replay' + location.search + '&speed=1e9').then(function(resp)
+	{
+		if (!resp.ok) throw `/replay failed: ${resp.status}`;
+		return resp.text();
+	}).then(function(rec)
+	{
+		var msgs = rec.split(/(?<=\n)/);
+
+		/* display() only decodes until the font is loaded. */
+		function run()
+		{
+			var ri, st, ns, res;
+
+			if (!term_ready) { setTimeout(run, 100); return }
+
+			reps = Math.max(1, reps | 0);
+			st = performance.now();
+			for (ri = 0; ri < reps; ri++)
+				msgs.forEach(function(m) { display(m) });
+			ns = (performance.now() - st) * 1e6;
+
+			res = `benchdisp: ${msgs.length} msgs x ${reps}, `
+				+ `${(ns / msgs.length / reps).toFixed(0)} ns/op, `
+				+ `${(ns / rec.length / reps).toFixed(2)} ns/byte`;
+			console.log(res);
+			termwrite('\n' + res + '\n');
+		}
+		run();
+	}).catch(function(e) { termwrite(`benchdisp: ${e}\n`) });
+}
+
 function termwrite(s)
 {
 	var m = deqmk();
@@ -884,8 +995,12 @@ function termwrite(s)
 
 function reportwebsockerr(wse)
 {
+	var msg = 'error connecting websocket - see JS console';
+
 	console.log('error connecting websocket:', wse);
-	termwrite('error connecting websocket - see JS console\r');
+	if (outep)	notice(msg);
+	else		termwrite(msg + '\r');
+	if (sockfails) reconnect();
 }
 
 function doauthn()
@@ -970,7 +1085,9 @@ function doauthn()
 
 function keepali()
 {
-	if (sock && sock.readyState == WebSocket.OPEN) signal('\\!\n');
+	/* The worker keeps a multiplexed websocket alive itself. */
+	if (sock && sock.readyState == WebSocket.OPEN && !sock.mux)
+		signal('\\!\n');
 	/* Re-send every 60-80 seconds. This uses non-determinism to avoid every
 	browser window sending the heartbeat at the same time in the case of
 	a restored session (or something that opens several terminal tabs at
@@ -979,30 +1096,165 @@ function keepali()
 }
 keepali();
 
+/* A hidden tab asks the session to stop sending output, and when shown gets
+   what it missed, or the state if it missed a lot. */
+document.addEventListener('visibilitychange', function()
+{
+	if (sock && sock.readyState == WebSocket.OPEN)
+		signal(document.hidden ? '\\P' : '\\p');
+
+	/* A tab that is shown again stops waiting as a hidden one does. */
+	if (reconntmr && !document.hidden) {
+		clearTimeout(reconntmr);
+		reconntmr = 0;
+		reconnect();
+	}
+});
+
+/* Connection attempts that failed since a websocket was last open, and the
+   timer for the next attempt. */
+var sockfails = 0, reconntmr = 0;
+
+/* Connects again after a random delay of up to 250ms, doubled for each failed
+   attempt up to 30 seconds, so tabs that lose their connections together, or
+   are refused because too many are connecting (see ADMITSLOTS in http.h),
+   come back spread out rather than all at once. Hidden tabs wait four times as
+   long, leaving the server to the visible ones first. */
+function reconnect()
+{
+	var bound = Math.min(30000, 250 * 2 ** sockfails);
+
+	if (reconntmr) return;
+	if (document.hidden) bound *= 4;
+
+	reconntmr = setTimeout(function()
+	{
+		reconntmr = 0;
+		prepare_sock();
+	}, Math.random() * bound);
+}
+
+/* Whether to attach through the websocket shared by all tabs (see mux.js). Only
+   sessions named with termid can, and only with the query args a pooled master
+   accepts. localStorage.nomux turns this off. */
+function usemux()
+{
+	var k;
+
+	if (!window.SharedWorker || localStorage.nomux) return 0;
+	if (!termid) return 0;
+
+	for (k of new URLSearchParams(location.search).keys())
+		if (k != 'termid' && k != 'resume' && k != 'diff') return 0;
+
+	return 1;
+}
+
+/* Makes a channel of the shared websocket for query string q, which acts like
+   a WebSocket as far as this file uses one. */
+function muxsock(q)
+{
+	var ms = {readyState: WebSocket.CONNECTING, mux: 1},
+		port = new SharedWorker('/mux.js').port;
+
+	port.onmessage = function(e)
+	{
+		var m = e.data;
+
+		switch (m.op) {
+		case 'open':
+			ms.readyState = WebSocket.OPEN;
+			ms.onopen();
+			break;
+		case 'data':
+			ms.onmessage({data: m.d});
+			break;
+		case 'error':
+			ms.onerror(m);
+			break;
+		case 'close':
+			ms.readyState = WebSocket.CLOSED;
+			port.close();
+			ms.onclose(m);
+			break;
+		}
+	};
+
+	ms.send = function(s) { port.postMessage({op: 'send', d: s}) };
+	ms.close = function()
+	{
+		if (ms.readyState == WebSocket.CLOSED) return;
+		ms.readyState = WebSocket.CLOSED;
+		port.postMessage({op: 'close'});
+		port.close();
+	};
+
+	port.postMessage({op: 'open', q: q.replace(/^\?/, '')});
+	return ms;
+}
+
+/* The worker cannot tell when a tab goes away. A tab restored from the
+   back-forward cache comes back with its channel closed, so it attaches again,
+   resuming from the output it has. */
+window.addEventListener('pagehide', function()
+{
+	if (sock && sock.mux) sock.close();
+});
+window.addEventListener('pageshow', function(ev)
+{
+	if (!ev.persisted || !sock || !sock.mux) return;
+	if (sock.readyState == WebSocket.CLOSED) prepare_sock();
+});
+
 function prepare_sock()
 {
-	sock = new WebSocket(
-		location.origin.replace(/^http/, 'ws') + '/' + location.search);
+	var q = location.search, opened = 0;
+
+	/* When reconnecting, ask for only the output missed since. A partial
+	   escape is sent again. */
+	if (outep && termid && !diffmode) {
+		q += '&resume=' + outep + '.' + outseq;
+		pend_escape = '';
+		kanl = 0;
+	}
+
+	/* Lets the server admit visible tabs first. */
+	if (document.hidden) q += (q ? '&' : '?') + 'hidden=1';
+
+	if (usemux())	sock = muxsock(q);
+	else		sock = new WebSocket(
+				location.origin.replace(/^http/, 'ws') + '/' + q);
 	/* signalsize implicitly sends pending sends that have
 	   accumulated while disconnected. */
-	sock.onopen = function() { signal('\\i' + endptid()) };
+	sock.onopen = function()
+	{
+		opened = 1;
+		sockfails = 0;
+		signal('\\i' + endptid());
+		if (document.hidden) signal('\\P');
+	};
 
 	sock.onmessage = function(e) {
 		if (log_packin)
 			console.log(`packet in ${e.data.length} chr(s)`,
 				    [e.data]);
-		display(e.data);
+		display(e.data, 1);
 	};
 
-	sock.onclose = function(e)
-	{
-		var mtxt = '[lost connection to server]';
-		display(mtxt + mtxt.replaceAll(/./g, '\\08') + '\n');
-	};
+	/* Notices about the connection are drawn over the screen rather than
+	   written to it, as a resumed client is sent only the output it missed
+	   and must have the same screen as the master. */
+	sock.onclose = function(e) { notice('[lost connection to server]') };
 
 	sock.onerror = function(e)
 	{
 		var athreq, as;
+
+		/* Browsers do not say why a handshake failed, so a failure is
+		   retried on the client's own schedule rather than a
+		   Retry-After. */
+		if (!opened) sockfails++;
+
 		if (!window.relyingparty) 	{ reportwebsockerr(e);	return }
 		if (!localStorage['authnid'])	{ newcred();		return }
 
@@ -1011,12 +1263,150 @@ function prepare_sock()
 	};
 }
 
+/* Plays back a timed raw log (sblvl=t in the README) instead of attaching to a
+   session. The page's query string is passed to /replay, whose output is in the
+   same form a session sends and is displayed as it arrives. Input is ignored,
+   and the terminal keeps the size it had when recorded. */
+function replay()
+{
+	var dec = new TextDecoder();
+
+	replaying = 1;
+	fetch('/replay' + location.search).then(function(resp)
+	{
+		var rd = resp.body.getReader();
+
+		if (!resp.ok) {
+			termwrite(`replay failed: ${resp.status}\n`);
+			return;
+		}
+
+		function more(r)
+		{
+			if (r.done) return;
+			display(dec.decode(r.value, {stream: true}));
+			return rd.read().then(more);
+		}
+		return rd.read().then(more);
+	});
+}
+
+/* The scrollback view. sbtop is the number of the scrollback line at the top
+   of the screen, or -1 to show the live screen. Lines come from the scrollback
+   ring of the master in \\@sbpage messages and are kept in sbcache by number
+   until the view is closed. sbasked holds the numbers of lines requested with
+   \\b. Lines before sbfirst were dropped from the ring. */
+var sbtop = -1, sbfirst = 0, sbcache = new Map(), sbasked = new Set(),
+	sbnoline = new Int32Array([2, 0]);
+
+function sbtotal()
+{
+	var r = term(t,sbring);
+
+	return r ? sbr_first(r) + sbr_cnt(r) : 0;
+}
+
+/* Requests the lines numbered from to to-1 that are not cached or requested
+   already. */
+function sbask(from, to)
+{
+	var i, lo = -1, hi;
+
+	if (from < sbfirst) from = sbfirst;
+	if (to > sbtotal()) to = sbtotal();
+
+	for (i = from; i < to; i++) {
+		if (sbcache.has(i) || sbasked.has(i)) continue;
+		if (lo < 0) lo = i;
+		hi = i;
+		sbasked.add(i);
+	}
+	if (lo < 0) return;
+
+	signal(	'\\b'						+
+		lo.toString().padStart(10, '0')			+
+		Math.min(9999, hi - lo + 1).toString().padStart(4, '0'));
+}
+
+/* Draws the screen from scrollback line sbtop, followed by as much of the live
+   screen as fits. Lines not received yet are blank. */
+function sbdraw()
+{
+	var	tot = sbtotal(), rows = term(t,row), cols = term(t,col),
+		scra = term_cellf(t, rows, 0), r, l, x;
+
+	for (r = 0; r < rows; r++) {
+		if (sbtop + r >= tot) {
+			term_setbuffromrow(t, sbtop + r - tot);
+		} else {
+			l = jsobj_alloc(sbcache.get(sbtop + r) || sbnoline);
+			sbrunpack(t, l, 0, term(t,row));
+			tmfree(l);
+		}
+
+		for (x = 0; x < cols; x++)
+			Xdrawglyph(t, scra + x * GLYPH_ELCNT, x, r);
+	}
+
+	gl.flush();
+}
+
+/* Moves the scrollback view n lines back, or forward if n is negative. Moving
+   past the end returns to the live screen. */
+function sbscroll(n)
+{
+	var tot = sbtotal(), rows = term(t,row);
+
+	sbtop = (sbtop < 0 ? tot : sbtop) - n;
+	if (sbtop < sbfirst) sbtop = sbfirst;
+	if (sbtop >= tot) { sbleave(); return; }
+
+	/* Fetch a page ahead in the direction we are likely to go. */
+	sbask(sbtop - rows, sbtop + rows);
+	sbdraw();
+}
+
+function sbleave()
+{
+	if (sbtop < 0) return;
+
+	sbtop = -1;
+	sbcache.clear();
+	sbasked.clear();
+	tfulldirt(t);
+	draw(t);
+}
+
+/* Shows the screen image the master keeps (/screen), so the screen comes up
+   before the session sends its state, which replaces it. */
+function loadscreen()
+{
+	fetch('/screen?termid=' + encodeURIComponent(termid)).then(function(resp)
+	{
+		return resp.ok ? resp.arrayBuffer() : null;
+	}).then(function(ab)
+	{
+		var it;
+
+		if (!ab || gotstate || !(it = tmimgload(ab))) return;
+
+		t	= it;
+		topr	= deqmk();
+		term4cli();
+		sbleave();
+		tfulldirt(t);
+		if (term_ready) draw(t);
+	});
+}
+
 function signal(s)
 {
 	var s;
 
+	if (replaying) return;
+
 	pend_send.push(s);
-	if (sock.readyState >	WebSocket.OPEN) prepare_sock();
+	if (sock.readyState >	WebSocket.OPEN) reconnect();
 	if (sock.readyState !=	WebSocket.OPEN) return;
 
 	while (pend_send.length) {
@@ -1087,8 +1477,8 @@ function process_key_down(e)
 			case 'bs': signal(pref + '\x17');		return true;	/* C+W */
 			case 'en': signal(pref + '\x0e');		return true;	/* C+N */
 			case 'ta': signal(pref + '\x1b\x5b\x5a');	return true;
-			case 'pu':					return true;
-			case 'pd':					return true;
+			case 'pu': sbscroll(+Math.max(1, term(t,row) - 1));	return true;
+			case 'pd': sbscroll(-Math.max(1, term(t,row) - 1));	return true;
 			case 'ho':					return true;
 			case 'nd':					return true;
 			case 'up':					return true;
@@ -1807,6 +2197,11 @@ function sporkeydown(e)
 
 	if (capsonwhile && !ce.mn.match(capsonwhile)) capsonwhile = 0;
 
+	/* Typing returns to the live screen. */
+	if (	!ce.mn.match(/^[lr][scaw]$/)
+	&&	!(ce.shiftKey && ce.mn.match(/^p[ud]$/)))
+		sbleave();
+
 	// Let search+right alt (in that order) turn on capslock.
 	if (ce.mn == 'ra' && ce.metaKey) return;
 
@@ -1861,9 +2256,13 @@ window.onload = function()
 {
 	term_canv();
 
-	prepare_sock();
 	params = new URLSearchParams(window.location.search);
 	termid = params.get('termid');
+	diffmode = params.has('diff');
+	if (params.has('benchdisp'))	benchdisp(+params.get('benchdisp'));
+	else if (params.has('replay'))	replay();
+	else				prepare_sock();
+	if (termid && !replaying)	loadscreen();
 	dead_key_hist = ['?', 'x', '?', 'x'];
 	display('');
 
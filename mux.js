@@ -0,0 +1,117 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+/* SharedWorker that keeps one websocket to /mux for every tab of the origin.
+Each SharedWorker object a tab makes has its own port here, which gets a
+channel on the websocket (see becomemux in session.c for the messages).
+
+Messages from a port:
+	{op: 'open', q: QUERY}	open the channel for the session in QUERY
+	{op: 'send', d: DATA}	send DATA to the session
+	{op: 'close'}		close the channel
+
+Messages to a port:
+	{op: 'open'}		the channel can be sent to
+	{op: 'data', d: DATA}	output of the session
+	{op: 'error'}		the websocket failed before it opened
+	{op: 'close'}		the channel is closed */
+
+var ws, chans = new Map(), nextch = 1;
+
+function wsopen() { return ws && ws.readyState == WebSocket.OPEN }
+
+function chclose(id, op)
+{
+	var port = chans.get(id);
+
+	if (!port) return;
+	chans.delete(id);
+	if (op) port.postMessage({op: op});
+	port.postMessage({op: 'close'});
+}
+
+function connect()
+{
+	var wasopen;
+
+	ws = new WebSocket(location.origin.replace(/^http/, 'ws') + '/mux');
+
+	ws.onopen = function()
+	{
+		wasopen = 1;
+		chans.forEach(function(port, id)
+		{
+			ws.send('o' + id + ':' + port.q);
+			port.postMessage({op: 'open'});
+		});
+	};
+
+	ws.onmessage = function(e)
+	{
+		var d = e.data, ci = d.indexOf(':'), id = +d.substring(1, ci),
+			port = chans.get(id);
+
+		switch (d.charAt(0)) {
+		case 'd':
+			if (port) port.postMessage({op: 'data', d: d.substring(ci + 1)});
+			break;
+		case 'c':
+			chclose(id);
+			break;
+		}
+	};
+
+	/* Every channel is lost with the websocket. Tabs open them again as
+	   they reconnect, which makes a new websocket. */
+	ws.onclose = function()
+	{
+		ws = null;
+		chans.forEach(function(port, id)
+		{
+			chclose(id, wasopen ? 0 : 'error');
+		});
+	};
+}
+
+function portmsg(port, m)
+{
+	switch (m.op) {
+	case 'open':
+		port.id = nextch++;
+		port.q = m.q;
+		chans.set(port.id, port);
+
+		if (!ws) connect();
+		else if (wsopen()) {
+			ws.send('o' + port.id + ':' + port.q);
+			port.postMessage({op: 'open'});
+		}
+		break;
+	case 'send':
+		if (wsopen() && chans.has(port.id))
+			ws.send('d' + port.id + ':' + m.d);
+		break;
+	case 'close':
+		if (!chans.delete(port.id)) break;
+		if (wsopen()) ws.send('c' + port.id + ':');
+		break;
+	}
+}
+
+onconnect = function(e)
+{
+	var port = e.ports[0];
+
+	port.onmessage = function(m) { portmsg(port, m.data) };
+};
+
+/* One keepalive for all tabs, every 60-80 seconds as each tab did before. */
+function keepali()
+{
+	if (wsopen()) ws.send('k0:');
+	setTimeout(keepali, 60000 + Math.random() * 20000);
+}
+keepali();
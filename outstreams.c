@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 
 #include "outstreams.h"
@@ -70,11 +71,12 @@ static void fullwriannot(struct wrides *de, const unsigned char *br, size_t sz)
 	fdb_apnd(&eb, "[", -1);
 
 	while (sz--) {
-		esc[0] = *br++;
+		esc[0] = *br;
 		esc[1] = 0;
 
-		if (*esc == '\\') strcpy(esc, "\\\\");
-		else if (*esc < ' ') sprintf(esc, "\\%03o", *esc);
+		if (*br == '\\') strcpy(esc, "\\\\");
+		else if (*br < ' ' || *br > '~') sprintf(esc, "\\%03o", *br);
+		br++;
 
 		fdb_apnd(&eb, esc, -1);
 	}
@@ -120,30 +122,134 @@ void fdb_routc(struct fdbuf *b, int c)
 	}
 }
 
+/* Makes sure there are at least least free bytes at the end of b, and want if
+   b has no descriptor, flushing or growing it as needed. Returns the number of
+   free bytes. */
+static size_t fdb_room(struct fdbuf *b, size_t want, size_t least)
+{
+	size_t avail, ncap;
+
+	if (!b->bf) {
+		if (!b->cap) b->cap = 64;
+		b->bf = malloc(b->cap);
+	}
+
+	avail = b->cap - b->len;
+	if (avail >= want) return avail;
+
+	if (b->de) {
+		if (avail >= least) return avail;
+
+		full_write(b->de, b->bf, b->len);
+		b->len = 0;
+		if (b->cap >= least) return b->cap;
+		want = least;
+	}
+
+	ncap = b->cap + b->cap / 2;
+	if (ncap < b->len + want) ncap = b->len + want;
+	b->cap = ncap;
+	b->bf = realloc(b->bf, b->cap);
+
+	return b->cap - b->len;
+}
+
+#define ONES	0x0101010101010101ull
+#define HIGHS	0x8080808080808080ull
+
+/* Nonzero if any byte of w is less than n, which is at most 128, or equal to
+   one of e1 and e2. */
+static uint64_t wordneeds(uint64_t w, int n, int e1, int e2)
+{
+	uint64_t x1 = w ^ ONES * e1, x2 = w ^ ONES * e2;
+
+	return	((w - ONES * n) & ~w & HIGHS)
+	|	((x1 - ONES) & ~x1 & HIGHS)
+	|	((x2 - ONES) & ~x2 & HIGHS);
+}
+
+static int routneeds(int c) { return c == '\\' || c < ' ' || c > '~'; }
+static int jsonneeds(int c) { return c == '\\' || c < ' ' || c == '"'; }
+
+/* Returns how many bytes at the start of s, up to n, need no escaping for
+   fdb_json if json is set, or for fdb_routs if not. Checks 16 bytes at a time
+   while none of them need it. */
+static size_t cleanrun(const unsigned char *s, size_t n, int json)
+{
+	uint64_t w0, w1, hit;
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		memcpy(&w0, s + i, 8);
+		memcpy(&w1, s + i + 8, 8);
+
+		if (json)
+			hit =	wordneeds(w0, ' ', '"', '\\')
+			|	wordneeds(w1, ' ', '"', '\\');
+		else
+			hit =	wordneeds(w0, ' ', 0x7f, '\\')
+			|	wordneeds(w1, ' ', 0x7f, '\\')
+			|	((w0 | w1) & HIGHS);
+		if (hit) break;
+	}
+
+	if (json)	while (i < n && !jsonneeds(s[i])) i++;
+	else		while (i < n && !routneeds(s[i])) i++;
+
+	return i;
+}
+
+/* Appends s escaped for fdb_routs or fdb_json, copying runs that need no
+   escaping with memcpy. */
+static void escbulk(struct fdbuf *b, const unsigned char *s, size_t len,
+		    int json)
+{
+	size_t esclen = json ? 6 : 3, room, run;
+	unsigned char *o;
+
+	while (len) {
+		room = fdb_room(b, len * esclen, esclen);
+		o = b->bf + b->len;
+
+		for (;;) {
+			run = cleanrun(s, len < room ? len : room, json);
+			memcpy(o, s, run);
+			o += run;
+			s += run;
+			len -= run;
+			room -= run;
+
+			if (!len || room < esclen) break;
+
+			if (json) {
+				memcpy(o, "\\u00", 4);
+				o += 4;
+			}
+			else *o++ = '\\';
+			*o++ = hexdig_lc(*s >> 4);
+			*o++ = hexdig_lc(*s);
+			s++;
+			len--;
+			room -= esclen;
+		}
+
+		b->len = o - b->bf;
+	}
+}
+
 void fdb_routs(struct fdbuf *b, const char *s, ssize_t len)
 {
 	if (len < 0) len = strlen(s);
 
-	while (len--) fdb_routc(b, *s++);
+	escbulk(b, (const unsigned char *)s, len, 0);
 }
 
 void fdb_json(struct fdbuf *b, const char *s, ssize_t len)
 {
-	int c;
-
 	if (len < 0) len = strlen(s);
 
 	fdb_apnc(b, '"');
-	while (len--) {
-		c = *s++ & 0xff;
-		if (c < ' ' || c == '"' || c == '\\') {
-			fdb_apnd(b, "\\u00", -1);
-			fdb_apnc(b, hexdig_lc(c >> 4));
-			fdb_apnc(b, hexdig_lc(c));
-		}
-		else
-			fdb_apnc(b, c);
-	}
+	escbulk(b, (const unsigned char *)s, len, 1);
 	fdb_apnc(b, '"');
 }
 
@@ -188,6 +294,11 @@ void full_write(struct wrides *de, const void *buf_, ssize_t sz)
 	if (sz < 0) abort();
 	if (!sz) return;
 
+	if (de->to) {
+		fdb_apnd(de->to, buf_, sz);
+		return;
+	}
+
 	if (de->escannot) {
 		fullwriannot(de, buf_, sz);
 		return;
@@ -212,10 +323,21 @@ void full_write(struct wrides *de, const void *buf_, ssize_t sz)
 	} while (sz);
 }
 
+/* Put before each frame's payload while output is for a channel of a
+   multiplexed websocket. */
+static char wbsocpfx[16];
+
+void wbsoc_channel(int ch)
+{
+	if (ch < 0)	*wbsocpfx = 0;
+	else		snprintf(wbsocpfx, sizeof(wbsocpfx), "d%d:", ch);
+}
+
 void write_wbsoc_frame(const void *buf, ssize_t len)
 {
-	unsigned char headr[14];
-	struct iovec v[2], *vc;
+	unsigned char headr[10];
+	struct iovec v[3], *vc;
+	size_t pfxlen = strlen(wbsocpfx), flen;
 	uint16_t len2;
 	uint32_t len4;
 	ssize_t writn;
@@ -227,39 +349,39 @@ void write_wbsoc_frame(const void *buf, ssize_t len)
 
 	/* Send as a single text data frame. */
 	headr[0] = 0x81;
+	flen = pfxlen + len;
 
 	v[0].iov_base = headr;
-	if (len <= 125) {
-		headr[1] = len;
+	if (flen <= 125) {
+		headr[1] = flen;
 		v[0].iov_len = 2;
 	}
-	else if (len <= 0xffff) {
+	else if (flen <= 0xffff) {
 		headr[1] = 126;
-		len2 = htons(len);
+		len2 = htons(flen);
 		memcpy(headr + 2, &len2, 2);
 		v[0].iov_len = 4;
 	}
 	else {
-		headr[2] = 127;
-		len4 = htonl(len >> 32);
+		headr[1] = 127;
+		len4 = htonl((uint64_t) flen >> 32);
 		memcpy(headr + 2, &len4, 4);
-		len4 = htonl(len);
+		len4 = htonl(flen);
 		memcpy(headr + 6, &len4, 4);
 		v[0].iov_len = 10;
 	}
 
-	v[1].iov_base = (void *) buf;
-	v[1].iov_len = len;
+	v[1].iov_base = wbsocpfx;
+	v[1].iov_len = pfxlen;
+	v[2].iov_base = (void *) buf;
+	v[2].iov_len = len;
 
 	vc = v;
 
-	writn = 0;
 	for (;;) {
-		vc->iov_len -= writn;
-
-		writn = writev(1, vc, v+2 - vc);
+		writn = writev(1, vc, v+3 - vc);
 		if (writn < 0) {
-			if (writn == EINTR) continue;
+			if (errno == EINTR) continue;
 			perror("writev websocket frame");
 			abort();
 		}
@@ -267,8 +389,10 @@ void write_wbsoc_frame(const void *buf, ssize_t len)
 
 		while (writn >= vc->iov_len) {
 			writn -= vc->iov_len;
-			if (++vc == v + 2) return;
+			if (++vc == v + 3) return;
 		}
+		vc->iov_base = (char *) vc->iov_base + writn;
+		vc->iov_len -= writn;
 	}
 }
 
@@ -295,10 +419,55 @@ void _Noreturn exit_msg(const char *flags, const char *msg, int code)
 	exit(iserr);
 }
 
+/* Prints the frames write_wbsoc_frame writes, with and without a channel, and
+   the header of one too long for a 16-bit length. */
+static void tstwbsoc(void)
+{
+	static char big[0x10001];
+	struct wrides de = {1, "wbsoc"};
+	unsigned char fb[256];
+	int p[2], sout;
+	ssize_t redn;
+
+	if (pipe(p)) { perror("pipe"); exit(1); }
+	sout = dup(1);
+	dup2(p[1], 1);
+
+	write_wbsoc_frame("plain", -1);
+	wbsoc_channel(42);
+	write_wbsoc_frame("on channel", -1);
+	wbsoc_channel(-1);
+	write_wbsoc_frame("", 0);
+	write_wbsoc_frame("plain again", -1);
+
+	dup2(sout, 1);
+	close(p[1]);
+	redn = read(p[0], fb, sizeof(fb));
+	full_write(&de, fb, redn);
+
+	/* A pipe holds less than the frame, so only check the header. */
+	if (pipe(p)) { perror("pipe"); exit(1); }
+	dup2(p[1], 1);
+	memset(big, 'x', sizeof(big));
+	if (!fork()) {
+		close(p[0]);
+		write_wbsoc_frame(big, sizeof(big));
+		_exit(0);
+	}
+	dup2(sout, 1);
+	close(sout);
+	close(p[1]);
+	redn = read(p[0], fb, 12);
+	full_write(&de, fb, redn);
+	close(p[0]);
+	wait(0);
+}
+
 void test_outstreams(void)
 {
 	struct wrides de = {1};
-	struct fdbuf b = {&de, 32};
+	struct fdbuf b = {&de, 32}, eb = {0};
+	unsigned char raw[1000];
 	int i;
 
 	printf("TEST OUTSTREAMS\n");
@@ -356,4 +525,41 @@ void test_outstreams(void)
 	b.cap = 16;
 	for (i = 0; i < 50; i++) fdb_apnd(&b, i & 1 ? "abc" : "123", i % 3);
 	fdb_finsh(&b);
+
+	/* Escaping in bulk must match escaping each byte, wherever the bytes
+	   that need it fall in the blocks checked at once. */
+	for (i = 0; i < sizeof(raw); i++)
+		raw[i] = i % 7 && i % 11 ? 'a' + i % 26 : i * 37;
+	b.de = 0;
+	fdb_routs(&b, (char *)raw, sizeof(raw));
+	for (i = 0; i < sizeof(raw); i++) fdb_routc(&eb, raw[i]);
+	printf("routs same as routc: %d\n",
+	       b.len == eb.len && !memcmp(b.bf, eb.bf, b.len));
+	fdb_finsh(&b);
+	fdb_finsh(&eb);
+
+	de.escannot = "routs";
+	b.de = &de;
+	b.cap = 8;
+	fdb_routs(&b, "0123456789abcdef\033[1mbold\\\177 caf\303\251", -1);
+	fdb_finsh(&b);
+
+	de.escannot = "json";
+	b.cap = 16;
+	fdb_json(&b, "tab\there \"q\" back\\ \001 caf\303\251 0123456789abcdef",
+		 -1);
+	fdb_finsh(&b);
+
+	/* Writes held in a buffer are kept in order and not flushed. */
+	de.to = &eb;
+	b.cap = 4;
+	fdb_apnd(&b, "held ", -1);
+	fdb_apnd(&b, "back", -1);
+	fdb_finsh(&b);
+	full_write(&de, "!", 1);
+	printf("held: %.*s\n", (int) eb.len, eb.bf);
+	fdb_finsh(&eb);
+	de.to = 0;
+
+	tstwbsoc();
 }
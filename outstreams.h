@@ -23,6 +23,10 @@ struct wrides {
 	 * Intended for more readable test output.
 	 */
 	const char *escannot;
+
+	/* If non-null, writes are appended to this buffer rather than written
+	 * to fd, such as to hold them until fd can take them. */
+	struct fdbuf *to;
 };
 
 /* Comprises a file descriptor and a buffer which is pending a write to it.
@@ -89,6 +93,11 @@ void full_write(struct wrides *de, const void *buf_, ssize_t len);
 /* Writes data in buffer as a websocket data frame to stdout. */
 void write_wbsoc_frame(const void *buf, ssize_t len);
 
+/* Makes write_wbsoc_frame send its data as output of channel ch of a
+ * multiplexed websocket, by putting "d<ch>:" before it, until this is called
+ * again. Pass -1 to send frames as they are. */
+void wbsoc_channel(int ch);
+
 /* Formats and escapes a message for output to stdout as websocket data.
  * code is concatenated on the end of the message, if it is not -1.
  * flags can be any number of these characters in a string:
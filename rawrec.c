@@ -0,0 +1,522 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "rawrec.h"
+#include "logidx.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long long nowms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void putvar(struct fdbuf *b, unsigned long long v)
+{
+	while (v >= 0x80) {
+		fdb_apnc(b, 0x80 | (v & 0x7f));
+		v >>= 7;
+	}
+	fdb_apnc(b, v);
+}
+
+/* Sums the uncompressed sizes in a frame index. Any unfinished frame after the
+   indexed ones is truncated by the log writer when it reopens the log. */
+static unsigned long long idxulen(int zidx)
+{
+	unsigned long long off, clen, ulen, sum = 0;
+	FILE *f;
+
+	f = fdopen(dup(zidx), "r");
+	if (!f) { perror("open frame index"); return 0; }
+
+	rewind(f);
+	while (3 == fscanf(f, "%llu %llu %llu\n", &off, &clen, &ulen))
+		sum += ulen;
+	fclose(f);
+
+	return sum;
+}
+
+void rec_open(struct recorder *r, struct logsink *s, int ckpfd)
+{
+	struct stat sb;
+
+	r->ckpfd = ckpfd;
+	if (!ckpfd) return;
+
+	if (s->zidx)			r->off = idxulen(s->zidx);
+	else if (!fstat(s->de.fd, &sb))	r->off = sb.st_size;
+	else				perror("stat timed raw log");
+
+	r->ckpoff = r->off;
+}
+
+/* Sends the record in r->b, starting the log first if needed. */
+static void recput(struct recorder *r, struct logsink *s, unsigned long long ms)
+{
+	struct fdbuf st = {0};
+
+	if (!r->started) {
+		r->started = 1;
+		fdb_apnc(&st, 'S');
+		putvar(&st, ms);
+		if (logsink_write(s, st.bf, st.len)) r->off += st.len;
+		r->ms = ms;
+		fdb_finsh(&st);
+	}
+
+	if (!logsink_write(s, r->b.bf, r->b.len)) return;
+	r->off += r->b.len;
+	r->ms = ms;
+}
+
+/* Starts a record in r->b. Returns the current time. */
+static unsigned long long recbegin(struct recorder *r, int tag)
+{
+	unsigned long long ms = nowms();
+
+	r->b.len = 0;
+	fdb_apnc(&r->b, tag);
+
+	/* The clock may be set back, but time never goes back in the log. */
+	if (r->started && ms < r->ms) ms = r->ms;
+	putvar(&r->b, r->started ? ms - r->ms : 0);
+	return ms;
+}
+
+void rec_out(struct recorder *r, struct logsink *s, const void *buf, size_t len)
+{
+	unsigned long long ms;
+
+	if (!len) return;
+
+	ms = recbegin(r, 'o');
+	putvar(&r->b, len);
+	fdb_apnd(&r->b, buf, len);
+	recput(r, s, ms);
+}
+
+void rec_size(struct recorder *r, struct logsink *s, int cols, int rows)
+{
+	unsigned long long ms = recbegin(r, 'w');
+
+	putvar(&r->b, cols);
+	putvar(&r->b, rows);
+	recput(r, s, ms);
+}
+
+int rec_ckpdue(struct recorder *r)
+{
+	unsigned long long ms;
+
+	if (!r->ckpfd || r->off - r->ckpoff < RECCKPBYTES) return 0;
+
+	ms = nowms();
+	if (ms - r->ckpms < RECCKPMS) return 0;
+
+	r->ckpoff = r->off;
+	r->ckpms = ms;
+	return 1;
+}
+
+void rec_ckpput(struct recorder *r, int32_t t, const void *img, size_t imgsz)
+{
+	struct ckphdr h = {"WCKP", imgsz, r->off, r->ms, t, 0};
+	struct iovec iov[] = {
+		{&h, sizeof(h)},
+		{(void *)img, imgsz},
+	};
+
+	/* A single write to a file opened with O_APPEND, so checkpoints from
+	   overlapping children are not interleaved. */
+	if (0 > writev(r->ckpfd, iov, 2)) perror("write checkpoint");
+}
+
+struct recrd {
+	int fd;
+	struct logrd *lr;
+
+	/* Decompressed bytes to drop before the first record. */
+	unsigned long long skip;
+
+	/* Time of the last record */
+	unsigned long long ms;
+
+	unsigned char b[64 * 1024];
+	size_t bi, bn;
+};
+
+/* Finds the last checkpoint at or before at in the checkpoint file of the log at
+   path. A damaged or partly written checkpoint ends the file. */
+static void ckpfind(const char *path, unsigned long long at,
+		   struct ckphdr *ck, struct fdbuf *img)
+{
+	struct ckphdr h;
+	struct stat sb;
+	char *fn;
+	size_t pl = strlen(path);
+	off_t off = 0, best = -1;
+	int fd;
+
+	memset(ck, 0, sizeof(*ck));
+
+	if (pl > 3 && !strcmp(path + pl - 3, ".gz")) pl -= 3;
+	xasprintf(&fn, "%.*s.ckp", (int)pl, path);
+	fd = open(fn, O_RDONLY);
+	free(fn);
+	if (fd < 0) return;
+	if (fstat(fd, &sb)) goto cleanup;
+
+	while (sizeof(h) == pread(fd, &h, sizeof(h), off)
+	       && !memcmp(h.magic, "WCKP", 4)
+	       && off + sizeof(h) + h.imgsz <= (unsigned long long)sb.st_size
+	       && h.ms <= at) {
+		*ck = h;
+		best = off;
+		off += sizeof(h) + h.imgsz;
+	}
+	if (best < 0) goto cleanup;
+
+	img->len = 0;
+	if (img->cap < ck->imgsz) {
+		img->bf = realloc(img->bf, ck->imgsz);
+		img->cap = ck->imgsz;
+	}
+	if (ck->imgsz != pread(fd, img->bf, ck->imgsz, best + sizeof(h))) {
+		warnx("cannot read checkpoint at %lld", (long long)best);
+		memset(ck, 0, sizeof(*ck));
+		goto cleanup;
+	}
+	img->len = ck->imgsz;
+
+cleanup:
+	close(fd);
+}
+
+/* Starts reading a compressed log at the frame holding offset off, and returns
+   the offset where that frame starts. */
+static unsigned long long gzseek(struct logrd *lr, const char *path,
+				 unsigned long long off)
+{
+	unsigned long long start;
+	char *idxfn;
+	int idx;
+
+	xasprintf(&idxfn, "%s.idx", path);
+	idx = open(idxfn, O_RDONLY);
+	free(idxfn);
+	if (idx < 0) return 0;
+
+	start = logrd_seek(lr, idx, off);
+	close(idx);
+	return start;
+}
+
+struct recrd *recrd_open(const char *path, unsigned long long at,
+			 struct ckphdr *ck, struct fdbuf *img)
+{
+	struct recrd *r;
+	size_t pl = strlen(path);
+	int fd, gz;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) { warn("open %s", path); return 0; }
+
+	ckpfind(path, at, ck, img);
+
+	r = calloc(1, sizeof(*r));
+	r->fd = fd;
+	r->ms = ck->ms;
+
+	gz = pl > 3 && !strcmp(path + pl - 3, ".gz");
+	r->lr = logrd_open(fd, gz, ck->recoff);
+	r->skip = gz ? ck->recoff - gzseek(r->lr, path, ck->recoff) : 0;
+
+	return r;
+}
+
+void recrd_close(struct recrd *r)
+{
+	if (!r) return;
+	logrd_close(r->lr);
+	close(r->fd);
+	free(r);
+}
+
+static int rdbyte(struct recrd *r)
+{
+	ssize_t redn;
+	size_t k;
+
+	while (r->bi == r->bn) {
+		redn = logrd_read(r->lr, r->b, sizeof(r->b));
+		if (redn <= 0) return -1;
+
+		k = (unsigned long long)redn < r->skip ? redn : r->skip;
+		r->skip -= k;
+		r->bi = k;
+		r->bn = redn;
+	}
+
+	return r->b[r->bi++];
+}
+
+static int rdvar(struct recrd *r, unsigned long long *v)
+{
+	int c, sh = 0;
+
+	*v = 0;
+	do {
+		c = rdbyte(r);
+		if (c < 0 || sh > 63) return 0;
+		*v |= (unsigned long long)(c & 0x7f) << sh;
+		sh += 7;
+	} while (c & 0x80);
+
+	return 1;
+}
+
+int recrd_next(struct recrd *r, struct recev *ev)
+{
+	unsigned long long dms, len, cols, rows;
+	size_t k;
+	int tag = rdbyte(r);
+
+	ev->tag = 0;
+	ev->dat.len = 0;
+
+	switch (tag) {
+	case 'S':
+		if (!rdvar(r, &r->ms)) return 0;
+		break;
+
+	case 'w':
+		if (!rdvar(r, &dms) || !rdvar(r, &cols) || !rdvar(r, &rows))
+			return 0;
+		r->ms += dms;
+		ev->cols = cols;
+		ev->rows = rows;
+		break;
+
+	case 'o':
+		if (!rdvar(r, &dms) || !rdvar(r, &len)) return 0;
+		r->ms += dms;
+
+		while (len) {
+			if (r->bi == r->bn) {
+				if (rdbyte(r) < 0) return 0;
+				r->bi--;
+			}
+
+			k = r->bn - r->bi;
+			if (k > len) k = len;
+			fdb_apnd(&ev->dat, r->b + r->bi, k);
+			r->bi += k;
+			len -= k;
+		}
+		break;
+
+	case -1:
+		return 0;
+
+	default:
+		warnx("bad record in timed raw log: %d", tag);
+		return 0;
+	}
+
+	ev->tag = tag;
+	ev->ms = r->ms;
+	return tag;
+}
+
+static int pathcmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+char *rec_find(const char *base, const char *termid)
+{
+	struct fdbuf pat = {0};
+	glob_t gl = {0};
+	const char *c;
+	char *found = 0;
+
+	if (!*termid || strchr(termid, '/')) return 0;
+
+	fdb_apnd(&pat, base, -1);
+	fdb_apnd(&pat, "/[0-9][0-9][0-9][0-9]/[0-9][0-9]/[0-9][0-9]/", -1);
+	for (c = termid; *c; c++) {
+		if (strchr("*?[\\", *c)) fdb_apnc(&pat, '\\');
+		fdb_apnc(&pat, *c);
+	}
+	fdb_apnd(&pat, ".rec", -1);
+	glob(cstr(&pat), 0, 0, &gl);
+	pat.len--;
+	fdb_apnd(&pat, ".gz", 4);
+	glob(cstr(&pat), GLOB_APPEND, 0, &gl);
+	fdb_finsh(&pat);
+
+	if (gl.gl_pathc) {
+		qsort(gl.gl_pathv, gl.gl_pathc, sizeof(*gl.gl_pathv), pathcmp);
+		found = strdup(gl.gl_pathv[gl.gl_pathc - 1]);
+	}
+
+	globfree(&gl);
+	return found;
+}
+
+unsigned long long rec_parsetime(const char *s, const char *path)
+{
+	struct tm tm = {.tm_isdst = -1};
+	const char *fn = strrchr(path, '/');
+	time_t t;
+
+	if (!s || !*s) return 0;
+	if (!strchr(s, ':')) return strtod(s, 0) * 1000;
+
+	if (!fn || fn - path < 10
+	    || 3 != sscanf(fn - 10, "%d/%d/%d",
+			   &tm.tm_year, &tm.tm_mon, &tm.tm_mday)) {
+		warnx("no date in log path: %s", path);
+		return 0;
+	}
+	sscanf(s, "%d:%d:%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+
+	t = mktime(&tm);
+	return t < 0 ? 0 : t * 1000ULL;
+}
+
+static void tstshowrec(struct recrd *r, struct recev *ev)
+{
+	unsigned long long start = 0;
+	unsigned i;
+
+	while (recrd_next(r, ev)) {
+		if (ev->tag == 'S') start = ev->ms;
+		printf("%c recent=%d", ev->tag,
+		       start && ev->ms >= start && ev->ms - start < 60000);
+		if (ev->tag == 'w') printf(" %ux%u", ev->cols, ev->rows);
+		if (ev->tag == 'o') {
+			printf(" len=%u: ", ev->dat.len);
+			for (i = 0; i < ev->dat.len && i < 20; i++)
+				putchar(ev->dat.bf[i] >= ' ' && ev->dat.bf[i] <= '~'
+					? ev->dat.bf[i] : '.');
+		}
+		putchar('\n');
+	}
+}
+
+void test_rawrec(void)
+{
+	char dir[] = "/tmp/werm.rawrec.XXXXXX", *fn, *found;
+	struct recorder r = {0};
+	struct logsink s = {0};
+	struct recev ev = {0};
+	struct fdbuf img = {0}, big = {0};
+	struct ckphdr ck;
+	struct recrd *rd;
+	int32_t fakeimg[3] = {1, 2, 3};
+	unsigned long long szoff;
+	const char *sub[] = {"/2026", "/01", "/02", 0}, **sb;
+	int i;
+
+	printf("TIMED RAW LOG\n");
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	fn = strdup(dir);
+	for (sb = sub; *sb; sb++) {
+		fn = realloc(fn, strlen(fn) + strlen(*sb) + 1);
+		strcat(fn, *sb);
+		if (mkdir(fn, 0700)) err(1, "mkdir %s", fn);
+	}
+	free(fn);
+	xasprintf(&fn, "%s/2026/01/02/tst.a.rec", dir);
+
+	s.de.fd = open(fn, O_RDWR | O_CREAT | O_APPEND, 0600);
+	rec_open(&r, &s, open("/dev/null", O_WRONLY));
+	printf("off before start: %llu\n", r.off);
+
+	rec_out(&r, &s, "hello", 5);
+	rec_out(&r, &s, "", 0);
+	szoff = r.off;
+	rec_size(&r, &s, 100, 40);
+	for (i = 0; i < 300; i++) fdb_apnc(&big, 'a' + i % 26);
+	rec_out(&r, &s, big.bf, big.len);
+	printf("off: %llu\n", r.off);
+
+	rd = recrd_open(fn, -1, &ck, &img);
+	printf("checkpoint: %d\n", !!ck.magic[0]);
+	tstshowrec(rd, &ev);
+	recrd_close(rd);
+
+	/* Checkpoints are found by time. Give them fixed times to test. */
+	close(r.ckpfd);
+	free(fn);
+	xasprintf(&fn, "%s/2026/01/02/tst.a.rec.ckp", dir);
+	r.ckpfd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	r.ms = 1000;
+	rec_ckpput(&r, 7, fakeimg, sizeof(fakeimg));
+	r.ms = 2000;
+	r.off = szoff;
+	rec_ckpput(&r, 9, fakeimg, 8);
+	close(r.ckpfd);
+	free(fn);
+
+	xasprintf(&fn, "%s/2026/01/02/tst.a.rec", dir);
+	for (i = 0; i < 3; i++) {
+		rd = recrd_open(fn, 500 + i * 1000, &ck, &img);
+		printf("at %d: ckp=%d t=%d imgsz=%u atszoff=%d ms=%llu\n",
+		       500 + i * 1000, !!ck.magic[0], (int)ck.t, img.len,
+		       ck.recoff == szoff, (unsigned long long)ck.ms);
+		recrd_close(rd);
+	}
+
+	/* Reading from the second checkpoint starts with the resize. */
+	rd = recrd_open(fn, 2000, &ck, &img);
+	if (rd) {
+		recrd_next(rd, &ev);
+		printf("after ckp: %c %ux%u\n", ev.tag, ev.cols, ev.rows);
+		recrd_close(rd);
+	}
+
+	found = rec_find(dir, "tst.a");
+	printf("found: %s\n", found ? found + strlen(dir) : "(null)");
+	free(found);
+	found = rec_find(dir, "tst.b");
+	printf("found: %s\n", found ? found : "(null)");
+
+	printf("parsetime: %llu %llu %d\n",
+	       rec_parsetime("1700000000.5", fn), rec_parsetime("", fn),
+	       rec_parsetime("00:00", fn) == rec_parsetime("00:00:00", fn));
+
+	close(s.de.fd);
+	free(fn);
+	fdb_finsh(&img);
+	fdb_finsh(&big);
+	fdb_finsh(&ev.dat);
+	fdb_finsh(&r.b);
+
+	xasprintf(&fn, "rm -r %s", dir);
+	if (system(fn)) warnx("could not clean up %s", dir);
+	free(fn);
+}
@@ -0,0 +1,126 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef RAWREC_H
+#define RAWREC_H
+
+#include "asynclog.h"
+
+#include <stdint.h>
+
+/* A timed raw log, "*.rec" or "*.rec.gz" if compressed, holds the output of the
+ * subprocess like a .raw log, but split into records giving the time of each
+ * read from the pty. Each record is a tag byte and unsigned varints of 7 bits
+ * per byte, least significant first, with the high bit set on all but the last
+ * byte:
+ *
+ *	'S' MS			logging starts at MS, in milliseconds since the
+ *				Unix epoch, with no terminal yet
+ *	'o' DMS LEN BYTES	output read DMS milliseconds after the last
+ *				record
+ *	'w' DMS COLS ROWS	the terminal is resized
+ *
+ * The master appends snapshots of its terminal engine to "*.rec.ckp" every
+ * RECCKPBYTES of output, but at most once per RECCKPMS. A snapshot, or
+ * checkpoint, is a ckphdr followed by a tmsave() image of all engine objects.
+ * To get the screen at a given time, a reader loads the last checkpoint before
+ * it and runs only the records after that through twrite. */
+#define RECCKPBYTES	(256 * 1024)
+#define RECCKPMS	1000
+
+/* Longest pause when playing back, in milliseconds after scaling by speed. */
+#define RECMAXGAP	2000
+
+struct ckphdr {
+	/* "WCKP" */
+	char magic[4];
+
+	/* Size of the image after this header */
+	uint32_t imgsz;
+
+	/* Offset in the log, uncompressed, of the first record not reflected
+	   in the image, and the time of the record before it. */
+	uint64_t recoff, ms;
+
+	/* ID of the terminal in the image */
+	int32_t t;
+	uint32_t reserved;
+};
+
+/* Writing side, kept by the master. */
+struct recorder {
+	/* The checkpoint file, or zero if the raw log is not timed. */
+	int ckpfd;
+
+	/* Set once the 'S' record is written. */
+	int started;
+
+	/* Uncompressed size of the log, counting only records the logsink
+	   accepted, and the time of the last of them. */
+	unsigned long long off, ms;
+
+	/* off and the time when the last checkpoint was taken. */
+	unsigned long long ckpoff, ckpms;
+
+	/* Scratch space for putting together a record. */
+	struct fdbuf b;
+};
+
+/* Starts recording to s, whose log and frame index must be open and not yet
+ * passed to start_logwriter. If the log already has records, new ones are
+ * appended after a new 'S' record. */
+void rec_open(struct recorder *r, struct logsink *s, int ckpfd);
+
+/* Logs output read from the pty, or a resize of the terminal. */
+void rec_out(struct recorder *r, struct logsink *s, const void *buf, size_t len);
+void rec_size(struct recorder *r, struct logsink *s, int cols, int rows);
+
+/* Returns 1 if it is time for a checkpoint. If so, the caller writes one with
+ * rec_ckpput, which does not change r and may be called in a forked child. */
+int rec_ckpdue(struct recorder *r);
+void rec_ckpput(struct recorder *r, int32_t t, const void *img, size_t imgsz);
+
+/* A record read back. */
+struct recev {
+	int tag;
+
+	/* Time of the record in milliseconds since the Unix epoch */
+	unsigned long long ms;
+
+	/* Set for 'w' */
+	unsigned cols, rows;
+
+	/* Output of an 'o' record */
+	struct fdbuf dat;
+};
+
+struct recrd;
+
+/* Opens the timed raw log at path for reading from the last checkpoint taken
+ * at or before at. If there is one, it is put in ck and its image in img, and
+ * reading starts after it. If not, ck->magic is zeroed and reading starts at
+ * the beginning. Returns null if the log cannot be opened. */
+struct recrd *recrd_open(const char *path, unsigned long long at,
+			 struct ckphdr *ck, struct fdbuf *img);
+
+/* Reads the next record into ev and returns its tag, or 0 at the end of the log
+ * or the end of what has been written so far. */
+int recrd_next(struct recrd *r, struct recev *ev);
+
+void recrd_close(struct recrd *r);
+
+/* Finds the newest timed raw log of termid under base, in base/YEAR/MONTH/DAY.
+ * Returns null if there is none. The caller frees the path. */
+char *rec_find(const char *base, const char *termid);
+
+/* Parses a time to seek to in the log at path. It is either seconds since the
+ * epoch or HH:MM[:SS] in local time on the day in the path of the log. An empty
+ * or missing time means the start. Returns milliseconds since the epoch. */
+unsigned long long rec_parsetime(const char *s, const char *path);
+
+void test_rawrec(void);
+
+#endif
@@ -0,0 +1,687 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "sbview.h"
+#include "http.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define PAGEDEF		(64 * 1024)
+#define PAGEMAX		(1024 * 1024)
+
+/* How far a part is extended to reach the end of a line. */
+#define SNAPMAX		4096
+
+#define FINDCHNK	(256 * 1024)
+
+/* How long the list of logs of a scrollback is reused before looking for new
+   ones. */
+#define GLOBSECS	10
+
+/* A gzip member of a compressed log: its offset and size in the file, and its
+   size and offset once decompressed. */
+struct sbfrm {
+	unsigned long long off, clen, ulen, uoff;
+};
+
+struct sbseg {
+	/* The log, and its name relative to the state dir, which points into
+	   path. */
+	char *path;
+	const char *rel;
+	int fd;
+
+	/* The line naming the log, which comes before its contents, and
+	   whether it starts with a newline to end the previous log. */
+	char *hdr;
+	unsigned hdrlen, hdrnl;
+
+	/* Size of the log when it was last checked. */
+	unsigned long long fsz;
+
+	/* Set for a compressed log. The last frame may be unfinished, in
+	   which case its size is what could be decompressed. The first nidx
+	   frames are from the index, which has been read up to idxpos. */
+	struct sbfrm *frms;
+	int nfrm, nidx, gz;
+	long idxpos;
+
+	/* The last frame decompressed and its index, or -1 */
+	struct fdbuf fb;
+	int fbfrm;
+
+	/* Size of the contents, their last byte, or a newline if there are
+	   none, and offset of hdr in the scrollback. */
+	unsigned long long len, docoff;
+	unsigned char last;
+};
+
+struct sbdoc {
+	char *base, *termid;
+	time_t globbed;
+
+	struct sbseg *segs;
+	int n;
+	unsigned long long size;
+};
+
+static int fold(int c) { return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c; }
+
+/* Decompresses one gzip member at off in fd, or as much of it as the next max
+   bytes hold, onto out. Returns how many bytes of the file were used. */
+static unsigned long long sbinfl(int fd, unsigned long long off,
+				 unsigned long long max, struct fdbuf *out)
+{
+	unsigned char ib[16 * 1024], ob[16 * 1024];
+	unsigned long long fed = 0;
+	z_stream z = {0};
+	ssize_t redn;
+	size_t n;
+	int zr = Z_OK;
+
+	if (inflateInit2(&z, 15 + 16) != Z_OK) {
+		warnx("inflateInit2: %s", z.msg);
+		return max;
+	}
+
+	for (;;) {
+		if (!z.avail_in) {
+			n = max - fed < sizeof(ib) ? max - fed : sizeof(ib);
+			redn = n ? pread(fd, ib, n, off + fed) : 0;
+			if (redn < 0 && errno == EINTR) continue;
+			if (redn < 0) perror("read log");
+			if (redn <= 0) break;
+
+			fed += redn;
+			z.next_in = ib;
+			z.avail_in = redn;
+		}
+
+		do {
+			z.next_out = ob;
+			z.avail_out = sizeof(ob);
+			zr = inflate(&z, Z_NO_FLUSH);
+			fdb_apnd(out, ob, sizeof(ob) - z.avail_out);
+		} while (zr == Z_OK && !z.avail_out);
+
+		if (zr == Z_BUF_ERROR && !z.avail_in) continue;
+		if (zr != Z_OK) break;
+	}
+
+	if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR)
+		warnx("inflate log: %s", z.msg ? z.msg : "?");
+
+	inflateEnd(&z);
+	return fed - z.avail_in;
+}
+
+static void sbfrmadd(struct sbseg *s, unsigned long long off,
+		     unsigned long long clen, unsigned long long ulen)
+{
+	struct sbfrm *f;
+
+	s->frms = realloc(s->frms, (s->nfrm + 1) * sizeof(*s->frms));
+	f = s->frms + s->nfrm++;
+	f->off = off;
+	f->clen = clen;
+	f->ulen = ulen;
+	f->uoff = s->len;
+	s->len += ulen;
+}
+
+/* Finds the frames of a compressed log that are not known yet, from its index
+   where it has been added to. The frames after the indexed ones are
+   decompressed to learn their size. That is only the last, unfinished frame
+   unless the index is missing or damaged. */
+static void sbgzframes(struct sbseg *s)
+{
+	unsigned long long off, clen, ulen, end = 0, used;
+	struct sbfrm *f;
+	char *idxfn;
+	FILE *idx;
+
+	/* Frames that were decompressed may have grown or been indexed. */
+	s->nfrm = s->nidx;
+	s->len = 0;
+	if (s->nfrm) {
+		f = s->frms + s->nfrm - 1;
+		s->len = f->uoff + f->ulen;
+		end = f->off + f->clen;
+	}
+	if (s->fbfrm >= s->nfrm) s->fbfrm = -1;
+
+	xasprintf(&idxfn, "%s.idx", s->path);
+	idx = fopen(idxfn, "r");
+	free(idxfn);
+
+	if (idx && fseek(idx, s->idxpos, SEEK_SET)) { fclose(idx); idx = 0; }
+	while (idx && 3 == fscanf(idx, "%llu %llu %llu\n", &off, &clen, &ulen)) {
+		if (off != end || off + clen > s->fsz) break;
+		sbfrmadd(s, off, clen, ulen);
+		end = off + clen;
+		s->idxpos = ftell(idx);
+	}
+	if (idx) fclose(idx);
+	s->nidx = s->nfrm;
+
+	while (end < s->fsz) {
+		s->fb.len = 0;
+		used = sbinfl(s->fd, end, s->fsz - end, &s->fb);
+		if (!used) break;
+
+		sbfrmadd(s, end, used, s->fb.len);
+		s->fbfrm = s->nfrm - 1;
+		end += used;
+	}
+}
+
+/* Copies up to n bytes of the contents of s from off. Returns the number
+   copied, which is less than n only at the end. */
+static size_t sbsegread(struct sbseg *s, unsigned long long off,
+			unsigned char *b, size_t n)
+{
+	struct sbfrm *f;
+	size_t cpy, tot = 0;
+	ssize_t redn;
+	int lo, hi, mid;
+
+	if (!s->gz) {
+		if (off >= s->len) return 0;
+		if (n > s->len - off) n = s->len - off;
+
+		/* The log may have been cut short since its size was read. */
+		while (tot < n) {
+			redn = pread(s->fd, b + tot, n - tot, off + tot);
+			if (redn < 0 && errno == EINTR) continue;
+			if (redn < 0) perror("read log");
+			if (redn <= 0) break;
+			tot += redn;
+		}
+		return tot;
+	}
+
+	while (n && off < s->len) {
+		lo = 0;
+		hi = s->nfrm - 1;
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (s->frms[mid].uoff <= off)	lo = mid;
+			else				hi = mid - 1;
+		}
+		f = s->frms + lo;
+
+		if (s->fbfrm != lo) {
+			s->fb.len = 0;
+			sbinfl(s->fd, f->off, f->clen, &s->fb);
+			s->fbfrm = lo;
+		}
+		if (off - f->uoff >= s->fb.len) break;
+
+		cpy = s->fb.len - (off - f->uoff);
+		if (cpy > n) cpy = n;
+		memcpy(b, s->fb.bf + (off - f->uoff), cpy);
+		b += cpy;
+		off += cpy;
+		n -= cpy;
+		tot += cpy;
+	}
+
+	return tot;
+}
+
+/* Like sbsegread, but for the whole scrollback. */
+static size_t sbdocread(struct sbdoc *d, unsigned long long off,
+			unsigned char *b, size_t n)
+{
+	struct sbseg *s;
+	unsigned long long so;
+	size_t cpy, tot = 0;
+	int si;
+
+	for (si = 0; si < d->n && n; si++) {
+		s = d->segs + si;
+		if (off >= s->docoff + s->hdrlen + s->len) continue;
+
+		so = off - s->docoff;
+		if (so < s->hdrlen) {
+			cpy = s->hdrlen - so;
+			if (cpy > n) cpy = n;
+			memcpy(b, s->hdr + so, cpy);
+		}
+		else {
+			cpy = sbsegread(s, so - s->hdrlen, b, n);
+			if (!cpy) break;
+		}
+
+		b += cpy;
+		off += cpy;
+		n -= cpy;
+		tot += cpy;
+		si--;
+	}
+
+	return tot;
+}
+
+static int sbsegopen(struct sbseg *s, const char *path, size_t baselen)
+{
+	size_t pl = strlen(path);
+
+	memset(s, 0, sizeof(*s));
+	s->fbfrm = -1;
+	s->last = '\n';
+	s->gz = pl > 3 && !strcmp(path + pl - 3, ".gz");
+
+	s->fd = open(path, O_RDONLY);
+	if (s->fd < 0) { warn("open %s", path); return 0; }
+
+	s->path = strdup(path);
+	s->rel = s->path + baselen + 1;
+	return 1;
+}
+
+static void sbsegclose(struct sbseg *s)
+{
+	close(s->fd);
+	free(s->path);
+	free(s->hdr);
+	free(s->frms);
+	fdb_finsh(&s->fb);
+}
+
+/* Brings s up to date with its log, which may have grown or, if it was
+   replaced, shrunk. Returns 0 if it cannot be read. */
+static int sbsegsync(struct sbseg *s)
+{
+	struct stat sb;
+
+	if (fstat(s->fd, &sb)) { warn("stat %s", s->path); return 0; }
+	if (sb.st_size == s->fsz) return 1;
+
+	if (sb.st_size < s->fsz) {
+		s->nfrm = s->nidx = 0;
+		s->idxpos = 0;
+		s->fbfrm = -1;
+	}
+	s->fsz = sb.st_size;
+
+	if (s->gz)	sbgzframes(s);
+	else		s->len = s->fsz;
+
+	s->last = '\n';
+	if (s->len) sbsegread(s, s->len - 1, &s->last, 1);
+	return 1;
+}
+
+static int pathcmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void sbdocclose(struct sbdoc *d)
+{
+	struct sbseg *s;
+
+	if (!d) return;
+	for (s = d->segs; s != d->segs + d->n; s++) sbsegclose(s);
+	free(d->segs);
+	free(d->base);
+	free(d->termid);
+	free(d);
+}
+
+/* Finds the logs of d->termid under d->base, in base/YEAR/MONTH/DAY, keeping
+   the segments of those that were already open. */
+static void sbglob(struct sbdoc *d)
+{
+	struct fdbuf pat = {0};
+	struct sbseg *segs, *s;
+	glob_t gl = {0};
+	const char *c;
+	size_t pi;
+	int si, n = 0;
+
+	fdb_apnd(&pat, d->base, -1);
+	fdb_apnd(&pat, "/[0-9][0-9][0-9][0-9]/[0-9][0-9]/[0-9][0-9]/", -1);
+	for (c = d->termid; *c; c++) {
+		if (strchr("*?[\\", *c)) fdb_apnc(&pat, '\\');
+		fdb_apnc(&pat, *c);
+	}
+	glob(cstr(&pat), 0, 0, &gl);
+	pat.len--;
+	fdb_apnd(&pat, ".gz", 4);
+	glob(cstr(&pat), GLOB_APPEND, 0, &gl);
+	fdb_finsh(&pat);
+
+	qsort(gl.gl_pathv, gl.gl_pathc, sizeof(*gl.gl_pathv), pathcmp);
+	segs = calloc(gl.gl_pathc + 1, sizeof(*segs));
+
+	for (pi = 0; pi < gl.gl_pathc; pi++) {
+		s = segs + n;
+		for (si = 0; si < d->n; si++) {
+			if (!d->segs[si].path) continue;
+			if (strcmp(d->segs[si].path, gl.gl_pathv[pi])) continue;
+
+			*s = d->segs[si];
+			d->segs[si].path = 0;
+			break;
+		}
+		if (si < d->n || sbsegopen(s, gl.gl_pathv[pi], strlen(d->base)))
+			n++;
+	}
+
+	for (si = 0; si < d->n; si++)
+		if (d->segs[si].path) sbsegclose(d->segs + si);
+	free(d->segs);
+	d->segs = segs;
+	d->n = n;
+	d->globbed = time(0);
+
+	globfree(&gl);
+}
+
+/* The scrollback last opened. The viewer makes many requests for the same one
+   on a connection, and they only need to see what was added to its logs. */
+static struct sbdoc *sbcached;
+
+/* Opens the logs of termid under base, or brings them up to date if they were
+   opened last. Returns null if termid is invalid or has no logs. */
+static struct sbdoc *sbdocopen(const char *base, const char *termid)
+{
+	struct sbdoc *d = sbcached;
+	struct sbseg *s;
+	unsigned char lastb = '\n';
+	int si, n = 0;
+
+	if (!*termid || strchr(termid, '/')) return 0;
+
+	if (d && (strcmp(d->base, base) || strcmp(d->termid, termid))) {
+		sbdocclose(d);
+		d = 0;
+	}
+	if (!d) {
+		d = sbcached = calloc(1, sizeof(*d));
+		d->base = strdup(base);
+		d->termid = strdup(termid);
+	}
+	if (!d->n || time(0) - d->globbed >= GLOBSECS) sbglob(d);
+
+	d->size = 0;
+	for (si = 0; si < d->n; si++) {
+		s = d->segs + si;
+		if (!sbsegsync(s)) { sbsegclose(s); continue; }
+		d->segs[n] = *s;
+		s = d->segs + n++;
+
+		if (!s->hdr || s->hdrnl != (lastb != '\n')) {
+			free(s->hdr);
+			s->hdrnl = lastb != '\n';
+			s->hdrlen = xasprintf(&s->hdr, "%s--- SCROLLBACK %s ---\n",
+					      s->hdrnl ? "\n" : "", s->rel);
+		}
+
+		s->docoff = d->size;
+		d->size += s->hdrlen + s->len;
+		lastb = s->last;
+	}
+	d->n = n;
+
+	return d->n ? d : 0;
+}
+
+/* Moves pos past any UTF-8 continuation bytes. */
+static unsigned long long sbutf8(struct sbdoc *d, unsigned long long pos)
+{
+	unsigned char b[4];
+	size_t n, i;
+
+	n = sbdocread(d, pos, b, sizeof(b));
+	for (i = 0; i < n && (b[i] & 0xc0) == 0x80; i++) {}
+	return pos + i;
+}
+
+/* Returns the start of the first line at or after pos, looking up to SNAPMAX
+   bytes ahead. If there is none, returns pos at a character boundary. */
+static unsigned long long sbsnap(struct sbdoc *d, unsigned long long pos)
+{
+	unsigned char b[SNAPMAX];
+	size_t n, i;
+
+	if (pos >= d->size)	return d->size;
+	if (!pos)		return 0;
+
+	n = sbdocread(d, pos - 1, b, sizeof(b));
+	for (i = 0; i < n; i++) if (b[i] == '\n') return pos + i;
+	if (pos - 1 + n >= d->size) return d->size;
+
+	return sbutf8(d, pos);
+}
+
+static void sbpagedoc(struct wrides *de, struct sbdoc *d,
+		      long long off, long long end, long long len)
+{
+	struct fdbuf ob = {0};
+	unsigned char b[16 * 1024];
+	unsigned long long start, pos;
+	size_t n, i, j;
+	char *cmt;
+
+	if (len <= 0 || len > PAGEMAX)	len = PAGEDEF;
+	if (off < 0 && end < 0)		end = d->size;
+
+	if (end >= 0) {
+		end = end > d->size ? d->size : sbutf8(d, end);
+		start = end > len ? sbsnap(d, end - len) : 0;
+		if (start >= end && end) start = sbutf8(d, end - len);
+	}
+	else {
+		start = sbsnap(d, off);
+		end = sbsnap(d, start + len);
+	}
+
+	xasprintf(&cmt, "<!--sb %llu %llu %llu-->",
+		  start, (unsigned long long)end, d->size);
+	fdb_apnd(&ob, cmt, -1);
+	free(cmt);
+
+	for (pos = start; pos < end; pos += n) {
+		n = end - pos < sizeof(b) ? end - pos : sizeof(b);
+		n = sbdocread(d, pos, b, n);
+		if (!n) break;
+
+		for (i = 0; i < n; i = j + 1) {
+			for (j = i; j < n; j++) {
+				if (b[j] == '&' || b[j] == '<' || b[j] == '>')
+					break;
+			}
+			fdb_apnd(&ob, b + i, j - i);
+			if (j == n) break;
+
+			fdb_apnd(&ob,	b[j] == '&' ? "&amp;" :
+					b[j] == '<' ? "&lt;" : "&gt;", -1);
+		}
+	}
+
+	resp_dynamc(de, 'h', 200, ob.bf, ob.len);
+	fdb_finsh(&ob);
+}
+
+void sbview_page(struct wrides *de, const char *termid,
+		 long long off, long long end, long long len)
+{
+	struct sbdoc *d = sbdocopen(state_dir(), termid);
+
+	if (!d) { resp_dynamc(de, 't', 404, 0, 0); return; }
+
+	sbpagedoc(de, d, off, end, len);
+}
+
+static long long sbfinddoc(struct sbdoc *d, const char *q,
+			   long long from, int back)
+{
+	unsigned char *b, *lq, *hit, *p;
+	size_t qlen = strlen(q), n, i;
+	unsigned long long pos, end;
+	long long found = -1;
+
+	if (!qlen) return -1;
+	if (from < 0) from = 0;
+
+	lq = (unsigned char *)strdup(q);
+	for (i = 0; i < qlen; i++) lq[i] = fold(lq[i]);
+	b = malloc(FINDCHNK + qlen);
+
+	if (!back) {
+		for (pos = from; found < 0 && pos < d->size; pos += FINDCHNK) {
+			n = sbdocread(d, pos, b, FINDCHNK + qlen - 1);
+			for (i = 0; i < n; i++) b[i] = fold(b[i]);
+
+			hit = memmem(b, n, lq, qlen);
+			if (hit) found = pos + (hit - b);
+		}
+	}
+
+	/* Each chunk also has the first qlen-1 bytes of the next, so matches
+	   that straddle chunks are found. */
+	end = (unsigned long long)from < d->size ? from : d->size;
+	while (back && found < 0 && end) {
+		pos = end > FINDCHNK ? end - FINDCHNK : 0;
+		n = sbdocread(d, pos, b, end - pos + qlen - 1);
+		for (i = 0; i < n; i++) b[i] = fold(b[i]);
+
+		for (p = b; (hit = memmem(p, n - (p - b), lq, qlen)); p = hit+1) {
+			if (hit - b >= end - pos) break;
+			found = pos + (hit - b);
+		}
+		end = pos;
+	}
+
+	free(b);
+	free(lq);
+	return found;
+}
+
+void sbview_find(struct wrides *de, const char *termid, const char *q,
+		 long long from, int back)
+{
+	struct sbdoc *d = sbdocopen(state_dir(), termid);
+	char *res;
+	int len;
+
+	if (!d) { resp_dynamc(de, 't', 404, 0, 0); return; }
+
+	len = xasprintf(&res, "%lld\n", sbfinddoc(d, q, from, back));
+	resp_dynamc(de, 't', 200, res, len);
+
+	free(res);
+}
+
+static unsigned tstgz(FILE *f, const char *s, int flsh)
+{
+	unsigned char ob[256];
+	z_stream z = {0};
+
+	deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	z.next_in = (unsigned char *)s;
+	z.avail_in = strlen(s);
+	z.next_out = ob;
+	z.avail_out = sizeof(ob);
+	deflate(&z, flsh);
+	deflateEnd(&z);
+
+	fwrite(ob, 1, sizeof(ob) - z.avail_out, f);
+	return sizeof(ob) - z.avail_out;
+}
+
+void test_sbview(void)
+{
+	char dir[] = "/tmp/sbviewXXXXXX", *fn;
+	struct wrides de = {1, "sbpage"};
+	struct sbdoc *d;
+	unsigned c1, c2;
+	FILE *f;
+
+	puts("SCROLLBACK VIEWER");
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+
+	xasprintf(&fn, "%s/2026", dir);		mkdir(fn, 0700); free(fn);
+	xasprintf(&fn, "%s/2026/01", dir);	mkdir(fn, 0700); free(fn);
+	xasprintf(&fn, "%s/2026/01/02", dir);	mkdir(fn, 0700); free(fn);
+	xasprintf(&fn, "%s/2026/01/03", dir);	mkdir(fn, 0700); free(fn);
+
+	xasprintf(&fn, "%s/2026/01/02/t.a", dir);
+	f = fopen(fn, "w");
+	fputs("one\ntwo & <three>\nfour", f);
+	fclose(f);
+	free(fn);
+
+	xasprintf(&fn, "%s/2026/01/03/t.a.gz", dir);
+	f = fopen(fn, "w");
+	c1 = tstgz(f, "five\nsix\n", Z_FINISH);
+	c2 = tstgz(f, "seven\n", Z_FINISH);
+	tstgz(f, "ei\xc3\xa9ght", Z_SYNC_FLUSH);
+	fclose(f);
+	free(fn);
+
+	xasprintf(&fn, "%s/2026/01/03/t.a.gz.idx", dir);
+	f = fopen(fn, "w");
+	fprintf(f, "0 %u 9\n%u %u 6\n", c1, c1, c2);
+	fclose(f);
+	free(fn);
+
+	d = sbdocopen(dir, "t.a");
+	printf("segments: %d size: %llu\n", d->n, d->size);
+
+	puts("whole:");		sbpagedoc(&de, d, 0, -1, 1000);
+	puts("tail:");		sbpagedoc(&de, d, -1, -1, 10);
+	puts("from middle:");	sbpagedoc(&de, d, 5, -1, 4);
+	puts("ending at:");	sbpagedoc(&de, d, -1, 22, 8);
+	puts("mid-character:");	sbpagedoc(&de, d, -1, d->size - 4, 2);
+
+	printf("find SIX: %lld\n",	sbfinddoc(d, "SIX", 0, 0));
+	printf("find o from 2: %lld\n",	sbfinddoc(d, "o", 2, 0));
+	printf("find o back: %lld\n",	sbfinddoc(d, "o", d->size, 1));
+	printf("find o back 14: %lld\n",sbfinddoc(d, "o", 14, 1));
+	printf("find none: %lld\n",	sbfinddoc(d, "nine", 0, 0));
+	printf("find across: %lld\n",	sbfinddoc(d, "four\n---", 0, 0));
+
+	puts("first log grows:");
+	xasprintf(&fn, "%s/2026/01/02/t.a", dir);
+	f = fopen(fn, "a");
+	fputs(" and a half\n", f);
+	fclose(f);
+	printf("reopened: %d\n", d == sbdocopen(dir, "t.a"));
+	sbpagedoc(&de, d, 0, -1, 1000);
+
+	puts("first log cut short:");
+	if (truncate(fn, 4)) perror("truncate");
+	free(fn);
+	sbdocopen(dir, "t.a");
+	sbpagedoc(&de, d, 0, -1, 1000);
+
+	sbdocclose(sbcached);
+	sbcached = 0;
+
+	printf("no logs: %d\n", !sbdocopen(dir, "u"));
+	printf("bad termid: %d\n", !sbdocopen(dir, "../t.a"));
+	sbdocclose(sbcached);
+	sbcached = 0;
+
+	xasprintf(&fn, "rm -r %s", dir);
+	if (system(fn)) warnx("could not remove %s", dir);
+	free(fn);
+}
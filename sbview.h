@@ -0,0 +1,40 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef SBVIEW_H
+#define SBVIEW_H
+
+#include "outstreams.h"
+
+/* Backend of the scrollback viewer. The scrollback of a terminal is its plain
+ * logs under state_dir(), compressed or not, oldest first, each preceded by a
+ * line naming it. This is addressed by byte offsets as if it were one file. Only
+ * the requested part of the logs is read. They are kept open for the next
+ * request on the connection, which only needs to look at what was added. */
+
+/* Writes an HTTP response with part of the scrollback of termid, escaped as
+ * HTML. It starts with a comment giving the offsets where the part starts and
+ * ends, and the size of the whole scrollback:
+ *
+ *	<!--sb START END SIZE-->
+ *
+ * If end is not negative, the part ends there and starts up to len bytes
+ * earlier. Otherwise it starts at off, or if that is negative, at the end of
+ * the scrollback less len bytes. The part is extended to whole lines unless
+ * a line is very long. */
+void sbview_page(struct wrides *de, const char *termid,
+		 long long off, long long end, long long len);
+
+/* Writes an HTTP response with the offset of the next occurrence of q in the
+ * scrollback of termid at or after from, or if back is set, the last one
+ * starting before from. ASCII case is ignored. The offset is -1 if there is
+ * none. */
+void sbview_find(struct wrides *de, const char *termid, const char *q,
+		 long long from, int back);
+
+void test_sbview(void);
+
+#endif
@@ -0,0 +1,369 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "sesreg.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define REGSZ		(SESREGSLOTS * sizeof(struct sesent))
+
+/* Times a reader retries an entry that keeps changing before skipping it. */
+#define SNAPTRIES	100
+
+static int alive(pid_t pid)
+{
+	return pid > 0 && (!kill(pid, 0) || errno != ESRCH);
+}
+
+struct sesent *sesreg_claim(const char *path)
+{
+	struct sesent *r = 0, *e;
+	struct stat st;
+	int fd, i;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) { warn("open %s", path); return 0; }
+
+	/* Keep other masters from claiming the same entry. */
+	if (flock(fd, LOCK_EX)) { warn("flock %s", path); goto cleanup; }
+
+	if (fstat(fd, &st)) { warn("fstat %s", path); goto cleanup; }
+	if (st.st_size < (off_t)REGSZ && ftruncate(fd, REGSZ)) {
+		warn("ftruncate %s", path);
+		goto cleanup;
+	}
+
+	r = mmap(0, REGSZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED) { warn("mmap %s", path); r = 0; goto cleanup; }
+
+	/* An entry with our pid is left by an earlier process that had it. */
+	for (i = 0; i < SESREGSLOTS; i++)
+		if (!alive(r[i].pid) || r[i].pid == getpid()) break;
+
+	if (i == SESREGSLOTS) {
+		warnx("session registry is full: %s", path);
+		munmap(r, REGSZ);
+		r = 0;
+		goto cleanup;
+	}
+
+	e = r + i;
+
+	/* The last owner may have died while changing it. */
+	if (e->gen & 1) e->gen++;
+
+	sesreg_begin(e);
+	memset((char *)e + sizeof e->gen, 0, sizeof *e - sizeof e->gen);
+	e->pid = getpid();
+	sesreg_end(e);
+
+	r = e;
+
+cleanup:
+	/* The mapping keeps the file open, so closing fd alone would not
+	   release the lock. */
+	flock(fd, LOCK_UN);
+	close(fd);
+	return r;
+}
+
+void sesreg_free(struct sesent *e)
+{
+	if (!e || e->pid != getpid()) return;
+
+	sesreg_begin(e);
+	e->pid = 0;
+	sesreg_end(e);
+}
+
+void sesreg_begin(struct sesent *e)
+{
+	__atomic_store_n(&e->gen, e->gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void sesreg_end(struct sesent *e)
+{
+	__atomic_store_n(&e->gen, e->gen + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t sesreg_cpy(char *dst, size_t cap, const char *s, size_t len)
+{
+	if (len > cap) {
+		len = cap;
+		while (len && (s[len] & 0xc0) == 0x80) len--;
+	}
+	memcpy(dst, s, len);
+	return len;
+}
+
+/* Copies e to c once it is not being changed. */
+static int snap(const struct sesent *e, struct sesent *c)
+{
+	uint32_t g;
+	int tries;
+
+	for (tries = 0; tries < SNAPTRIES; tries++) {
+		g = __atomic_load_n(&e->gen, __ATOMIC_ACQUIRE);
+		if (g & 1) { sched_yield(); continue; }
+
+		memcpy(c, e, sizeof *c);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->gen, __ATOMIC_RELAXED) == g) return 1;
+	}
+
+	return 0;
+}
+
+#define CLAMP(n, max) ((n) < (max) ? (n) : (max))
+
+void sesreg_each(const char *path, void *ctx,
+		 void (*fn)(void *ctx, int i, const struct sesent *c))
+{
+	struct sesent *r = MAP_FAILED, c;
+	struct stat st;
+	int fd, i, n = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) warn("open %s", path);
+		goto cleanup;
+	}
+	if (fstat(fd, &st)) { warn("fstat %s", path); goto cleanup; }
+
+	n = CLAMP(st.st_size / sizeof *r, SESREGSLOTS);
+	if (n) r = mmap(0, n * sizeof *r, PROT_READ, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED) {
+		if (n) warn("mmap %s", path);
+		n = 0;
+	}
+
+	for (i = 0; i < n; i++)
+		if (r[i].pid && snap(r + i, &c) && alive(c.pid)) fn(ctx, i, &c);
+
+cleanup:
+	if (n) munmap(r, n * sizeof *r);
+	if (fd >= 0) close(fd);
+}
+
+static void entjson(struct fdbuf *b, int i, const struct sesent *c)
+{
+	unsigned cli;
+
+	fdb_apnc(b, '[');
+	fdb_apnc(b, '[');
+	for (cli = 0; cli < CLAMP(c->ncli, SESREGCLIS); cli++) {
+		if (cli) fdb_apnc(b, ',');
+		fdb_json(b, c->clis[cli], strnlen(c->clis[cli], 8));
+	}
+	fdb_apnd(b, "],", -1);
+	fdb_json(b, c->termid, CLAMP(c->termidlen, sizeof c->termid));
+	fdb_apnc(b, ',');
+	fdb_json(b, c->title, CLAMP(c->titlelen, sizeof c->title));
+	fdb_apnc(b, ',');
+	fdb_itoa(b, c->lastact);
+	fdb_apnc(b, ',');
+	fdb_itoa(b, c->outbytes);
+	fdb_apnc(b, ',');
+	fdb_itoa(b, i);
+	fdb_apnc(b, ']');
+}
+
+struct jsonctx {
+	struct fdbuf *b;
+	int firs;
+};
+
+static void apndent(void *ctx_, int i, const struct sesent *c)
+{
+	struct jsonctx *ctx = ctx_;
+
+	if (!ctx->firs) fdb_apnc(ctx->b, ',');
+	ctx->firs = 0;
+	entjson(ctx->b, i, c);
+}
+
+void sesreg_json(const char *path, struct fdbuf *b)
+{
+	struct jsonctx ctx = {b, 1};
+
+	fdb_apnc(b, '[');
+	sesreg_each(path, &ctx, apndent);
+	fdb_apnc(b, ']');
+}
+
+struct evctx {
+	struct sesevst *st;
+	struct fdbuf *b;
+
+	/* The list sent on the first call */
+	struct jsonctx list;
+
+	char seen[SESREGSLOTS];
+};
+
+static void sesev(struct fdbuf *b, const char *ev, int i,
+		  const struct sesent *c)
+{
+	fdb_apnd(b, "event: ", -1);
+	fdb_apnd(b, ev, -1);
+	fdb_apnd(b, "\ndata: ", -1);
+	if (c)	entjson(b, i, c);
+	else	fdb_itoa(b, i);
+	fdb_apnd(b, "\n\n", -1);
+}
+
+static int samelisting(const struct sesent *a, const struct sesent *b)
+{
+	return	a->termidlen == b->termidlen
+	&&	!memcmp(a->termid, b->termid, CLAMP(a->termidlen, sizeof a->termid))
+	&&	a->titlelen == b->titlelen
+	&&	!memcmp(a->title, b->title, CLAMP(a->titlelen, sizeof a->title))
+	&&	a->ncli == b->ncli
+	&&	!memcmp(a->clis, b->clis, sizeof a->clis);
+}
+
+static void diffent(void *ctx_, int i, const struct sesent *c)
+{
+	struct evctx *ctx = ctx_;
+	struct sesent *l = ctx->st->last + i;
+
+	ctx->seen[i] = 1;
+
+	if (!ctx->st->started)		apndent(&ctx->list, i, c);
+	else if (l->pid != c->pid) {
+		if (l->pid) sesev(ctx->b, "del", i, 0);
+		sesev(ctx->b, "add", i, c);
+	}
+	else if (!samelisting(l, c))	sesev(ctx->b, "ses", i, c);
+
+	*l = *c;
+}
+
+void sesreg_events(const char *path, struct sesevst *st, struct fdbuf *b)
+{
+	struct evctx ctx = {st, b, {b, 1}};
+	int i;
+
+	if (!st->started) fdb_apnd(b, "event: list\ndata: [", -1);
+	sesreg_each(path, &ctx, diffent);
+	if (!st->started) fdb_apnd(b, "]\n\n", -1);
+
+	for (i = 0; i < SESREGSLOTS; i++) {
+		if (ctx.seen[i] || !st->last[i].pid) continue;
+		if (st->started) sesev(b, "del", i, 0);
+		st->last[i].pid = 0;
+	}
+
+	st->started = 1;
+}
+
+void test_sesreg(void)
+{
+	char dir[] = "/tmp/sesregXXXXXX", *fn, tb[4];
+	struct fdbuf b = {0};
+	struct sesent *e, *e2;
+	struct sesevst *st = calloc(1, sizeof *st);
+	pid_t dead;
+
+	puts("SESSION REGISTRY");
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	xasprintf(&fn, "%s/sessions", dir);
+
+	sesreg_json(fn, &b);
+	printf("missing: %.*s\n", (int)b.len, b.bf);
+
+	e = sesreg_claim(fn);
+	printf("claimed: %d\n", !!e);
+	b.len = 0;
+	sesreg_json(fn, &b);
+	printf("new: %.*s\n", (int)b.len, b.bf);
+
+	sesreg_begin(e);
+	sesreg_setstr(e, termid, "abc", 3);
+	sesreg_setstr(e, title, "title \"q\"", 9);
+	memcpy(e->clis[0], "cli12345", 8);
+	memcpy(e->clis[1], "x", 2);
+	e->ncli = 2;
+	e->lastact = 1700000000;
+	e->outbytes = 42;
+	sesreg_end(e);
+	printf("gen even: %d\n", !(e->gen & 1));
+
+	b.len = 0;
+	sesreg_json(fn, &b);
+	printf("filled: %.*s\n", (int)b.len, b.bf);
+
+	b.len = 0;
+	sesreg_events(fn, st, &b);
+	printf("events on connect:\n%.*s", (int)b.len, b.bf);
+
+	sesreg_begin(e);
+	e->outbytes = 50;
+	sesreg_end(e);
+	b.len = 0;
+	sesreg_events(fn, st, &b);
+	printf("events after output: %u\n", b.len);
+
+	sesreg_begin(e);
+	sesreg_setstr(e, title, "new", 3);
+	sesreg_end(e);
+	b.len = 0;
+	sesreg_events(fn, st, &b);
+	printf("events after title change:\n%.*s", (int)b.len, b.bf);
+
+	printf("truncated: %u %u\n",
+	       sesreg_cpy(tb, 2, "t\xc3\xa9", 3),
+	       sesreg_cpy(tb, 3, "t\xc3\xa9", 3));
+
+	/* e and e2 are separate mappings of the first entry. */
+	e2 = sesreg_claim(fn);
+	printf("same process reuses entry: %d\n", !e->termidlen);
+	munmap(e2, REGSZ);
+
+	/* Stand in for a master that was killed. */
+	if (!(dead = fork())) _exit(0);
+	waitpid(dead, 0, 0);
+	e->pid = dead;
+	b.len = 0;
+	sesreg_json(fn, &b);
+	printf("dead: %.*s\n", (int)b.len, b.bf);
+	b.len = 0;
+	sesreg_events(fn, st, &b);
+	printf("events after death:\n%.*s", (int)b.len, b.bf);
+
+	e2 = sesreg_claim(fn);
+	printf("dead entry reused: %d\n", e->pid == getpid());
+	b.len = 0;
+	sesreg_events(fn, st, &b);
+	printf("events after reuse:\n%.*s", (int)b.len, b.bf);
+	sesreg_free(e2);
+	munmap(e2, REGSZ);
+	b.len = 0;
+	sesreg_json(fn, &b);
+	printf("freed: %.*s\n", (int)b.len, b.bf);
+
+	munmap(e, REGSZ);
+	unlink(fn);
+	rmdir(dir);
+	free(fn);
+	free(b.bf);
+	free(st);
+}
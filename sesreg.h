@@ -0,0 +1,100 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef SESREG_H
+#define SESREG_H
+
+#include "outstreams.h"
+
+#include <stdint.h>
+
+/* Registry of running sessions, "sessions" under state_dir(), which lets the
+ * attach page list them without connecting to each master. It is an array of
+ * SESREGSLOTS entries that each master maps shared, claiming one when it starts
+ * and updating it as clients come and go and output arrives. An entry is free
+ * if its pid is zero or no longer names a running process, so entries of
+ * masters that were killed are reused by later ones.
+ *
+ * Each entry has one writer, its master. The writer makes gen odd while it is
+ * changing the entry, and readers retry an entry that was odd or whose gen
+ * changed while they copied it. */
+#define SESREGSLOTS	512
+#define SESREGCLIS	16
+
+struct sesent {
+	uint32_t gen;
+	int32_t pid;
+
+	/* When output was last read, in seconds since the Unix epoch, and how
+	   many bytes of output have been sent to clients. */
+	int64_t lastact;
+	uint64_t outbytes;
+
+	/* Lengths of the strings below, and how many clients are in clis. */
+	uint32_t termidlen, titlelen, ncli;
+
+	/* Terminal ID, empty for an ephemeral session. */
+	char termid[128];
+
+	char title[256];
+
+	/* Endpoint IDs of up to SESREGCLIS clients receiving output. */
+	char clis[SESREGCLIS][8];
+};
+
+/* Claims an entry in the registry at path for the calling process, creating
+ * the registry if needed. Returns null if it cannot be opened or is full. */
+struct sesent *sesreg_claim(const char *path);
+
+/* Frees an entry claimed by the calling process. */
+void sesreg_free(struct sesent *e);
+
+/* Bracket changes to an entry. */
+void sesreg_begin(struct sesent *e);
+void sesreg_end(struct sesent *e);
+
+/* Sets a string field of an entry being changed, truncating it to fit without
+ * splitting a UTF-8 sequence. */
+#define sesreg_setstr(e, f, s, n) \
+	((e)->f##len = sesreg_cpy((e)->f, sizeof (e)->f, s, n))
+uint32_t sesreg_cpy(char *dst, size_t cap, const char *s, size_t len);
+
+/* Calls fn with a copy of each live entry in the registry at path and its
+ * index. */
+void sesreg_each(const char *path, void *ctx,
+		 void (*fn)(void *ctx, int i, const struct sesent *c));
+
+/* Appends a JSON array of the live sessions in the registry at path, each an
+ * array of:
+ *	0: endpoint IDs of its clients receiving output
+ *	1: termid string
+ *	2: title string
+ *	3: lastact
+ *	4: outbytes
+ *	5: index of its entry, which identifies it while it runs
+ * A missing registry is an empty array. */
+void sesreg_json(const char *path, struct fdbuf *b);
+
+/* What a stream of events has told its reader. Zero it before the first call
+ * to sesreg_events. */
+struct sesevst {
+	/* Each entry as of the last call, with a zero pid if it was not live */
+	struct sesent last[SESREGSLOTS];
+
+	unsigned started	: 1;
+};
+
+/* Appends server-sent events for how the registry at path changed since the
+ * last call with st. The first call gives a "list" event with the sessions as
+ * sesreg_json does. Later calls give an "add" event for each new session, a
+ * "ses" event for each whose title or clients changed, each with the session
+ * as an element of that list, and a "del" event with the index of each that
+ * ended. */
+void sesreg_events(const char *path, struct sesevst *st, struct fdbuf *b);
+
+void test_sesreg(void);
+
+#endif
@@ -12,7 +12,11 @@
 #include <md4c-html.h>
 #include "wts.h"
 #include "http.h"
+#include "inbound.h"
 #include "spawner.h"
+#include "sbview.h"
+#include "sesreg.h"
+#include "authtab.h"
 #include "dtachctx.h"
 #include "tm.c"
 #include "third_party/st/b64.h"
@@ -37,15 +41,40 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <err.h>
 #include <stdarg.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <signal.h>
 
-static char *argv0, *termid, *logview, *sblvl, *dtachlog;
+static char	*argv0, *termid, *logview, *sblvl, *sbmem, *dtachlog, *resume,
+		*diff, *pool;
 static const char *qs;
 
 static size_t argv0sz;
 
+/* Default size of the scrollback ring kept by the master, in KiB, and the
+   most that sbmem= can ask for. Each line takes 2 fields, 4 per run of cells
+   with the same attributes, and 1 per non-blank cell. */
+#define SBMEMKIB	4096
+#define SBMEMMAXKIB	(1024 * 1024)
+
+/* Least number of seconds between writes of the screen image */
+#define SCRIMGSECS	2
+
+/* Bytes of client output the master keeps for clients that fall behind or
+   reconnect */
+#define OUTRINGSZ	(256 * 1024)
+
+/* Most output a client shown again is sent rather than the state */
+#define UNPAUSEBYTES	(16 * 1024)
+
+/* Most diffs sent to a client in diff mode per second */
+#define DIFFFPS		30
+
 /* Terminal Machine (TM...) functions are implemented in both Javascript and C.
  * They consider arguments to be untrusted - memory access must be guarded.
  * This means out-of-bounds checking to prevent an uncaught exception in
@@ -88,37 +117,346 @@ void Ttywriteraw(int trm, int dq, int of, int sz)
 	fdb_routs(&therout, deqtostring(dq, of), sz);
 }
 
+static long long nowms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Moves the rows the engine marked dirty to the change counts kept for diff
+   mode, so that a row changed after diff dgen was sent has rowgen > dgen. Any
+   call counts as a change, since the cursor has likely moved. */
+static void diffharvest(void)
+{
+	int y, n = term(wts.t,row), dirt = term(wts.t,dirty);
+
+	wts.dgen++;
+	if (n > wts.rowgencap) {
+		wts.rowgen = realloc(wts.rowgen, n * sizeof(*wts.rowgen));
+		if (!wts.rowgen) err(1, "allocating row change counts");
+		for (y = wts.rowgencap; y < n; y++) wts.rowgen[y] = wts.dgen;
+		wts.rowgencap = n;
+	}
+
+	for (y = 0; y < n; y++) {
+		if (!fld(dirt, y)) continue;
+		fld(dirt, y) = 0;
+		wts.rowgen[y] = wts.dgen;
+	}
+}
+
+/* Output read while no client is receiving it, which the engine is run over
+   only when its state is needed */
+#define LAZYMAX		(1024 * 1024)
+static int ttyd;
+
 struct fdbuf therout;
+
+/* Runs the engine over output buffered in lazy mode (see tty_out_lazy). */
+static void tmsync(void)
+{
+	unsigned tl = therout.len;
+
+	if (!wts.lazyb.len) return;
+
+	ttyd = deqsetutf8(ttyd ? ttyd : deqmk(), wts.lazyb.bf, wts.lazyb.len);
+	twrite(wts.t, ttyd, -1, 0);
+	wts.lazyb.len = 0;
+	diffharvest();
+	wts.scrimgdirty = 1;
+
+	/* Drop replies to queries in the output, as no client saw them. */
+	therout.len = tl;
+}
+
+/* Appends a snapshot of the engine to the checkpoint file of the timed raw log
+   if one is due. This is done by a child process with a copy of the engine, so
+   the master does not wait on the filesystem. Fork twice so the child is not
+   ours, as for the log writer. */
+static void checkpoint(void)
+{
+	void *img;
+	size_t sz;
+	pid_t pid;
+
+	if (!rec_ckpdue(&wts.rec)) return;
+
+	pid = fork();
+	if (pid < 0) { perror("fork for checkpoint"); return; }
+	if (pid) {
+		while (0 > waitpid(pid, 0, 0) && errno == EINTR) {}
+		return;
+	}
+	if (fork()) _exit(0);
+
+	/* Leave out the scrollback ring, which is only useful while the
+	   session is running. */
+	if (term(wts.t,sbring))
+		term(wts.t,sbring) = sbrstub(term(wts.t,sbring));
+
+	sz = tmimgsz();
+	img = malloc(sz);
+	if (!img) { perror("malloc checkpoint"); _exit(1); }
+	tmsave(img);
+	rec_ckpput(&wts.rec, wts.t, img, sz);
+	_exit(0);
+}
+
+/* Writes the screen image if the engine changed and the last image is at least
+   SCRIMGSECS old. Changes made sooner are written once that much time has
+   passed, by duework, or when the master exits. This is done by a child
+   process, as for checkpoints. */
+static void scrimgput(void)
+{
+	time_t now;
+	pid_t pid;
+
+	if (!wts.scrimg || !wts.t) return;
+	if (!wts.scrimgdirty && !wts.lazyb.len) return;
+
+	now = time(0);
+	if (now - wts.scrimgtm < SCRIMGSECS && now >= wts.scrimgtm) return;
+	wts.scrimgtm = now;
+	tmsync();
+	wts.scrimgdirty = 0;
+
+	pid = fork();
+	if (pid < 0) { perror("fork for screen image"); return; }
+	if (pid) {
+		while (0 > waitpid(pid, 0, 0) && errno == EINTR) {}
+		return;
+	}
+	if (fork()) _exit(0);
+
+	if (term(wts.t,sbring))
+		term(wts.t,sbring) = sbrstub(term(wts.t,sbring));
+	_exit(!tmimgwrite(wts.scrimg, wts.t));
+}
+
+/* Whether the title in the session registry may be out of date and can be
+   found again, which needs the engine caught up. */
+static int sesttlstale(void)
+{
+	return	wts.ses && !wts.clnttl && wts.t && !wts.lazyb.len
+	&&	wts.sesttlgen != wts.dgen;
+}
+
+int duewait(void)
+{
+	struct timespec ts;
+	time_t now = time(0);
+	int wait = -1;
+
+	if (wts.scrimg && wts.t && (wts.scrimgdirty || wts.lazyb.len)) {
+		if (now < wts.scrimgtm || now - wts.scrimgtm >= SCRIMGSECS)
+			return 0;
+		wait = (wts.scrimgtm + SCRIMGSECS - now) * 1000;
+	}
+
+	/* The title is found at most once a second; see publish_session. */
+	if (sesttlstale()) {
+		if (wts.sesttltm != now) return 0;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if (wait < 0 || wait > 1000 - ts.tv_nsec / 1000000)
+			wait = 1000 - ts.tv_nsec / 1000000;
+	}
+
+	return wait;
+}
+
+void duework(void) { scrimgput(); }
+
+/* Gives wts.t a scrollback ring of sbmem KiB, numbering lines after those
+   counted by the ring it has, if any. */
+static void mksbring(void)
+{
+	long kib = sbmem ? strtol(sbmem, 0, 10) : SBMEMKIB;
+	int old = term(wts.t,sbring);
+
+	if (kib > SBMEMMAXKIB) kib = SBMEMMAXKIB;
+	term(wts.t,sbring) = kib > 0 ? sbrmk(kib * 256) : 0;
+	if (!old) return;
+
+	if (term(wts.t,sbring))
+		sbr_first(term(wts.t,sbring)) = sbr_first(old) + sbr_cnt(old);
+	tmfree(old);
+}
+
+/* Appends client output to the ring, numbering it from outseq. */
+static void outpush(const char *b, size_t n)
+{
+	size_t of, cp;
+
+	if (!wts.outring && !(wts.outring = malloc(OUTRINGSZ)))
+		err(1, "allocating output ring");
+
+	if (n > OUTRINGSZ) {
+		outseq += n - OUTRINGSZ;
+		b += n - OUTRINGSZ;
+		n = OUTRINGSZ;
+	}
+
+	while (n) {
+		of = outseq % OUTRINGSZ;
+		cp = OUTRINGSZ - of < n ? OUTRINGSZ - of : n;
+		memcpy(wts.outring + of, b, cp);
+		outseq += cp;
+		b += cp;
+		n -= cp;
+	}
+}
+
+void outring_start(void)
+{
+	wts.outep = (unsigned long long)time(0) * 100000 + getpid() % 100000;
+}
+
+void tty_out_lazy(int lazy)
+{
+	wts.lazy = lazy;
+}
+
+unsigned long long outseq;
 void process_tty_out(void *buf, ssize_t len)
 {
-	static int d;
 	int sbbuf;
+	size_t outst = therout.len;
 
 	if (len < 0) len = strlen(buf);
 
-	if (wts.writerawlg) full_write(&wts.rawlogde, buf, len);
+	if (wts.rec.ckpfd)	rec_out(&wts.rec, &wts.rawlgsk, buf, len);
+	else if (wts.writerawlg)	logsink_write(&wts.rawlgsk, buf, len);
 
 	if (!wts.t) {
 		wts.t = term_new();
 		tnew(wts.t, 80, 25);
 		if (wts.writelg) term(wts.t,sbbuf) = deqmk();
+		mksbring();
+	}
+
+	/* Plain logs and checkpoints need the engine to keep up. */
+	if (wts.lazy && !wts.writelg && !wts.rec.ckpfd) {
+		if (wts.lazyb.len + len > LAZYMAX) tmsync();
+		fdb_apnd(&wts.lazyb, buf, len);
+	}
+	else {
+		tmsync();
+		ttyd = deqsetutf8(ttyd ? ttyd : deqmk(), buf, len);
+		twrite(wts.t, ttyd, -1, 0);
+		diffharvest();
+		checkpoint();
+		wts.scrimgdirty = 1;
 	}
-	d = deqsetutf8(d ? d:deqmk(), buf, len);
-	twrite(wts.t, d, -1, 0);
+	scrimgput();
 
 	fdb_routs(&therout, buf, len);
 	fdb_apnc(&therout, '\n');
+	outpush((char *)therout.bf + outst, therout.len - outst);
 
 	if (wts.writelg) {
 		sbbuf = term(wts.t,sbbuf);
 		if (deqsiz(sbbuf)) {
-			full_write(&wts.logde,	deqtostring(sbbuf, 0),
-						deqbytsiz(sbbuf));
+			logsink_write(&wts.lgsk,	deqtostring(sbbuf, 0),
+							deqbytsiz(sbbuf));
 			deqclear(sbbuf);
 		}
 	}
 }
 
+/* Seeking in a timed raw log. rd reads the records after the checkpoint in ck,
+   if any, and ev holds the first record after the time sought, if ev.tag is
+   set. */
+struct replay {
+	struct recrd *rd;
+	struct ckphdr ck;
+	struct recev ev;
+
+	/* Input deq for twrite */
+	int d;
+
+	/* Records applied after the checkpoint to reach the time */
+	unsigned long long nrec;
+};
+
+/* Applies a record to wts.t as the master did when it was logged. */
+static void replayrec(struct replay *rp)
+{
+	switch (rp->ev.tag) {
+	case 'S':
+		term_fre(wts.t);
+		wts.t = 0;
+		break;
+
+	case 'w':
+		if (wts.t) tresize(wts.t, rp->ev.cols, rp->ev.rows);
+		break;
+
+	case 'o':
+		if (!wts.t) {
+			wts.t = term_new();
+			tnew(wts.t, 80, 25);
+		}
+		rp->d = deqsetutf8(rp->d ? rp->d : deqmk(),
+				   rp->ev.dat.bf, rp->ev.dat.len);
+		twrite(wts.t, rp->d, -1, 0);
+		break;
+	}
+}
+
+/* Brings wts.t to its state at time at in the log at path, from the last
+   checkpoint before it. Returns 0 if the log cannot be read. */
+static int replayseek(struct replay *rp, const char *path, unsigned long long at)
+{
+	struct fdbuf img = {0};
+
+	rp->rd = recrd_open(path, at, &rp->ck, &img);
+	if (!rp->rd) return 0;
+
+	wts.t = 0;
+	if (rp->ck.magic[0]) {
+		/* Images from an older engine may lack term fields. */
+		if (	tmload(img.bf, img.len)
+		&&	tmlen(rp->ck.t) >= term_fldcnt) {
+			wts.t = rp->ck.t;
+		}
+		else {
+			warnx("bad checkpoint in %s; replaying from start", path);
+			recrd_close(rp->rd);
+			rp->rd = recrd_open(path, 0, &rp->ck, &img);
+		}
+	}
+	fdb_finsh(&img);
+
+	rp->d = 0;
+	rp->nrec = 0;
+	while (rp->rd && recrd_next(rp->rd, &rp->ev) && rp->ev.ms <= at) {
+		replayrec(rp);
+		rp->nrec++;
+	}
+
+	return !!rp->rd;
+}
+
+static void replayend(struct replay *rp)
+{
+	recrd_close(rp->rd);
+	fdb_finsh(&rp->ev.dat);
+}
+
+/* Sleeps for dms milliseconds of log time played at speed. */
+static void replaywait(unsigned long long dms, double speed)
+{
+	double ms = dms / speed;
+	struct timespec ts;
+
+	if (ms > RECMAXGAP) ms = RECMAXGAP;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms - ts.tv_sec * 1000.0) * 1000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR) {}
+}
+
 static void recounttitl(struct wrides *de)
 {
 	struct fdbuf b = {.de = de};
@@ -186,7 +524,17 @@ static void processquerystr(const char *fullqs)
 		if (parsequeryarg("termid=",	&termid		)) continue;
 		if (parsequeryarg("logview=",	&logview	)) continue;
 		if (parsequeryarg("sblvl=",	&sblvl		)) continue;
+		if (parsequeryarg("sbmem=",	&sbmem		)) continue;
 		if (parsequeryarg("dtachlog=",	&dtachlog	)) continue;
+		if (parsequeryarg("resume=",	&resume		)) continue;
+		if (parsequeryarg("diff=",	&diff		)) continue;
+		if (parsequeryarg("pool=",	&pool		)) continue;
+
+		/* Only for admission, which http_parse_req has done. */
+		if (!strncmp(qs, "hidden=", 7)) {
+			qs = strchrnul(qs, '&');
+			continue;
+		}
 
 		fprintf(stderr,
 			"invalid query string arg at char pos %zu in '%s'\n",
@@ -252,7 +600,7 @@ static void appenddir(char **p, int nmb)
 	if (mkdir(*p, 0700) && errno != EEXIST) err(1, "cannot create %s", *p);
 }
 
-static int opnforlog(const struct tm *tim, const char *suff)
+static int opnforlog(const struct tm *tim, const char *suff, int apnd)
 {
 	int fd;
 	char *dir, *fn;
@@ -265,7 +613,7 @@ static int opnforlog(const struct tm *tim, const char *suff)
 	xasprintf(&fn, "%s/%s%s", dir, termid, suff);
 	free(dir);
 
-	fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	fd = open(fn, O_RDWR | O_CREAT | (apnd ? O_APPEND : 0), 0600);
 	if (fd < 0) {
 		warn("open %s", fn);
 		fd = 0;
@@ -274,26 +622,148 @@ static int opnforlog(const struct tm *tim, const char *suff)
 	return fd;
 }
 
-void open_logs(void)
+/* Opens the log named with suff for appending, compressed if gz is set. A
+   compressed log is named suff.gz and needs its frame index, suff.gz.idx, whose
+   fd is put in *zidx. If the index cannot be opened, the log is written plain
+   under the name without .gz instead, and *zidx is 0. */
+static int opnlog(const struct tm *tim, const char *suff, int gz, int *zidx)
+{
+	char *zsuff;
+	int fd;
+
+	*zidx = 0;
+	if (gz) {
+		xasprintf(&zsuff, "%s.gz.idx", suff);
+		*zidx = opnforlog(tim, zsuff, 1);
+		free(zsuff);
+	}
+	if (!*zidx) return opnforlog(tim, suff, 1);
+
+	xasprintf(&zsuff, "%s.gz", suff);
+	fd = opnforlog(tim, zsuff, 1);
+	free(zsuff);
+
+	if (!fd) {
+		close(*zidx);
+		*zidx = 0;
+	}
+	return fd;
+}
+
+void open_logs(Dtachctx dc)
 {
 	time_t now;
 	struct tm tim;
+	struct logsink *snks[2];
+	int snkc = 0, gz;
 
 	now = time(NULL);
 	if (!localtime_r(&now, &tim)) err(1, "cannot get time");
 
 	/* sblvl configures scrollback logging. If the string has "p" then plain
-	 * logging is on, if "r" then raw logging is on. */
+	 * logging is on, if "r" then raw logging is on, and if "t" then raw
+	 * logging is on with timestamps and checkpoints for replay. Logs are
+	 * written by a separate process unless "s" is given, and "f" fsyncs each
+	 * batch. "z" compresses the logs, which is always done by the separate
+	 * process. The plain log gets a trigram index for /logsearch. */
 	if (!sblvl) sblvl = strdup("p");
+	gz = !!strchr(sblvl, 'z');
 
 	if (strchr(sblvl, 'p')) {
 		wts.writelg = 1;
-		wts.logde.fd = opnforlog(&tim, "");
+		wts.lgsk.de.fd = opnlog(&tim, "", gz, &wts.lgsk.zidx);
+		wts.lgsk.tri.fd = opnforlog(
+			&tim, wts.lgsk.zidx ? ".gz.tri" : ".tri", 0);
+		wts.lgsk.dropnote = 1;
+		if (wts.lgsk.de.fd) snks[snkc++] = &wts.lgsk;
 	}
-	if (strchr(sblvl, 'r')) {
+	if (strchr(sblvl, 't')) {
 		wts.writerawlg = 1;
-		wts.rawlogde.fd = opnforlog(&tim, ".raw");
+		wts.rawlgsk.de.fd = opnlog(&tim, ".rec", gz, &wts.rawlgsk.zidx);
+		if (wts.rawlgsk.de.fd) {
+			rec_open(&wts.rec, &wts.rawlgsk,
+				 opnforlog(&tim, ".rec.ckp", 1));
+			snks[snkc++] = &wts.rawlgsk;
+		}
+	}
+	else if (strchr(sblvl, 'r')) {
+		wts.writerawlg = 1;
+		wts.rawlgsk.de.fd = opnlog(&tim, ".raw", gz, &wts.rawlgsk.zidx);
+		if (wts.rawlgsk.de.fd) snks[snkc++] = &wts.rawlgsk;
+	}
+
+	if (snkc && (gz || !strchr(sblvl, 's')))
+		start_logwriter(dc, snks, snkc, !!strchr(sblvl, 'f'));
+
+	if (wts.lgsk.tri.fd && !wts.lgsk.async && wts.lgsk.de.fd > 0)
+		triidx_load(&wts.lgsk.tri, wts.lgsk.de.fd, 0);
+}
+
+/* If the subprocess is gone, the session is over and its screen image is of no
+   use to a later master. Otherwise, as when the master is killed, the image is
+   kept, and changes not yet in it are written first. */
+static void scrimgexit(void)
+{
+	if (getpid() != wts.scrimgpid) return;
+	if (kill(wts.subpid, 0) && errno == ESRCH) {
+		unlink(wts.scrimg);
+		return;
+	}
+	if (!wts.t || (!wts.scrimgdirty && !wts.lazyb.len)) return;
+
+	tmsync();
+	wts.scrimgdirty = 0;
+	if (term(wts.t,sbring))
+		term(wts.t,sbring) = sbrstub(term(wts.t,sbring));
+	tmimgwrite(wts.scrimg, wts.t);
+}
+
+void restore_screen(Dtachctx dc)
+{
+	char *dir;
+	int t, sbbuf;
+
+	xasprintf(&dir, "%s/screens", state_dir());
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		warn("cannot create %s", dir);
+		free(dir);
+		return;
+	}
+	xasprintf(&wts.scrimg, "%s/%s.tmi", dir, termid);
+	free(dir);
+
+	wts.scrimgpid = getpid();
+	wts.subpid = dc->the_pty.pid;
+	atexit(scrimgexit);
+
+	t = tmimgload(wts.scrimg);
+	if (!t) return;
+
+	/* Images from an older engine may lack term fields. */
+	if (tmlen(t) < term_fldcnt) {
+		warnx("screen image from another version: %s", wts.scrimg);
+		return;
 	}
+
+	wts.t = t;
+	sbbuf = term(t,sbbuf);
+	if (sbbuf && !wts.writelg)	{ tmfree(sbbuf); sbbuf = 0; }
+	if (!sbbuf && wts.writelg)	sbbuf = deqmk();
+	if (sbbuf)			deqclear(sbbuf);
+	term(t,sbbuf) = sbbuf;
+	mksbring();
+}
+
+void logs_fdset(fd_set *wfds, int *highest_fd)
+{
+	logsink_fdset(&wts.lgsk,	wfds, highest_fd);
+	logsink_fdset(&wts.rawlgsk,	wfds, highest_fd);
+}
+
+void logs_pump(fd_set *wfds)
+{
+	if (FD_ISSET(wts.lgsk.de.fd,	wfds)) logsink_pump(&wts.lgsk);
+	if (FD_ISSET(wts.rawlgsk.de.fd,	wfds)) logsink_pump(&wts.rawlgsk);
 }
 
 static Dtachctx prepfordtach(void)
@@ -301,6 +771,7 @@ static Dtachctx prepfordtach(void)
 	Dtachctx dc = calloc(1, sizeof(*dc));
 	char *dtlogfn = 0;
 	int lgfd = -1, ok;
+	unsigned long long ep, seq;
 	struct fdbuf sp = {0};
 
 	/* sp is a predictable string to use in the socket name or related
@@ -317,6 +788,14 @@ static Dtachctx prepfordtach(void)
 
 	dc->isephem = !termid;
 
+	/* diff asks for screen diffs after the state rather than output.
+	   resume is EPOCH.SEQ as last received by the client, who asks for the
+	   output after it rather than the whole state. */
+	if (diff)
+		dc->atchesc = strdup("\\N\\D");
+	else if (termid && resume && 2 == sscanf(resume, "%llu.%llu", &ep, &seq))
+		xasprintf(&dc->atchesc, "\\R%016llx%016llx", ep, seq);
+
 	if (!termid && !logview)
 		write_wbsoc_frame(ephemeral_hello, EPHEMERAL_HELLO_LEN);
 
@@ -384,36 +863,77 @@ static void newsessinhtml(struct iterprofspec *spc, char k, const void *nmarg)
 	}
 }
 
-static int proflines(
-	const char *grpname, const char *prffn, struct iterprofspec *spc)
+/* A line of a profile group file */
+struct profent {
+	/* Name, preamble and auxiliary JS fields. nm.bf is also null-terminated.
+	   js is the rest of the line, including any further tabs. */
+	struct fdbuf nm, pream, js;
+
+	unsigned namerr		: 1;	/* name has an illegal char */
+};
+
+struct profgrp {
+	char *name;
+	struct profent *ents;
+	unsigned nent;
+};
+
+/* Profiles read from every group file on a profile path. The spawner builds it
+   and rebuilds it when inotify reports a change in a profile dir, and children
+   get it when they are forked so they need not read the files.
+
+   A process checks that an index is current by seeing that no change is waiting
+   to be read from the inotify instance, then that profgen is the one the index
+   was built at. The spawner bumps profgen before reading the changes and again
+   once it has rebuilt, so a change it has already read is never missed. */
+struct profidx {
+	char *ppaths;
+	struct profgrp *grps;
+	unsigned ngrp;
+
+	/* Dirs on the path which did not exist, so could not be watched */
+	char **missing;
+	unsigned nmissing;
+
+	unsigned gen;
+};
+
+#define PROFWATCH (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | \
+		   IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+		   IN_DELETE_SELF | IN_MOVE_SELF)
+
+static struct profidx *profidx;
+static unsigned *profgen;	/* shared by the spawner and its children */
+static int profinfd = -1;
+static pid_t profowner;
+
+static void proflines(
+	const char *grpname, const char *prffn, struct profidx *ix)
 {
-	const char *cmpname;
-	int lineno = 0, namematc = 0, namerr = 0;
+	struct profgrp *g;
+	struct profent *e = 0;
+	int lineno = 0;
 
-	char fld, eofield, namemat, err = 0, startedjs;
-	char begunprenam, c;
-	struct fdbuf nmbuf = {0};
+	char fld, eofield, err = 0, c;
 	FILE *pff = fopen(prffn, "r");
 
 	if (!pff) {
 		perror("fopen for profile");
 		fprintf(stderr, "prpath=%s group=%s\n", prffn, grpname);
-		return 0;
+		return;
 	}
 
-	newsessinhtml(spc, 's', grpname);
+	ix->grps = realloc(ix->grps, sizeof(*g) * (ix->ngrp + 1));
+	g = ix->grps + ix->ngrp++;
+	*g = (struct profgrp){strdup(grpname)};
 
 	c = '\n';
 	do {
 		if (c == '\n') {
-			cmpname = termid ? termid : "";
-
-			namemat = 0;
+			g->ents = realloc(g->ents, sizeof(*e) * (g->nent + 1));
+			e = g->ents + g->nent++;
+			memset(e, 0, sizeof(*e));
 			fld = 'n';
-			startedjs = 0;
-			begunprenam = 0;
-			nmbuf.len = 0;
-			namerr = 0;
 			lineno++;
 		}
 
@@ -421,6 +941,7 @@ static int proflines(
 		c = getc(pff);
 		if (c == EOF && ferror(pff)) {
 			perror("getc for profile def file");
+			if (fld == 'n') fdb_finsh(&g->ents[--g->nent].nm);
 			break;
 		}
 		eofield = c == '\n' || c == EOF || c == '\t';
@@ -429,15 +950,9 @@ static int proflines(
 		/* n = name field, p = preamble, j = auxjs list */
 		case 'n':
 			if (eofield) {
-				namemat = cmpname &&
-					(!*cmpname || '.' == *cmpname);
-				namematc += namemat;
+				fdb_apnc(&e->nm, 0);
+				e->nm.len--;
 				fld = 'p';
-
-				if (spc->newsessin && !namerr && nmbuf.len) {
-					fdb_apnc(&nmbuf, 0);
-					newsessinhtml(spc, 'i', nmbuf.bf);
-				}
 				break;
 			}
 
@@ -445,38 +960,20 @@ static int proflines(
 				fprintf(stderr,
 					"illegal char '%c' in profile name", c);
 				err = 1;
-				namerr = 1;
-				cmpname = NULL;
+				e->namerr = 1;
 			}
 
-			if (cmpname && *cmpname++ != c) cmpname = NULL;
-			fdb_apnc(&nmbuf, c);
+			fdb_apnc(&e->nm, c);
 
 			break;
 		case 'p':
-			if (eofield) {
-				fld = 'j';
-				if (begunprenam) fdb_apnc(spc->sigb, '\n');
-				break;
-			}
-			if (namemat && spc->sendpream) {
-				fdb_apnc(spc->sigb, c);
-				begunprenam = 1;
-			}
+			if (eofield)	fld = 'j';
+			else		fdb_apnc(&e->pream, c);
 
 			break;
 
 		case 'j':
-			if (eofield) {
-				if (startedjs) fdb_apnc(spc->sigb, '\n');
-				break;
-			}
-			if (namemat && spc->sendauxjs) {
-				if (!startedjs)
-					fdb_apnd(spc->sigb, "\\@auxjs:", -1);
-				startedjs = 1;
-				fdb_apnc(spc->sigb, c);
-			}
+			if (c != '\n' && c != EOF) fdb_apnc(&e->js, c);
 
 			break;
 
@@ -490,34 +987,60 @@ static int proflines(
 		}
 	} while (c != EOF);
 
-	newsessinhtml(spc, 'e', 0);
-
-	fdb_finsh(&nmbuf);
 	fclose(pff);
+}
+
+static void profidxfree(struct profidx *ix)
+{
+	struct profgrp *g;
+	struct profent *e;
+
+	if (!ix) return;
+
+	for (g = ix->grps; g != ix->grps + ix->ngrp; g++) {
+		for (e = g->ents; e != g->ents + g->nent; e++) {
+			fdb_finsh(&e->nm);
+			fdb_finsh(&e->pream);
+			fdb_finsh(&e->js);
+		}
+		free(g->ents);
+		free(g->name);
+	}
+	while (ix->nmissing) free(ix->missing[--ix->nmissing]);
 
-	return namematc;
+	free(ix->missing);
+	free(ix->grps);
+	free(ix->ppaths);
+	free(ix);
 }
 
-static void iterprofs(const char *ppaths_, struct iterprofspec *spc)
+static struct profidx *profidxbuild(const char *ppaths_, int diaglog)
 {
 	DIR *pd;
 	char *ppaths = strdup(ppaths_), *tkn, *savepp, *ppitr, *ffn = 0;
+	struct profidx *ix = calloc(1, sizeof(*ix));
 
 	struct dirent *den;
-	int namematc = 0;
 
-	/* "--" prefix to sort this category first. This hack can be removed
-	 * once the sorting logic is moved out of shell. */
-	newsessinhtml(spc, 's', "--basic");
-	newsessinhtml(spc, 'b', 0);
-	newsessinhtml(spc, 'e', 0);
+	ix->ppaths = strdup(ppaths_);
 
 	for (ppitr = ppaths; ; ppitr = NULL) {
 		if (!(tkn = strtok_r(ppitr, ":", &savepp))) break;
 		fprintf(stderr, "reading profile dir at: %s\n", tkn);
 
+		/* Watch before reading so no change is missed. */
+		if (getpid() == profowner &&
+		    0 > inotify_add_watch(profinfd, tkn, PROFWATCH) &&
+		    errno != ENOENT)
+			perror("inotify_add_watch");
+
 		pd = opendir(tkn);
 		if (!pd) {
+			if (errno == ENOENT) {
+				ix->missing = realloc(ix->missing,
+					sizeof(char *) * (ix->nmissing + 1));
+				ix->missing[ix->nmissing++] = strdup(tkn);
+			}
 			perror("opendir");
 			continue;
 		}
@@ -534,17 +1057,17 @@ static void iterprofs(const char *ppaths_, struct iterprofspec *spc)
 			xasprintf(&ffn, "%s/%s", tkn, den->d_name);
 
 			if (den->d_name[0] == '.') {
-				if (spc->diaglog)
+				if (diaglog)
 					fprintf(stderr,
 						"  skipped file '%s'\n",
 						den->d_name);
 				continue;
 			}
 
-			if (spc->diaglog)
+			if (diaglog)
 				fprintf(stderr, "  group %s\n", den->d_name);
 
-			namematc += proflines(den->d_name, ffn, spc);
+			proflines(den->d_name, ffn, ix);
 		}
 
 		closedir(pd);
@@ -553,6 +1076,109 @@ static void iterprofs(const char *ppaths_, struct iterprofspec *spc)
 	free(ppaths);
 	free(ffn);
 
+	return ix;
+}
+
+static int profidxcurrent(const struct profidx *ix, const char *ppaths)
+{
+	struct stat sb;
+	unsigned i;
+	int pend;
+
+	if (!ix || !profgen || strcmp(ix->ppaths, ppaths)) return 0;
+
+	if (ioctl(profinfd, FIONREAD, &pend) || pend) return 0;
+	if (ix->gen != __atomic_load_n(profgen, __ATOMIC_ACQUIRE)) return 0;
+
+	for (i = 0; i < ix->nmissing; i++)
+		if (!stat(ix->missing[i], &sb)) return 0;
+
+	return 1;
+}
+
+/* Returns the index for the profile path ppaths, rebuilding it if it is not
+   current. */
+static const struct profidx *profidxget(const char *ppaths, int diaglog)
+{
+	char evs[4096];
+	unsigned gen;
+
+	if (profidxcurrent(profidx, ppaths)) return profidx;
+
+	if (profgen && getpid() == profowner) {
+		__atomic_add_fetch(profgen, 1, __ATOMIC_ACQ_REL);
+		while (0 < read(profinfd, evs, sizeof(evs))) {}
+	}
+	gen = profgen ? __atomic_load_n(profgen, __ATOMIC_ACQUIRE) : 0;
+
+	profidxfree(profidx);
+	profidx = profidxbuild(ppaths, diaglog);
+
+	if (profgen && getpid() == profowner)
+		gen = __atomic_add_fetch(profgen, 1, __ATOMIC_ACQ_REL);
+	profidx->gen = gen;
+
+	return profidx;
+}
+
+static int profnamemat(const struct profent *e, const char *termid)
+{
+	if (e->namerr || strncmp(termid, (char *)e->nm.bf, e->nm.len)) return 0;
+
+	termid += e->nm.len;
+	return !*termid || '.' == *termid;
+}
+
+static void iterprofs(const char *ppaths, struct iterprofspec *spc)
+{
+	const struct profidx *ix = profidxget(ppaths, spc->diaglog);
+	const struct profgrp *g;
+	const struct profent *e;
+	int namematc = 0, namemat, startedjs;
+	unsigned i;
+
+	/* "--" prefix to sort this category first. This hack can be removed
+	 * once the sorting logic is moved out of shell. */
+	newsessinhtml(spc, 's', "--basic");
+	newsessinhtml(spc, 'b', 0);
+	newsessinhtml(spc, 'e', 0);
+
+	for (g = ix->grps; g != ix->grps + ix->ngrp; g++) {
+		newsessinhtml(spc, 's', g->name);
+
+		for (e = g->ents; e != g->ents + g->nent; e++) {
+			namemat = profnamemat(e, termid ? termid : "");
+			namematc += namemat;
+
+			if (spc->newsessin && !e->namerr && e->nm.len)
+				newsessinhtml(spc, 'i', e->nm.bf);
+
+			if (!namemat) continue;
+
+			if (spc->sendpream && e->pream.len) {
+				fdb_apnd(spc->sigb, e->pream.bf, e->pream.len);
+				fdb_apnc(spc->sigb, '\n');
+			}
+
+			if (!spc->sendauxjs) continue;
+
+			/* Each tab in the list starts a new line. */
+			startedjs = 0;
+			for (i = 0; i <= e->js.len; i++) {
+				if (i == e->js.len || e->js.bf[i] == '\t') {
+					if (startedjs) fdb_apnc(spc->sigb, '\n');
+					continue;
+				}
+				if (!startedjs)
+					fdb_apnd(spc->sigb, "\\@auxjs:", -1);
+				startedjs = 1;
+				fdb_apnc(spc->sigb, e->js.bf[i]);
+			}
+		}
+
+		newsessinhtml(spc, 'e', 0);
+	}
+
 	if (namematc || !termid || !*termid) return;
 
 	if (spc->sendauxjs || spc->sendpream)
@@ -576,42 +1202,89 @@ static const char *profpath(void)
 	return profpathsavd=p;
 }
 
-static void tmstate4cli(struct wrides *de)
+void prof_maint(void)
 {
-	struct tmobj *o0, *o1;
-	int *f0, *f1;
-	struct fdbuf sigb = {de, .cap = 1024};
+	if (!profowner) {
+		profowner = getpid();
+
+		profgen = mmap(0, sizeof(*profgen), PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (profgen == MAP_FAILED) {
+			perror("mmap profile generation");
+			profgen = 0;
+			return;
+		}
 
-	if (!wts.t) return;
+		profinfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (profinfd < 0) {
+			perror("inotify_init1");
+			munmap(profgen, sizeof(*profgen));
+			profgen = 0;
+			return;
+		}
+	}
+
+	if (profgen) profidxget(profpath(), 1);
+}
 
-	fdb_apnd(&sigb, "\\@state:{\"bs\":[", -1);
+/* Appends a \\@state message with all engine objects, which the client loads
+   in place of its own. The scrollback ring is sent as a stub that only counts
+   lines; the client gets the lines with \\b when it needs them. */
+static void tmstatemsg(struct fdbuf *sigb)
+{
+	struct tmobj *o0, *o1;
+	int *f0, *f1, ring = term(wts.t,sbring);
+
+	fdb_apnd(sigb, "\\@state:{\"bs\":[", -1);
 	o0 = tmobjs.objel;
 	o1 = tmobjs.objel+tmobjs.capac;
 	for (;;) {
 		if (o0==o1) break;
-		if (o0!=tmobjs.objel) fdb_apnc(&sigb, ',');
-		if (!o0->fs) { fdb_itoa(&sigb, o0->fct); goto nexo; }
+		if (o0!=tmobjs.objel) fdb_apnc(sigb, ',');
+		if (!o0->fs) { fdb_itoa(sigb, o0->fct); goto nexo; }
+		if (ring && o0 == tmobjs.objel + ~ring) {
+			/* Same as sbrstub(ring) */
+			fdb_apnc(sigb, '[');
+			fdb_itoa(sigb, sbr_hdrflds);	fdb_apnc(sigb, ',');
+			fdb_itoa(sigb, sbr_hdrflds);	fdb_apnd(sigb, ",0,", -1);
+			fdb_itoa(sigb, sbr_first(ring) + sbr_cnt(ring));
+			fdb_apnc(sigb, ']');
+			goto nexo;
+		}
 
 		f0 = o0->fs;
 		f1 = o0->fs + o0->fct;
-		fdb_apnc(&sigb, '[');
+		fdb_apnc(sigb, '[');
 		for (;;) {
 			if (f0==f1) break;
-			if (f0!=o0->fs) fdb_apnc(&sigb, ',');
-			fdb_itoa(&sigb, *f0++);
+			if (f0!=o0->fs) fdb_apnc(sigb, ',');
+			fdb_itoa(sigb, *f0++);
 		}
-		fdb_apnc(&sigb, ']');
+		fdb_apnc(sigb, ']');
 
 	nexo:
 		o0++;
 	}
 
-	fdb_apnd(&sigb, "],\"fh\":", -1);
-	fdb_itoa(&sigb, tmobjs.bufsfreehead);
-	fdb_apnd(&sigb, ",\"t\":", -1);
-	fdb_itoa(&sigb, wts.t);
-	fdb_apnd(&sigb, "}\n", -1);
+	fdb_apnd(sigb, "],\"fh\":", -1);
+	fdb_itoa(sigb, tmobjs.bufsfreehead);
+	fdb_apnd(sigb, ",\"t\":", -1);
+	fdb_itoa(sigb, wts.t);
+	fdb_apnd(sigb, ",\"ep\":", -1);
+	fdb_itoa(sigb, wts.outep);
+	fdb_apnd(sigb, ",\"sq\":", -1);
+	fdb_itoa(sigb, outseq);
+	fdb_apnd(sigb, "}\n", -1);
+}
+
+static void tmstate4cli(struct wrides *de)
+{
+	struct fdbuf sigb = {de, .cap = 1024};
+
+	if (!wts.t) return;
 
+	tmsync();
+	tmstatemsg(&sigb);
 	fdb_finsh(&sigb);
 }
 
@@ -619,14 +1292,178 @@ static void simpdump4cl(struct wrides *de)
 {
 	struct fdbuf sigb = {de};
 	if (!wts.t) return;
+	tmsync();
 	fdb_apnd(&sigb, MODE_ALTSCREEN & term(wts.t,mode) ? "\\s2":"\\s1", -1);
 	fdb_finsh(&sigb);
 }
 
-static void profinfo4cli(struct wrides *de)
+const void *outpending(int clifd, struct clistate *cls, size_t *len)
 {
-	struct fdbuf sigb = {de};
-	iterprofs(profpath(), &((struct iterprofspec){
+	struct wrides tailde = {.to = &cls->tail};
+	size_t of;
+
+	*len = 0;
+	if (cls->outseq == outseq) return 0;
+
+	if (outseq - cls->outseq > OUTRINGSZ) {
+		/* What the client missed is gone, so give it the state. */
+		cls->outseq = outseq;
+		if (wts.allowtmstate)	tmstate4cli(&tailde);
+		else			simpdump4cl(&tailde);
+		return 0;
+	}
+
+	of = cls->outseq % OUTRINGSZ;
+	*len = outseq - cls->outseq;
+	if (*len > OUTRINGSZ - of) *len = OUTRINGSZ - of;
+	return wts.outring + of;
+}
+
+int diffwait(struct clistate *cls)
+{
+	long long wait;
+
+	if (!cls->diff || cls->paused || !wts.t) return -1;
+	if (cls->tail.len) return 0;
+	if (wts.dgen == cls->dgen) return -1;
+
+	wait = cls->dms + 1000 / DIFFFPS - nowms();
+	return wait > 0 ? wait : 0;
+}
+
+int tail4cli(int clifd, struct clistate *cls)
+{
+	struct fdbuf *b = &cls->tail;
+	ssize_t writn;
+
+	if (!b->len) return 1;
+
+	writn = write(clifd, b->bf, b->len);
+	if (writn < 0) writn = 0;
+	b->len -= writn;
+	memmove(b->bf, b->bf + writn, b->len);
+
+	return !b->len;
+}
+
+/* Sends a \\@diff message with the size of the screen, the cursor position,
+   the mode and cursor style, the number of scrollback lines so far, and each
+   row changed since the client's last diff as its number followed by the row
+   encoded as a scrollback line (see sbrmk).
+
+   If the socket takes none of the message, it is dropped and the next diff has
+   every row, since a client that far behind may as well get the whole screen.
+   If it takes part, the rest is sent before anything else. */
+void diff4cli(int clifd, struct clistate *cls)
+{
+	struct fdbuf *b = &cls->tail;
+	int y, f, ln, sz, ring, first = 1;
+	unsigned whole;
+
+	if (b->len) { tail4cli(clifd, cls); return; }
+
+	tmsync();
+	ring = term(wts.t,sbring);
+	fdb_apnd(b, "\\@diff:{\"c\":", -1);
+	fdb_itoa(b, term(wts.t,col));
+	fdb_apnd(b, ",\"r\":", -1);
+	fdb_itoa(b, term(wts.t,row));
+	fdb_apnd(b, ",\"x\":", -1);
+	fdb_itoa(b, curs_x(term(wts.t,curs)));
+	fdb_apnd(b, ",\"y\":", -1);
+	fdb_itoa(b, curs_y(term(wts.t,curs)));
+	fdb_apnd(b, ",\"m\":", -1);
+	fdb_itoa(b, term(wts.t,mode));
+	fdb_apnd(b, ",\"cu\":", -1);
+	fdb_itoa(b, term(wts.t,cursor));
+	fdb_apnd(b, ",\"sb\":", -1);
+	fdb_itoa(b, ring ? sbr_first(ring) + sbr_cnt(ring) : 0);
+	fdb_apnd(b, ",\"l\":[", -1);
+
+	for (y = 0; y < term(wts.t,row); y++) {
+		if (wts.rowgen[y] <= cls->dgen) continue;
+
+		sz = sbrenc(wts.t, term(wts.t,scr), y, 0, 0);
+		ln = tmalloc(sz);
+		sbrenc(wts.t, term(wts.t,scr), y, ln, 0);
+
+		if (!first) fdb_apnc(b, ',');
+		first = 0;
+		fdb_apnc(b, '[');
+		fdb_itoa(b, y);
+		for (f = 0; f < sz; f++) {
+			fdb_apnc(b, ',');
+			fdb_itoa(b, fld(ln, f));
+		}
+		fdb_apnc(b, ']');
+		tmfree(ln);
+	}
+
+	fdb_apnd(b, "]}\n", -1);
+
+	cls->dgen = wts.dgen;
+	cls->dms = nowms();
+
+	whole = b->len;
+	tail4cli(clifd, cls);
+	if (b->len != whole) return;
+
+	b->len = 0;
+	cls->dgen = 0;
+}
+
+/* Sends the scrollback lines requested with \\b in a \\@sbpage message.
+   first is the number of the oldest line held, from is the number of the first
+   line sent, and lines holds each line as encoded in the ring (see sbrmk).
+   Lines that were dropped or are not pushed yet are left out. */
+static void sbpage4cli(struct wrides *de)
+{
+	struct fdbuf sigb = {de};
+	char req[sizeof(wts.sbpgreq)+1] = {0};
+	long long from;
+	unsigned n;
+	int ring, p, f, sent;
+
+	memcpy(req, wts.sbpgreq, sizeof(wts.sbpgreq));
+	if (2 != sscanf(req, "%10lld%4u", &from, &n)) {
+		warnx("invalid scrollback request: %s", req);
+		return;
+	}
+
+	tmsync();
+	ring = wts.t ? term(wts.t,sbring) : 0;
+	if (!ring) return;
+
+	if (from < sbr_first(ring)) from = sbr_first(ring);
+
+	fdb_apnd(&sigb, "\\@sbpage:{\"first\":", -1);
+	fdb_itoa(&sigb, sbr_first(ring));
+	fdb_apnd(&sigb, ",\"from\":", -1);
+	fdb_itoa(&sigb, from);
+	fdb_apnd(&sigb, ",\"lines\":[", -1);
+
+	p = sbrat(ring, from);
+	for (sent = 0; p && sent < n; sent++) {
+		if (sent) fdb_apnc(&sigb, ',');
+		fdb_apnc(&sigb, '[');
+		for (f = p; f < p + fld(ring, p); f++) {
+			if (f != p) fdb_apnc(&sigb, ',');
+			fdb_itoa(&sigb, fld(ring, f));
+		}
+		fdb_apnc(&sigb, ']');
+
+		if (++from == sbr_first(ring) + sbr_cnt(ring)) break;
+		p = sbrnext(ring, p);
+	}
+
+	fdb_apnd(&sigb, "]}\n", -1);
+	fdb_finsh(&sigb);
+}
+
+static void profinfo4cli(struct wrides *de)
+{
+	struct fdbuf sigb = {de};
+	iterprofs(profpath(), &((struct iterprofspec){
 		.sigb = &sigb,
 		.sendauxjs = 1,
 		.diaglog = 1,
@@ -634,6 +1471,58 @@ static void profinfo4cli(struct wrides *de)
 	fdb_finsh(&sigb);
 }
 
+/* Starts sending output to the client, first sending the state so far. */
+static void atch4cli(struct wrides *de, struct clistate *cls)
+{
+	cls->wantsoutput = 1;
+	cls->outseq = outseq;
+	if (wts.ttl[0])		recounttitl(de);
+	if (wts.allowtmstate)	tmstate4cli(de);
+	else			simpdump4cl(de);
+	profinfo4cli(de);
+}
+
+/* Starts sending output to a reconnecting client from the point in
+   wts.resumereq, if this master produced it and still holds what came after.
+   Otherwise the client gets the state as with \\N. */
+static void resume4cli(struct wrides *de, struct clistate *cls)
+{
+	char req[sizeof(wts.resumereq)+1] = {0};
+	unsigned long long ep, seq;
+
+	memcpy(req, wts.resumereq, sizeof(wts.resumereq));
+	if (2 != sscanf(req, "%16llx%16llx", &ep, &seq)) {
+		warnx("invalid resume request: %s", req);
+		ep = 0;
+	}
+
+	if (!ep || ep != wts.outep || seq > outseq || outseq - seq > OUTRINGSZ) {
+		atch4cli(de, cls);
+		return;
+	}
+
+	cls->wantsoutput = 1;
+	cls->outseq = seq;
+	if (wts.ttl[0]) recounttitl(de);
+}
+
+/* Resumes output to a client paused with \\P. It is sent the output it
+   missed if there is little, and the state otherwise. A client in diff mode
+   is sent a diff as usual. */
+static void unpause4cli(struct wrides *de, struct clistate *cls)
+{
+	if (!cls->paused) return;
+	cls->paused = 0;
+
+	if (cls->diff) return;
+
+	if (outseq - cls->outseq <= UNPAUSEBYTES) return;
+
+	cls->outseq = outseq;
+	if (wts.allowtmstate)	tmstate4cli(de);
+	else			simpdump4cl(de);
+}
+
 void send_pream(int fd)
 {
 	struct fdbuf ob = {&(struct wrides){fd}};
@@ -654,18 +1543,82 @@ void send_pream(int fd)
 	fdb_finsh(&ob);
 }
 
-static void linetitl(struct fdbuf *o)
+/* Returns a deq holding the last non-empty line at or above the cursor. */
+static int linetitldeq(void)
 {
-	int td = deqmk(), y = curs_y(term(wts.t,curs));
+	int td, y;
+
+	tmsync();
+	td = deqmk();
+	y = curs_y(term(wts.t,curs));
 
 	for (;;) {
 		td = tpushlinestr(wts.t, td, y);
 		if (--y < 0 || deqbytsiz(td)) break;
 	}
+	return td;
+}
+
+static void linetitl(struct fdbuf *o)
+{
+	int td = linetitldeq();
+
 	fdb_json(o, deqtostring(td, 0), deqbytsiz(td));
 	tmfree(td);
 }
 
+static void sesexit(void) { sesreg_free(wts.ses); }
+
+void register_session(void)
+{
+	char *path;
+
+	xasprintf(&path, "%s/sessions", state_dir());
+	wts.ses = sesreg_claim(path);
+	free(path);
+	if (!wts.ses) return;
+
+	sesreg_begin(wts.ses);
+	if (termid) sesreg_setstr(wts.ses, termid, termid, strlen(termid));
+	sesreg_end(wts.ses);
+	atexit(sesexit);
+
+	/* Publish the title of a restored screen, which has not changed. */
+	wts.sesttlgen = wts.dgen - 1;
+}
+
+void publish_session(Dtachctx dc)
+{
+	struct sesent *e = wts.ses;
+	time_t now = time(0);
+	int td;
+
+	if (!e) return;
+
+	sesreg_begin(e);
+	put_atch_clis(dc, e);
+	if (e->outbytes != outseq) {
+		e->outbytes = outseq;
+		e->lastact = now;
+	}
+
+	/* Finding the title on the screen takes some work, so it is done at
+	   most once a second, only if the screen changed, and only if the
+	   engine is caught up. A change within the second is published when
+	   the master wakes for it; see duewait. */
+	if (wts.clnttl) {
+		sesreg_setstr(e, title, wts.ttl, ttl_len());
+	}
+	else if (sesttlstale() && wts.sesttltm != now) {
+		wts.sesttltm = now;
+		wts.sesttlgen = wts.dgen;
+		td = linetitldeq();
+		sesreg_setstr(e, title, deqtostring(td, 0), deqbytsiz(td));
+		tmfree(td);
+	}
+	sesreg_end(e);
+}
+
 /* Array with elements:
 	0: print_atch_clis() array
 	1: termid string
@@ -687,106 +1640,289 @@ static void atchstatejson(Dtachctx dc, struct wrides *cliutd)
 	fdb_finsh(&hbuf);
 }
 
-static void fwdlinetobuf(int fd, struct fdbuf *ob)
+static void atchsesnlis(struct wrides *de)
 {
-	int rdn;
-	char buf[512];
+	struct fdbuf rb = {0};
+	char *path;
+
+	xasprintf(&path, "%s/sessions", state_dir());
+	sesreg_json(path, &rb);
+	free(path);
+
+	resp_dynamc(de, 'j', 200, rb.bf, rb.len);
+	fdb_finsh(&rb);
+}
+
+/* Seconds between checks of the session registry, and how many checks with
+   nothing to send before sending a comment, to find out if the client left. */
+#define ATCHEVSECS	1
+#define ATCHEVKEEP	15
+
+/* Streams changes to the session list as server-sent events (see
+   sesreg_events) until the client disconnects. */
+static void atchevents(struct wrides *de)
+{
+	struct sesevst *st = calloc(1, sizeof *st);
+	struct fdbuf b = {0};
+	struct timeval tv;
+	fd_set rfds;
+	char *path, c;
+	int idle = 0, ready;
+
+	xasprintf(&path, "%s/sessions", state_dir());
+	resp_chunkd(de, 'e', 200);
 
 	for (;;) {
-		rdn = read(fd, buf, sizeof(buf));
+		b.len = 0;
+		sesreg_events(path, st, &b);
+		if (!b.len && ++idle >= ATCHEVKEEP) fdb_apnd(&b, ":\n\n", -1);
+		if (b.len) {
+			idle = 0;
+			resp_chunk(de, b.bf, b.len);
+		}
 
-		if (rdn < 0) {
-			if (errno == EINTR) continue;
-			perror("read line from socket");
+		/* The client sends nothing more, so the socket becoming
+		   readable means it was closed. */
+		FD_ZERO(&rfds);
+		FD_SET(0, &rfds);
+		tv.tv_sec = ATCHEVSECS;
+		tv.tv_usec = 0;
+		ready = select(1, &rfds, 0, 0, &tv);
+		if (ready < 0 && errno != EINTR) { perror("select"); break; }
+		if (ready > 0 && read(0, &c, 1) <= 0) break;
+	}
+
+	free(b.bf);
+	free(path);
+	free(st);
+}
+
+/* Idle masters kept by the spawner when pool=N is in WERMFLAGS: N for each of
+   the POOLPROFS profiles with the most live sessions, or for the basic profile
+   if there are none. Each has its shell started and listens on a socket named
+   "pool%PROFILE%PID", but has no termid, logs or registry entry until a new
+   session of its profile claims it. The new session renames the socket to its
+   own and sends \\I with its termid. */
+#define POOLPROFS	3
+#define POOLMAX		8
+
+/* How many profiles are told apart when counting sessions, and how many
+   spawner loop iterations pass between checks of the pool. */
+#define POOLSEEN	64
+#define POOLIVL		5
+
+struct poolprof {
+	char name[128];
+	int live, idle;
+};
+
+struct poolcnt {
+	struct poolprof p[POOLSEEN];
+	int n;
+};
+
+static void poolcount(void *ctx, int i, const struct sesent *e)
+{
+	struct poolcnt *pc = ctx;
+	const char *dot;
+	int p, len;
+
+	if (!e->termidlen || e->termid[0] == '~') return;
+
+	dot = memchr(e->termid, '.', e->termidlen);
+	len = dot ? dot - e->termid : e->termidlen;
+	if (len >= sizeof pc->p->name) return;
+
+	for (p = 0; p < pc->n; p++)
+		if (!strncmp(pc->p[p].name, e->termid, len) &&
+		    !pc->p[p].name[len])
 			break;
-		}
 
-		fdb_apnd(ob, buf, rdn);
-		if (buf[rdn-1] == '\n') break;
+	if (p == pc->n) {
+		if (pc->n == POOLSEEN) return;
+		memcpy(pc->p[pc->n].name, e->termid, len);
+		pc->p[pc->n++].name[len] = 0;
 	}
+	pc->p[p].live++;
 }
 
-static void atchsesnlis(struct wrides *de)
+/* Leaves the profiles to pool at the start of pc and returns how many there
+   are. */
+static int poolpick(struct poolcnt *pc)
 {
-	DIR *skd;
-	struct dirent *sken;
-	char *spth = 0;
-	int sc, firs = 1;
-	struct fdbuf rb = {0};
+	struct poolprof t;
+	int i, j, n;
 
-	if (!(skd = opendir(socksdir()))) {
-		perror("opendir: socks");
-		puts("error opening socks directory");
-		exit(1);
+	if (!pc->n) {
+		pc->n = 1;
+		pc->p[0].name[0] = 0;
 	}
 
-	fdb_apnc(&rb, '[');
-	for (;;) {
-		errno = 0;
-		sken = readdir(skd);
-		if (!sken) {
-			if (errno) perror("readdir: socks");
-			break;
+	n = pc->n < POOLPROFS ? pc->n : POOLPROFS;
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < pc->n; j++) {
+			if (pc->p[j].live <= pc->p[i].live) continue;
+			t = pc->p[i];
+			pc->p[i] = pc->p[j];
+			pc->p[j] = t;
 		}
+	}
 
-		if (strncmp(sken->d_name, "prs%", 4) &&
-		    strncmp(sken->d_name, "eph%", 4))
-			continue;
-
-		xasprintf(&spth, "%s/%s", socksdir(), sken->d_name);
-		sc = connect_uds_as_client(spth);
-		free(spth);
-		if (sc < 0) continue;
+	return n;
+}
 
-		if (!firs) fdb_apnc(&rb, ',');
-		firs = 0;
+static void poolstart(const char *prof)
+{
+	Dtachctx dc;
+	pid_t pid;
 
-		full_write(&(struct wrides){sc}, "\\A", -1);
-		fwdlinetobuf(sc, &rb);
-		close(sc);
+	pid = fork();
+	if (pid < 0) { warn("fork for pool"); return; }
+	if (pid) {
+		while (0 > waitpid(pid, 0, 0) && errno == EINTR) {}
+		return;
 	}
 
-	fdb_apnc(&rb, ']');
-	resp_dynamc(de, 'j', 200, rb.bf, rb.len);
-	fdb_finsh(&rb);
+	free(termid);
+	termid = strdup(prof);
+	dc = prepfordtach();
+	free(dc->sockpath);
+	xasprintf(&dc->sockpath, "%s/pool%%%s%%%lld",
+		  socksdir(), prof, (long long) getpid());
+	dc->pooled = 1;
+
+	_exit(!!dtach_master(dc));
+}
+
+void pool_maint(void)
+{
+	static int inter;
+	static struct poolcnt pc;
+	DIR *skd;
+	struct dirent *sken;
+	char *path, *nm, *end;
+	int i, n, want, sc;
+
+	if (!pool || inter++ % POOLIVL) return;
+
+	want = atoi(pool);
+	if (want <= 0) return;
+	if (want > POOLMAX) want = POOLMAX;
+
+	memset(&pc, 0, sizeof pc);
+	xasprintf(&path, "%s/sessions", state_dir());
+	sesreg_each(path, &pc, poolcount);
+	free(path);
+	n = poolpick(&pc);
+
+	if (!(skd = opendir(socksdir()))) { warn("opendir: socks"); return; }
+	while ((sken = readdir(skd))) {
+		if (strncmp(sken->d_name, "pool%", 5)) continue;
+		nm = sken->d_name + 5;
+		if (!(end = strchr(nm, '%'))) continue;
+
+		/* Remove sockets of pooled masters that are gone. */
+		xasprintf(&path, "%s/%s", socksdir(), sken->d_name);
+		sc = connect_uds_as_client(path);
+		if (sc < 0 && errno == ECONNREFUSED) unlink(path);
+		free(path);
+		if (sc < 0) continue;
+		close(sc);
 
+		for (i = 0; i < n; i++)
+			if (!strncmp(pc.p[i].name, nm, end - nm) &&
+			    !pc.p[i].name[end - nm])
+				pc.p[i].idle++;
+	}
 	closedir(skd);
+
+	/* Start at most one master per profile each time, so the pool fills
+	   gradually rather than all at once. */
+	for (i = 0; i < n; i++)
+		if (pc.p[i].idle < want) poolstart(pc.p[i].name);
 }
 
-static const char *wermauthkeys(void)
+/* Whether a request for a new session only names the profile and how to
+   attach, so a pooled master, which has the spawner's settings, can serve it.
+   */
+static int poolable(const char *quer)
 {
-	static char *p;
+	static const char *const ok[] = {
+		"termid=", "resume=", "diff=", "hidden=", 0};
+	const char *const *o;
 
-	if (p) return p;
-	p = getenv("WERMAUTHKEYS");
-	if (p) return p=strdup(p);
-	xasprintf(&p, "%s/.ssh/werm_authorized_keys", getenv("HOME"));
-	return p;
+	for (; *quer; quer = strchrnul(quer, '&')) {
+		if (*quer == '&') quer++;
+		if (!*quer) break;
+
+		for (o = ok; *o; o++)
+			if (!strncmp(quer, *o, strlen(*o))) break;
+		if (!*o) return 0;
+	}
+
+	return 1;
 }
 
-static int inauthkeys(const char *pubkey)
+/* Gives the new session of dc an idle master of its profile from the pool, if
+   there is one, by renaming the master's socket to dc->sockpath. The master
+   learns its termid from the \\I escape sent ahead of the others. */
+static void claimpool(Dtachctx dc)
 {
-	FILE *akf = fopen(wermauthkeys(), "r");
-	char ln[PUBKEY_BYTESZ * 2 + 1];
-	int foun = 0, bi;
+	DIR *skd;
+	struct dirent *sken;
+	char *pref, *from, *esc;
+	int ok = 0;
 
-	if (!akf) { perror("open wermauthkeys file"); return 0; }
+	xasprintf(&pref, "pool%%%.*s%%",
+		  (int) strcspn(termid, "."), termid);
 
-	for (;;) {
-		if (!fgets(ln, sizeof(ln), akf)) goto cleanup;
+	if (!(skd = opendir(socksdir()))) { warn("opendir: socks"); goto out; }
+	while (!ok && (sken = readdir(skd))) {
+		if (strncmp(sken->d_name, pref, strlen(pref))) continue;
 
-		bi=0;
-		for (;;) {
-			if (ln[bi*2 + 0] != hexdig_lc(pubkey[bi] >> 4)) break;
-			if (ln[bi*2 + 1] != hexdig_lc(pubkey[bi] >> 0)) break;
+		xasprintf(&from, "%s/%s", socksdir(), sken->d_name);
+		ok = !rename(from, dc->sockpath);
+		free(from);
+	}
+	closedir(skd);
 
-			if (++bi == PUBKEY_BYTESZ) { foun = 1; goto cleanup; }
-		}
+	if (!ok) goto out;
+
+	xasprintf(&esc, "\\I%s\n%s",
+		  termid, dc->atchesc ? dc->atchesc : "\\N");
+	free(dc->atchesc);
+	dc->atchesc = esc;
+
+out:
+	free(pref);
+}
+
+/* Makes a pooled master (see pool_maint) the master of the termid in
+   wts.claimreq, which must be of the profile the master was started for. */
+static void claim4ses(Dtachctx dc)
+{
+	const char *tid = wts.claimreq;
+	size_t pl;
+
+	pl = termid ? strlen(termid) : 0;
+	if (	!dc->pooled
+	||	strncmp(tid, termid, pl) || tid[pl] != '.'
+	||	strpbrk(tid, ILLEGALTERMIDCHARS)
+	) {
+		warnx("cannot claim session as %s", tid);
+		return;
 	}
 
-cleanup:
-	fclose(akf);
-	return foun;
+	free(termid);
+	termid = strdup(tid);
+	free(dc->sockpath);
+	xasprintf(&dc->sockpath, "%s/prs%%%s", socksdir(), termid);
+	dc->pooled = 0;
+
+	set_argv0(dc, 'm');
+	open_logs(dc);
+	restore_screen(dc);
+	register_session();
 }
 
 static void writetosubproccore(
@@ -837,8 +1973,11 @@ static void writetosubproccore(
 				break;
 
 			case 'w':
+			case 'b':
+			case 'R':
 			case 't':
 			case 'i':
+			case 'I':
 				wts.altbufsz = 0;
 				wts.escp = byte;
 				break;
@@ -852,16 +1991,17 @@ static void writetosubproccore(
 			   output, and to alert master that it's OK to read
 			   from subproc since there is a client ready to read
 			   the output. */
-			case 'N':
-				cls->wantsoutput=1;
-				if (wts.ttl[0])		recounttitl(clioutde);
-				if (wts.allowtmstate)	tmstate4cli(clioutde);
-				else			simpdump4cl(clioutde);
-				profinfo4cli(clioutde);
-				break;
+			case 'N': atch4cli(clioutde, cls);		break;
 
 			case 'A': atchstatejson(dc, clioutde);		break;
 
+			/* The client is hidden or shown. */
+			case 'P': cls->paused = 1;			break;
+			case 'p': unpause4cli(clioutde, cls);		break;
+
+			/* Send diffs from now on, starting with every row. */
+			case 'D': cls->diff = 1; cls->dgen = 0;		break;
+
 			/* directions, home, end */
 			case '^': cursmvbyte = 'A';			break;
 			case 'v': cursmvbyte = 'B';			break;
@@ -878,6 +2018,7 @@ static void writetosubproccore(
 			}
 
 			if (!cursmvbyte) break;
+			tmsync();
 			fdb_apnc(&kbdb, 033);
 			/* application cursor mode does O rather than [ */
 			fdb_apnc(&kbdb,	wts.t &&
@@ -899,6 +2040,24 @@ static void writetosubproccore(
 
 			break;
 
+		case 'b':
+			wts.sbpgreq[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.sbpgreq)) break;
+
+			wts.escp = 0;
+			sbpage4cli(clioutde);
+
+			break;
+
+		case 'R':
+			wts.resumereq[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.resumereq)) break;
+
+			wts.escp = 0;
+			resume4cli(clioutde, cls);
+
+			break;
+
 		case 't':
 			if (byte == '\n') {
 				wts.escp = 0;
@@ -910,6 +2069,17 @@ static void writetosubproccore(
 
 			break;
 
+		case 'I':
+			if (byte == '\n') {
+				wts.claimreq[wts.altbufsz] = 0;
+				wts.escp = 0;
+				claim4ses(dc);
+			}
+			else if (wts.altbufsz < sizeof wts.claimreq - 1)
+				wts.claimreq[wts.altbufsz++] = byte;
+
+			break;
+
 		case 'i':
 			if (wts.altbufsz >= sizeof cls->endpnt) abort();
 
@@ -924,18 +2094,51 @@ static void writetosubproccore(
 
 	fdb_finsh(&kbdb);
 
-	if (wts.t && wts.sendsigwin) tresize(wts.t, wts.swcol, wts.swrow);
+	if (!wts.t || !wts.sendsigwin) return;
+
+	tmsync();
+	tresize(wts.t, wts.swcol, wts.swrow);
+	tfulldirt(wts.t);
+	diffharvest();
+	if (wts.rec.ckpfd)
+		rec_size(&wts.rec, &wts.rawlgsk, wts.swcol, wts.swrow);
 }
 
 void process_kbd(int clioutfd, Dtachctx dc, struct clistate *cls,
 		 unsigned char *buf, size_t bufsz)
 {
-	struct wrides ptyde = { dc->the_pty.fd }, clide = { clioutfd };
+	struct fdbuf rpl = {0};
+	struct wrides ptyde = { dc->the_pty.fd }, clide = { .to = &rpl };
 
 	struct winsize ws = {0};
+	unsigned long long seq = cls->outseq, nowseq;
+	int owed = cls->wantsoutput && !cls->paused && !cls->diff;
+	const void *pend;
+	size_t pendsz;
 
 	writetosubproccore(&ptyde, &clide, dc, cls, buf, bufsz);
 
+	/* Replies must not land in the middle of output the client is still
+	   being sent, so they are put after the output it was owed, unless
+	   they moved it elsewhere, and whatever else is waiting to be sent. */
+	if (rpl.len) {
+		nowseq = cls->outseq;
+		cls->outseq = seq;
+		while (owed && (pend = outpending(clioutfd, cls, &pendsz))) {
+			fdb_apnd(&cls->tail, pend, pendsz);
+			cls->outseq += pendsz;
+		}
+		if (nowseq != seq) cls->outseq = nowseq;
+
+		fdb_apnd(&cls->tail, rpl.bf, rpl.len);
+		tail4cli(clioutfd, cls);
+	}
+	fdb_finsh(&rpl);
+
+	/* Input from a client is a chance to write a pending screen image. */
+	if (wts.sendsigwin) wts.scrimgdirty = 1;
+	scrimgput();
+
 	if (!wts.sendsigwin) return;
 
 	ws.ws_row = wts.swrow;
@@ -944,6 +2147,212 @@ void process_kbd(int clioutfd, Dtachctx dc, struct clistate *cls,
 		warn("setting window size");
 }
 
+/* Chars a JS file name in an aux.js query may have for its response to be
+   cached. The script reads names and dirs with read, so other chars may not
+   name the files the key is made of. */
+#define CGICACHENAME \
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.-"
+
+/* Appends to key each file aux.js would read for query, as the script finds
+   them, and the inode, size and modification time of those that exist.
+   Returns 0 if the response cannot be cached, because the script would run an
+   executable file or the names cannot be found the same way. */
+static int auxjskey(struct fdbuf *key, const char *query)
+{
+	const char *jsp = getenv("WERMJSPATH"), *nm, *nmend, *dir, *dirend;
+	char *defp = 0, *full;
+	struct stat sb;
+	int ok = 1;
+
+	if (!jsp || !*jsp) {
+		xasprintf(&defp, "%s/js:%s/.config/werm/js",
+			  getenv("WERMSRCDIR"), getenv("HOME"));
+		jsp = defp;
+	}
+
+	for (nm = query; ok; nm = nmend + 1) {
+		nmend = strchrnul(nm, ',');
+		if (strspn(nm, CGICACHENAME) != nmend - nm) ok = 0;
+
+		for (dir = jsp; ok; dir = dirend + 1) {
+			dirend = strchrnul(dir, ':');
+			if (memchr(dir, '\\', dirend - dir) ||
+			    (dirend > dir && (isspace(*dir) || isspace(dirend[-1]))))
+				ok = 0;
+
+			xasprintf(&full, "%.*s/%.*s.js", (int) (dirend - dir),
+				  dir, (int) (nmend - nm), nm);
+			fdb_apnd(key, full, -1);
+
+			if (stat(full, &sb)) {
+				fdb_apnd(key, " -\n", -1);
+			}
+			else if (!S_ISREG(sb.st_mode) || !access(full, X_OK)) {
+				ok = 0;
+			}
+			else {
+				fdb_apnc(key, ' ');
+				fdb_itoa(key, sb.st_ino);
+				fdb_apnc(key, ' ');
+				fdb_itoa(key, sb.st_size);
+				fdb_apnc(key, ' ');
+				fdb_itoa(key, sb.st_mtim.tv_sec);
+				fdb_apnc(key, '.');
+				fdb_itoa(key, sb.st_mtim.tv_nsec);
+				fdb_apnc(key, '\n');
+			}
+			free(full);
+
+			if (!*dirend) break;
+		}
+
+		if (!*nmend) break;
+	}
+
+	free(defp);
+	return ok;
+}
+
+/* Returns the path of the file in cachedir for the response to rq, with the
+   key of its content in key, or null if it cannot be cached. A cache file holds
+   the key, a null char, and the response. It is named for the request alone,
+   so it is replaced when the files change. */
+static char *cgicachefn(const char *cachedir, Httpreq *rq, struct fdbuf *key)
+{
+	char *fn;
+	const char *c;
+	uint64_t h = 14695981039346656037ULL;
+
+	if (!cachedir || strcmp(rq->resource, "/aux.js")) return 0;
+
+	fdb_apnd(key, rq->resource, -1);
+	fdb_apnc(key, '?');
+	fdb_apnd(key, rq->query, -1);
+	fdb_apnc(key, '\n');
+	for (c = (char *)key->bf; c != (char *)key->bf + key->len; c++)
+		h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+
+	if (!auxjskey(key, rq->query)) return 0;
+
+	if (mkdir(cachedir, 0700) && errno != EEXIST) {
+		perror("mkdir for cgi cache");
+		return 0;
+	}
+	xasprintf(&fn, "%s/%016llx", cachedir, (unsigned long long) h);
+	return fn;
+}
+
+/* Sends the cached response in fn if its key matches key. */
+static int cgicached(struct wrides *de, char hdr, const char *fn,
+		     const struct fdbuf *key)
+{
+	unsigned char inb[4096];
+	ssize_t redn;
+	int fd, hit = 0;
+
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	redn = read(fd, inb, sizeof(inb));
+	if (redn <= key->len || memcmp(inb, key->bf, key->len) ||
+	    inb[key->len])
+		goto cleanup;
+
+	hit = 1;
+	resp_chunkd(de, hdr, 200);
+	resp_chunk(de, inb + key->len + 1, redn - key->len - 1);
+	while (0 < (redn = read(fd, inb, sizeof(inb))))
+		resp_chunk(de, inb, redn);
+	if (redn < 0) perror("read cgi cache");
+	resp_chunk(de, 0, 0);
+
+cleanup:
+	close(fd);
+	return hit;
+}
+
+/* Runs the external CGI script for rq and streams its output. The aux.js
+   response is kept in cachedir, which is not used if null. */
+static void cgiresp(struct wrides *de, char hdr, Httpreq *rq,
+		    const char *cachedir)
+{
+	char *binp, *fn, *tmpfn = 0;
+	struct fdbuf key = {0}, nowkey = {0};
+	struct wrides cachede = {-1};
+	struct stat sb;
+	int p[2], wstat, ok = 1;
+	pid_t cpid;
+	ssize_t redn;
+	off_t cachesz = 0;
+	unsigned char inb[4096];
+
+	fn = cgicachefn(cachedir, rq, &key);
+	if (fn && cgicached(de, hdr, fn, &key)) goto cleanup;
+
+	if (fn) {
+		xasprintf(&tmpfn, "%s.%lld", fn, (long long) getpid());
+		cachede.fd = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				  0600);
+		if (cachede.fd < 0) perror("open for cgi cache");
+		fdb_apnc(&key, 0);
+	}
+	if (cachede.fd >= 0) {
+		full_write(&cachede, key.bf, key.len);
+		cachesz = key.len;
+	}
+
+	if (0>pipe(p))			{ perror("pipe cgi"	); exit(1); }
+	if (0>(cpid=fork()))		{ perror("fork cgi"	); exit(1); }
+	if (!cpid && 0>dup2(p[1], 1))	{ perror("dup p1"	); exit(1); }
+	if (0>close(p[1]))		{ perror("close p1"	); exit(1); }
+
+	if (!cpid) {
+		close(p[0]);
+
+		xasprintf(&binp, "%s/cgi%s",
+			  getenv("WERMSRCDIR"), rq->resource);
+		setenv("QUERY_STRING", rq->query, 1);
+		execl(binp, binp, NULL);
+		perror("execl for external cgi");
+		exit(1);
+	}
+
+	resp_chunkd(de, hdr, 200);
+	for (;;) {
+		redn = read(p[0], inb, sizeof(inb));
+		if (!redn)	break;
+		if (0<redn) {
+			resp_chunk(de, inb, redn);
+			if (cachede.fd >= 0) full_write(&cachede, inb, redn);
+			cachesz += redn;
+		}
+		if (0>redn && errno != EINTR)	{ perror("read"); ok = 0; break; }
+	}
+	resp_chunk(de, 0, 0);
+	close(p[0]);
+
+	if (0>waitpid(cpid, &wstat, 0))	{ perror("waitpid"); ok = 0; }
+	if (cachede.fd < 0) goto cleanup;
+
+	/* Keep only the whole output of a script that succeeded and read no
+	   file that changed while it ran. */
+	ok = ok && WIFEXITED(wstat) && !WEXITSTATUS(wstat);
+	ok = ok && !fstat(cachede.fd, &sb) && sb.st_size == cachesz;
+	if (0>close(cachede.fd)) { perror("close cgi cache"); ok = 0; }
+
+	free(cgicachefn(cachedir, rq, &nowkey));
+	fdb_apnc(&nowkey, 0);
+	ok = ok && nowkey.len == key.len && !memcmp(nowkey.bf, key.bf, key.len);
+
+	if (!ok || rename(tmpfn, fn)) unlink(tmpfn);
+
+cleanup:
+	free(fn);
+	free(tmpfn);
+	fdb_finsh(&key);
+	fdb_finsh(&nowkey);
+}
+
 static void putrwout(void)
 {
 	struct wrides de = {1, "putrwout"};
@@ -975,6 +2384,7 @@ static struct clistate *testclistate(char op)
 		if (!s) abort();
 	break;
 	case 'r':
+		if (s) fdb_finsh(&s->tail);
 		free(s);
 		s = calloc(1, sizeof(*s));
 	break;
@@ -995,13 +2405,21 @@ static struct clistate *testclistate(char op)
 static void testreset(void)
 {
 	term_fre(wts.t);
+	free(wts.outring);
+	free(wts.rowgen);
+	free(wts.lazyb.bf);
 	memset(&wts, 0, sizeof(wts));
 
 	therout.len = 0;
+	outseq = 0;
 
 	free(termid);	termid = 0;
 	free(logview);	logview = 0;
 	free(sblvl);	sblvl = 0;
+	free(sbmem);	sbmem = 0;
+	free(resume);	resume = 0;
+	free(diff);	diff = 0;
+	free(pool);	pool = 0;
 
 	profpathsavd = "";
 	testclistate('r');
@@ -1033,10 +2451,159 @@ static void testqrystring(void)
 	processquerystr("logview=test&huhtest=987");
 	printf("logview=%s\n", logview);
 
-	tstdesc("empty arg, escapes, and omitted arg");
-	testreset();
-	processquerystr("sblvl=&termid=%21escapes%7eand%45");
-	printf("%zu,%s,%d\n", strlen(sblvl), termid, !logview);
+	tstdesc("empty arg, escapes, and omitted arg");
+	testreset();
+	processquerystr("sblvl=&termid=%21escapes%7eand%45");
+	printf("%zu,%s,%d\n", strlen(sblvl), termid, !logview);
+}
+
+static void tstprofwrite(const char *fn, const char *s)
+{
+	FILE *f = fopen(fn, "w");
+
+	if (!f || 0 > fputs(s, f) || fclose(f)) err(1, "write %s", fn);
+}
+
+static void tstprofpream(void)
+{
+	struct wrides sigde = {1, "profsig"};
+	struct fdbuf sigb = {&sigde};
+
+	iterprofs("p:q", &((struct iterprofspec) {
+		&sigb,
+		.sendpream = 1,
+	}));
+	fdb_finsh(&sigb);
+}
+
+static void testprofidx(void)
+{
+	char dir[] = "/tmp/werm.profidx.XXXXXX", c;
+	struct profidx *ix;
+	int cwd, pip[2];
+	pid_t chld;
+
+	tstdesc("profile index is kept until a profile changes");
+	testreset();
+
+	/* Work in the directory so the dirs logged do not show its name. */
+	cwd = open(".", O_RDONLY | O_DIRECTORY);
+	if (cwd < 0 || !mkdtemp(dir) || chdir(dir)) err(1, "mkdtemp");
+	if (mkdir("p", 0700)) err(1, "mkdir");
+	tstprofwrite("p/grp", "a\tone\n");
+
+	profpathsavd = "p:q";
+	prof_maint();
+	ix = profidx;
+	termid = strdup("a");
+	tstprofpream();
+	prof_maint();
+	printf("kept: %d\n", ix == profidx);
+
+	tstprofwrite("p/grp", "a\ttwo\n");
+	tstprofpream();
+
+	tstdesc("forked child uses profile index until spawner rereads it");
+	fflush(stdout);
+	if (pipe(pip)) err(1, "pipe");
+	if (!(chld = fork())) {
+		tstprofpream();
+		if (1 != read(pip[0], &c, 1)) _exit(1);
+		tstprofpream();
+		tstprofpream();
+		_exit(0);
+	}
+	close(pip[0]);
+	usleep(100000);
+	tstprofwrite("p/grp", "a\tthree\n");
+	prof_maint();
+	write(pip[1], "", 1);
+	close(pip[1]);
+	waitpid(chld, 0, 0);
+
+	tstdesc("profile dir created after profile index was read");
+	if (mkdir("q", 0700)) err(1, "mkdir");
+	tstprofwrite("q/grp2", "a\tfour\n");
+	tstprofpream();
+
+	close(profinfd);
+	munmap(profgen, sizeof(*profgen));
+	profinfd = -1;
+	profgen = 0;
+	profowner = 0;
+	profidxfree(profidx);
+	profidx = 0;
+
+	unlink("p/grp");
+	unlink("q/grp2");
+	rmdir("p");
+	rmdir("q");
+	if (fchdir(cwd)) err(1, "fchdir");
+	close(cwd);
+	rmdir(dir);
+}
+
+static void tstcgi(const char *query)
+{
+	Httpreq rq = {"/aux.js", (char *)query};
+
+	cgiresp(&(struct wrides){1, "cgi"}, 'j', &rq, "cache");
+	putchar('\n');
+}
+
+static void testcgicache(void)
+{
+	char dir[] = "/tmp/werm.cgicache.XXXXXX";
+	struct timespec mtim[2];
+	struct stat sb;
+	struct dirent *ent;
+	DIR *cached;
+	int cwd;
+
+	cwd = open(".", O_RDONLY | O_DIRECTORY);
+	if (cwd < 0 || !mkdtemp(dir) || chdir(dir)) err(1, "mkdtemp");
+	if (mkdir("js", 0700)) err(1, "mkdir");
+	setenv("WERMJSPATH", "js", 1);
+
+	tstdesc("aux.js response is streamed and cached");
+	tstprofwrite("js/a.js", "one\n");
+	tstcgi("a,b");
+
+	tstdesc("cached aux.js is sent while its files are unchanged");
+	if (stat("js/a.js", &sb)) err(1, "stat");
+	mtim[0] = sb.st_atim;
+	mtim[1] = sb.st_mtim;
+	tstprofwrite("js/a.js", "two\n");
+	if (utimensat(AT_FDCWD, "js/a.js", mtim, 0)) err(1, "utimensat");
+	tstcgi("a,b");
+
+	tstdesc("cached aux.js is not sent once a file changes");
+	if (utimensat(AT_FDCWD, "js/a.js", 0, 0)) err(1, "utimensat");
+	tstcgi("a,b");
+	tstcgi("a,b");
+
+	tstdesc("aux.js which runs a script is not cached");
+	unlink("js/a.js");
+	tstprofwrite("js/b.js", "#!/bin/sh\necho ran\n");
+	chmod("js/b.js", 0700);
+	tstcgi("a,b");
+	tstprofwrite("js/b.js", "#!/bin/sh\necho new\n");
+	tstcgi("a,b");
+
+	unsetenv("WERMJSPATH");
+	unlink("js/a.js");
+	unlink("js/b.js");
+	rmdir("js");
+	if ((cached = opendir("cache"))) {
+		while ((ent = readdir(cached)))
+			if (*ent->d_name != '.') unlinkat(dirfd(cached),
+							  ent->d_name, 0);
+		closedir(cached);
+	}
+	rmdir("cache");
+	if (fchdir(cwd)) err(1, "fchdir");
+	close(cwd);
+	rmdir(dir);
 }
 
 static void testiterprofs(void)
@@ -1225,9 +2792,515 @@ static void testiterprofs(void)
 
 static void writelgon(void)
 {
-	wts.logde.fd = 1;
+	wts.lgsk.de.fd = 1;
 	wts.writelg = 1;
-	wts.logde.escannot = "sblog";
+	wts.lgsk.de.escannot = "sblog";
+}
+
+static void tstscreen(struct fdbuf *b)
+{
+	int y, td = deqmk();
+
+	b->len = 0;
+	for (y = 0; wts.t && y < term(wts.t,row); y++) {
+		td = tpushlinestr(wts.t, td, y);
+		fdb_apnd(b, deqtostring(td, 0), deqbytsiz(td));
+		fdb_apnc(b, '|');
+		deqclear(td);
+	}
+	fdb_apnc(b, 0);
+	tmfree(td);
+}
+
+/* Records output and a resize in a timed raw log with a checkpoint in the
+   middle, then replays it with and without the checkpoint. */
+static void testreplay(void)
+{
+	char dir[] = "/tmp/werm.replay.XXXXXX", *fn, *ckfn;
+	struct replay rp = {0};
+	struct fdbuf live = {0}, scr = {0};
+	struct stat sb;
+	int tries;
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	xasprintf(&fn, "%s/tst.rec", dir);
+	xasprintf(&ckfn, "%s/tst.rec.ckp", dir);
+
+	wts.writerawlg = 1;
+	wts.rawlgsk.de.fd = open(fn, O_RDWR | O_CREAT | O_APPEND, 0600);
+	rec_open(&wts.rec, &wts.rawlgsk,
+		 open(ckfn, O_WRONLY | O_CREAT | O_APPEND, 0600));
+
+	process_tty_out("one\r\ntwo\r\n", -1);
+	writetosp0term("\\w00050020");
+
+	/* Make a checkpoint due without writing a megabyte. */
+	wts.rec.ckpoff = wts.rec.off - RECCKPBYTES;
+	process_tty_out("three\r\n", -1);
+	for (tries = 0; tries < 500; tries++) {
+		if (!stat(ckfn, &sb) && sb.st_size) break;
+		usleep(10000);
+	}
+
+	process_tty_out("four\r\nfive", -1);
+	tstscreen(&live);
+	printf("live: %s\n", live.bf);
+
+	replayseek(&rp, fn, -1ULL);
+	tstscreen(&scr);
+	printf("from checkpoint: ckp=%d records=%llu same=%d\n",
+	       !!rp.ck.magic[0], rp.nrec, !strcmp((char *)live.bf,
+						   (char *)scr.bf));
+	replayend(&rp);
+
+	unlink(ckfn);
+	replayseek(&rp, fn, -1ULL);
+	tstscreen(&scr);
+	printf("from start: ckp=%d records=%llu same=%d\n",
+	       !!rp.ck.magic[0], rp.nrec, !strcmp((char *)live.bf,
+						   (char *)scr.bf));
+	replayend(&rp);
+
+	/* The screen before anything was output */
+	replayseek(&rp, fn, 0);
+	printf("at 0: t=%d records=%llu\n", wts.t, rp.nrec);
+	replayend(&rp);
+
+	close(wts.rawlgsk.de.fd);
+	close(wts.rec.ckpfd);
+	fdb_finsh(&wts.rec.b);
+	fdb_finsh(&live);
+	fdb_finsh(&scr);
+	unlink(fn);
+	rmdir(dir);
+	free(fn);
+	free(ckfn);
+}
+
+/* Writes a screen image, loads it in place of the engine and checks the screen
+   is the same, then checks that damaged images are rejected. */
+static void testscrimg(void)
+{
+	char dir[] = "/tmp/werm.scrimg.XXXXXX", *fn = "tst.tmi";
+	struct fdbuf live = {0}, scr = {0};
+	struct tmimghdr h;
+	int fd, cx, cy, cwd, i;
+
+	cwd = open(".", O_RDONLY | O_DIRECTORY);
+	if (cwd < 0 || !mkdtemp(dir) || chdir(dir)) err(1, "mkdtemp");
+
+	process_tty_out("first\r\n\033[1;33msecond\033[m\r\nthi", -1);
+	tstscreen(&live);
+	cx = curs_x(term(wts.t,curs));
+	cy = curs_y(term(wts.t,curs));
+	printf("written: %d\n", tmimgwrite(fn, wts.t));
+
+	wts.t = tmimgload(fn);
+	tstscreen(&scr);
+	printf("loaded: t=%d same=%d cursor same=%d\n", !!wts.t,
+	       !strcmp((char *)live.bf, (char *)scr.bf),
+	       cx == curs_x(term(wts.t,curs)) &&
+	       cy == curs_y(term(wts.t,curs)));
+	process_tty_out("rd", -1);
+	tstscreen(&scr);
+	printf("after more output: %s\n", scr.bf);
+
+	fd = open(fn, O_RDWR);
+	if (fd < 0 || read(fd, &h, sizeof(h)) != sizeof(h)) err(1, "read %s", fn);
+
+	h.version++;
+	pwrite(fd, &h, sizeof(h), 0);
+	printf("other version: %d\n", tmimgload(fn));
+
+	h.version--;
+	pwrite(fd, &h, sizeof(h), 0);
+	ftruncate(fd, sizeof(h) + h.imgsz / 2);
+	printf("truncated: %d\n", tmimgload(fn));
+	close(fd);
+
+	unlink(fn);
+	printf("missing: %d\n", tmimgload(fn));
+
+	tstdesc("screen image changed too soon after the last is written later");
+	wts.scrimg = (char *)fn;
+	wts.scrimgpid = getpid();
+	wts.subpid = getpid();
+	wts.scrimgtm = time(0);
+	process_tty_out("more", -1);
+	printf("written now: %d, due later: %d\n", !access(fn, F_OK),
+	       duewait() > 0);
+	wts.scrimgtm -= SCRIMGSECS;
+	printf("due now: %d\n", !duewait());
+	duework();
+	for (i = 0; i < 100 && access(fn, F_OK); i++) usleep(10000);
+	printf("written when due: %d, due: %d\n", !access(fn, F_OK),
+	       duewait());
+
+	tstdesc("screen image changed too soon is written at exit");
+	unlink(fn);
+	process_tty_out("!", -1);
+	scrimgexit();
+	printf("written at exit: %d, due: %d\n", !!tmimgload(fn), duewait());
+	tstscreen(&scr);
+	printf("loaded: %s\n", scr.bf);
+
+	wts.scrimg = 0;
+	wts.scrimgpid = wts.subpid = 0;
+	unlink(fn);
+	if (fchdir(cwd)) err(1, "fchdir");
+	close(cwd);
+	rmdir(dir);
+	fdb_finsh(&live);
+	fdb_finsh(&scr);
+}
+
+static void tstsestitle(void)
+{
+	publish_session(testdc('g'));
+	printf("title: %.*s, due: %d\n", (int) wts.ses->titlelen,
+	       wts.ses->title, duewait() > 0 ? 1 : duewait());
+}
+
+/* Publishes the title as the screen changes faster than it is found. */
+static void testsestitle(void)
+{
+	char dir[] = "/tmp/werm.sestitle.XXXXXX", *fn;
+	time_t t;
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	xasprintf(&fn, "%s/sessions", dir);
+	if (!(wts.ses = sesreg_claim(fn))) errx(1, "sesreg_claim %s", fn);
+
+	/* Start at a second so the burst is within it. */
+	for (t = time(0); t == time(0);) usleep(1000);
+	process_tty_out("one", -1);
+	tstsestitle();
+	process_tty_out("\rtwo", -1);
+	tstsestitle();
+	tstsestitle();
+
+	tstdesc("title changed within a second is published after it");
+	wts.sesttltm--;
+	tstsestitle();
+
+	sesreg_free(wts.ses);
+	wts.ses = 0;
+	unlink(fn);
+	rmdir(dir);
+	free(fn);
+}
+
+/* Sends the client its pending output, showing it if show is set and its size
+   otherwise. */
+static void tstpending(struct clistate *cls, int show)
+{
+	const char *b;
+	size_t sz;
+
+	printf("client at %llu of %llu%s\n", cls->outseq, outseq,
+	       cls->paused ? ", paused" : "");
+	while (!cls->paused && (b = outpending(1, cls, &sz))) {
+		if (show)	printf("pending: %.*s", (int) sz, b);
+		else		printf("pending: %zu bytes\n", sz);
+		cls->outseq += sz;
+	}
+	fflush(stdout);
+	tail4cli(1, cls);
+}
+
+static void tstresume(unsigned long long ep, unsigned long long seq)
+{
+	char esc[64];
+
+	sprintf(esc, "\\R%016llx%016llx", ep, seq);
+	writetosp0term(esc);
+	tstpending(testclistate('g'), 1);
+}
+
+/* Attaches a client, then resumes it from various points in the output ring as
+   a reconnecting client would. */
+static void testresume(void)
+{
+	struct clistate *cls = testclistate('g');
+	char big[4096];
+	int i;
+
+	wts.outep = 7;
+	process_tty_out("abc", -1);
+	writetosp0term("\\N");
+	process_tty_out("def", -1);
+	tstpending(cls, 1);
+
+	tstdesc("resume from the middle of the ring");
+	tstresume(7, 2);
+
+	tstdesc("resume from another master");
+	tstresume(6, 2);
+
+	tstdesc("resume from past the end");
+	tstresume(7, 9);
+
+	tstdesc("resume from output that left the ring");
+	memset(big, 'x', sizeof(big));
+	big[sizeof(big) - 1] = 0;
+	for (i = 0; i < OUTRINGSZ / sizeof(big) + 1; i++)
+		process_tty_out(big, -1);
+	process_tty_out("end", -1);
+	tstresume(7, 2);
+
+	tstdesc("client behind by less than the ring is sent the rest");
+	cls->outseq = outseq - 8;
+	tstpending(cls, 1);
+
+	tstdesc("... and in two parts if it wraps around");
+	cls->outseq = outseq - OUTRINGSZ + 10;
+	tstpending(cls, 0);
+
+	tstdesc("client that fell out of the ring is sent the state");
+	cls->outseq = 3;
+	tstpending(cls, 1);
+	putchar('\n');
+}
+
+/* Pauses a client and shows it again after a little and a lot of output. */
+static void testpause(void)
+{
+	struct clistate *cls = testclistate('g');
+	char big[4096];
+	int i;
+
+	writetosp0term("\\N\\P");
+	process_tty_out("hidden", -1);
+	tstpending(cls, 1);
+	writetosp0term("\\p");
+	tstpending(cls, 1);
+
+	tstdesc("client shown after much output gets the state");
+	writetosp0term("\\P");
+	memset(big, 'x', sizeof(big));
+	big[sizeof(big) - 1] = 0;
+	for (i = 0; i < UNPAUSEBYTES / sizeof(big) + 1; i++)
+		process_tty_out(big, -1);
+	writetosp0term("\\p");
+	tstpending(cls, 1);
+
+	tstdesc("showing a client that is not paused does nothing");
+	writetosp0term("\\p");
+	tstpending(cls, 1);
+}
+
+/* Sends diffs to a client in diff mode as the screen changes. */
+static void testdiff(void)
+{
+	struct clistate *cls = testclistate('g');
+	char fill[4096] = {0};
+	int sv[2];
+
+	process_tty_out("\033[1mhello\033[m\r\nworld", -1);
+	writetosp0term("\\N\\D");
+	printf("due: %d\n", diffwait(cls));
+	diff4cli(1, cls);
+	printf("after diff: %d\n", diffwait(cls));
+
+	tstdesc("diff has only the changed row");
+	process_tty_out("!", -1);
+	printf("waiting: %d\n", diffwait(cls) > 0);
+	cls->dms = 0;
+	diff4cli(1, cls);
+
+	tstdesc("diff after resize has every row");
+	writetosp0term("\\w00040010");
+	cls->dms = 0;
+	diff4cli(1, cls);
+
+	tstdesc("diff the client's socket has no room for is dropped");
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) err(1, "socketpair");
+	if (fcntl(sv[0], F_SETFL, O_NONBLOCK)) err(1, "fcntl");
+	while (write(sv[0], fill, sizeof(fill)) > 0) {}
+	while (write(sv[0], fill, 1) > 0) {}
+	process_tty_out("!", -1);
+	cls->dms = 0;
+	diff4cli(sv[0], cls);
+	printf("kept: %u, every row next: %d, waiting: %d\n", cls->tail.len,
+	       !cls->dgen, diffwait(cls) > 0);
+	close(sv[0]);
+	close(sv[1]);
+	diff4cli(1, cls);
+
+	tstdesc("paused client in diff mode gets no diff");
+	process_tty_out("\r\n", -1);
+	writetosp0term("\\P");
+	printf("paused: %d\n", diffwait(cls));
+	writetosp0term("\\p");
+	printf("shown: %d\n", diffwait(cls) >= 0);
+}
+
+/* Replies to a client that is not reading are held behind the output it is
+   owed, without waiting for it. */
+static void testslowcli(void)
+{
+	struct clistate *cls = testclistate('g');
+	char fill[4096] = {0};
+	int sv[2];
+
+	writetosp0term("\\N");
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) err(1, "socketpair");
+	if (	fcntl(sv[0], F_SETFL, O_NONBLOCK)
+	||	fcntl(sv[1], F_SETFL, O_NONBLOCK)) err(1, "fcntl");
+	while (write(sv[0], fill, sizeof(fill)) > 0) {}
+	while (write(sv[0], fill, 1) > 0) {}
+
+	process_tty_out("owed", -1);
+	process_kbd(sv[0], testdc('g'), cls, (unsigned char *)"\\!", 2);
+	printf("client at %llu of %llu, held: %.*s", cls->outseq, outseq,
+	       (int) cls->tail.len, cls->tail.bf);
+
+	while (read(sv[1], fill, sizeof(fill)) > 0) {}
+	printf("sent once drained: %d\n", tail4cli(sv[0], cls));
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void testlazy(void)
+{
+	struct fdbuf scr = {0};
+	char *big;
+	unsigned tl;
+
+	tty_out_lazy(1);
+	process_tty_out("one\r\ntwo", -1);
+	tstscreen(&scr);
+	printf("buffered: %u, screen: %.20s\n", wts.lazyb.len, scr.bf);
+
+	tstdesc("attaching runs the engine over buffered output");
+	writetosp0term("\\N");
+	tstscreen(&scr);
+	printf("buffered: %u, screen: %.20s\n", wts.lazyb.len, scr.bf);
+
+	tstdesc("replies to queries in buffered output are dropped");
+	process_tty_out("\033[6n", -1);
+	tl = therout.len;
+	writetosp0term("\\A");
+	printf("buffered: %u, reply: %d\n", wts.lazyb.len, therout.len != tl);
+
+	tstdesc("buffer is flushed through the engine when full");
+	big = calloc(1, LAZYMAX / 2 + 1);
+	memset(big, 'x', LAZYMAX / 2);
+	process_tty_out(big, -1);
+	process_tty_out(big, -1);
+	printf("buffered KiB: %u\n", wts.lazyb.len / 1024);
+	process_tty_out(big, -1);
+	printf("buffered KiB: %u\n", wts.lazyb.len / 1024);
+
+	tstdesc("output is processed right away once a client is watching");
+	tty_out_lazy(0);
+	tl = therout.len;
+	process_tty_out("\033[6n", -1);
+	printf("buffered: %u, out: %.*s\n",
+	       wts.lazyb.len, (int)(therout.len - tl - 1), therout.bf + tl);
+
+	free(big);
+	free(scr.bf);
+}
+
+static void testpool(void)
+{
+	static struct poolcnt pc;
+	static const char *const tids[] = {
+		"a.1", "b.1", "b.2", "~spawner.x", "", ".3", "c.1",
+		"d.1", "d.2", "d.3", 0,
+	};
+	const char *const *t;
+	struct sesent e = {0};
+	int n, i;
+
+	for (t = tids; *t; t++) {
+		e.termidlen = sesreg_cpy(e.termid, sizeof e.termid,
+					 *t, strlen(*t));
+		poolcount(&pc, 0, &e);
+	}
+	n = poolpick(&pc);
+	for (i = 0; i < n; i++)
+		printf("pool '%s' live=%d\n", pc.p[i].name, pc.p[i].live);
+
+	tstdesc("basic profile is pooled when there are no sessions");
+	memset(&pc, 0, sizeof pc);
+	n = poolpick(&pc);
+	printf("n=%d '%s'\n", n, pc.p[0].name);
+
+	tstdesc("only requests naming just a profile use the pool");
+	printf("%d %d %d %d\n",
+	       poolable("termid=a"),
+	       poolable("termid=a&diff=1"),
+	       poolable("termid=a&sblvl=t"),
+	       poolable("logview=x&termid=a"));
+
+	tstdesc("pooled master is only claimed for its profile");
+	termid = strdup("b");
+	writetosp0term("\\Ia.1\n");
+	printf("not pooled: %s\n", termid);
+	testdc('g')->pooled = 1;
+	writetosp0term("\\Ia.1\n\\Ib\n\\Ib.1/x\n");
+	printf("other profile: %s\n", termid);
+}
+
+static void tstsbring(const char *wh)
+{
+	int r = term(wts.t,sbring), p, x, cf;
+
+	printf("%s: first=%d cnt=%d\n", wh, sbr_first(r), sbr_cnt(r));
+	if (!sbr_cnt(r)) return;
+
+	/* Newest line, decoded as the client does */
+	p = sbrat(r, sbr_first(r) + sbr_cnt(r) - 1);
+	sbrunpack(wts.t, r, p, term(wts.t,row));
+	fputs("newest: ", stdout);
+	for (x = 0; x < term(wts.t,col); x++) {
+		cf = term_cellf(wts.t, term(wts.t,row), x);
+		if (x && fld(term(wts.t,scr), cf+GLYPH_FG) !=
+			 fld(term(wts.t,scr), cf+GLYPH_FG-GLYPH_ELCNT))
+			putchar('|');
+		putchar(fld(term(wts.t,scr), cf+GLYPH_RUNE));
+	}
+	puts("$");
+}
+
+/* Scrolls lines with colors into a small scrollback ring and requests them
+   the way the client does. */
+static void testsbring(void)
+{
+	int i;
+	char ln[64];
+
+	sbmem = strdup("1");
+	process_tty_out("\033[31mred\033[0m plain \033[44m  \033[0m\r\n", -1);
+	for (i = 0; i < 24; i++) process_tty_out("\r\n", -1);
+	tstsbring("one pushed");
+	writetosp0term("\\b00000000000005");
+
+	for (i = 0; i < 40; i++) {
+		sprintf(ln, "line %d \033[1;32mbold %d\033[m\r\n", i, i);
+		process_tty_out(ln, -1);
+	}
+	tstsbring("oldest dropped");
+	writetosp0term("\\b00000000000002");
+	writetosp0term("\\b00000000390002");
+	writetosp0term("\\b00000000410002");
+
+	tstdesc("resizing to fewer rows pushes rows above the cursor");
+	writetosp0term("\\w00200080");
+	tstsbring("after resize");
+
+	tstdesc("alt screen is not pushed");
+	process_tty_out("\033[?1049h\033[25;1H\r\n\r\n", -1);
+	tstsbring("alt screen");
+	process_tty_out("\033[?1049l", -1);
+
+	tstdesc("stub ring only counts");
+	term(wts.t,sbring) = sbrstub(term(wts.t,sbring));
+	process_tty_out("\033[20;1H\r\n\r\n", -1);
+	tstsbring("stub");
+	writetosp0term("\\b00000000000002");
 }
 
 static void _Noreturn testmain(void)
@@ -1659,10 +3732,59 @@ static void _Noreturn testmain(void)
 	process_tty_out("a\tb\tc\033[2Zxyz\r\n", -1);
 	process_tty_out("a\tb\tc\033[3Zxyz\r\n", -1);
 
+	tstdesc("timed raw log replays to the same screen");
+	testreset();
+	testreplay();
+
+	tstdesc("scrollback ring keeps attributes and drops oldest lines");
+	testreset();
+	testsbring();
+
+	tstdesc("output ring resumes clients");
+	testreset();
+	testresume();
+
+	tstdesc("paused client is sent what it missed when shown");
+	testreset();
+	testpause();
+
+	tstdesc("diff mode sends the whole screen first");
+	testreset();
+	testdiff();
+
+	tstdesc("client that is not reading does not hold up the master");
+	testreset();
+	testslowcli();
+
+	tstdesc("lazy mode buffers output while no client is watching");
+	testreset();
+	testlazy();
+
+	tstdesc("pool is kept for the profiles with the most sessions");
+	testreset();
+	testpool();
+
+	tstdesc("screen image restores the same screen");
+	testreset();
+	testscrimg();
+
+	tstdesc("session registry gets the last title of a burst of output");
+	testreset();
+	testsestitle();
+
 	testiterprofs();
+	testprofidx();
+	testcgicache();
 	testqrystring();
 	test_outstreams();
 	test_http();
+	test_inbound();
+	test_logidx();
+	test_sbview();
+	test_rawrec();
+	test_sesreg();
+	test_authtab();
+	test_uniqid();
 
 	exit(0);
 }
@@ -1734,22 +3856,230 @@ static int maybeservefont(struct wrides *de, const char *resource)
 	return 1;
 }
 
-static _Noreturn void becomewebsocket(const char *quer)
+/* Clears the query args settings that do not get inherited from the spawner to
+   children. */
+static void resetwsargs(void)
 {
-	/* These query args settings do not get inherited from the spawner to
-	   children. */
 	free(dtachlog);
 	dtachlog = 0;
 	free(termid);
 	termid = 0;
+	free(resume);
+	resume = 0;
+	free(diff);
+	diff = 0;
+}
+
+static _Noreturn void becomewebsocket(const char *quer)
+{
+	Dtachctx dc;
+	int newses = 0;
 
+	resetwsargs();
 	processquerystr(quer);
 	if (termid) {
 		checktid();
-		if (!strchr(termid, '.')) appendunqid(1);
+		newses = !strchr(termid, '.');
+		if (newses) appendunqid(1);
+	}
+
+	dc = prepfordtach();
+	if (newses && poolable(quer)) claimpool(dc);
+	dtach_main(dc);
+}
+
+/* Channels of the multiplexed websocket at /mux, each attached to a master. A
+   SharedWorker in the browser holds the websocket for all tabs of an origin, and
+   each tab showing a session has a channel, so this one process does what an
+   attach process does for each of them. Every message in either direction is
+   one of these, where ID is the decimal channel number the worker chose:
+
+	oID:QUERY	open a channel like a websocket at /?QUERY, which may only
+			have termid, resume and diff
+	dID:DATA	data for the master, or output from it
+	cID:		close the channel, or the channel was closed
+	k0:		keepalive, which is echoed */
+#define MUXMAX 256
+
+static struct muxch {
+	unsigned id;
+	int fd;
+} muxchs[MUXMAX];
+static int nmuxch;
+
+static struct muxch *muxfind(unsigned id)
+{
+	int i;
+
+	for (i = 0; i < nmuxch; i++) if (muxchs[i].id == id) return muxchs + i;
+	return 0;
+}
+
+static void muxsend(char cmd, unsigned id)
+{
+	char m[16];
+
+	snprintf(m, sizeof(m), "%c%u:", cmd, id);
+	write_wbsoc_frame(m, -1);
+}
+
+static void muxclose(struct muxch *c)
+{
+	close(c->fd);
+	muxsend('c', c->id);
+	*c = muxchs[--nmuxch];
+}
+
+/* Starts a master for dc in a child that does not keep the other channels. */
+static void muxmaster(Dtachctx dc)
+{
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid < 0) { warn("fork for master"); return; }
+	if (pid) {
+		while (0 > waitpid(pid, 0, 0) && errno == EINTR) {}
+		return;
+	}
+
+	for (i = 0; i < nmuxch; i++) close(muxchs[i].fd);
+	_exit(!!dtach_master(dc));
+}
+
+static void muxopen(unsigned id, const char *quer)
+{
+	Dtachctx dc;
+	int s, newses;
+
+	if (muxfind(id) || nmuxch == MUXMAX) goto er;
+
+	resetwsargs();
+	processquerystr(quer);
+	if (!poolable(quer) || !termid || !*termid) goto er;
+	if (strpbrk(termid, ILLEGALTERMIDCHARS)) goto er;
+
+	/* The new termid is sent on this channel. */
+	wbsoc_channel(id);
+	newses = !strchr(termid, '.');
+	if (newses) appendunqid(1);
+	wbsoc_channel(-1);
+
+	dc = prepfordtach();
+	if (newses) claimpool(dc);
+
+	s = connect_uds_as_client(dc->sockpath);
+	if (s < 0 && (errno == ECONNREFUSED || errno == ENOENT)) {
+		if (errno == ECONNREFUSED) unlink(dc->sockpath);
+		muxmaster(dc);
+		s = connect_uds_as_client(dc->sockpath);
+	}
+	if (s >= 0) full_write(&(struct wrides){s},
+			       dc->atchesc ? dc->atchesc : "\\N", -1);
+
+	free(dc->sockpath);
+	free(dc->atchesc);
+	free(dc);
+	if (s < 0) { warn("attach %s for mux", termid); goto er; }
+
+	muxchs[nmuxch].id = id;
+	muxchs[nmuxch++].fd = s;
+	return;
+
+er:
+	muxsend('c', id);
+}
+
+static void muxmsg(unsigned char *m, size_t sz)
+{
+	unsigned char *colon = memchr(m, ':', sz < 12 ? sz : 12);
+	struct muxch *c;
+	unsigned long id;
+	char *quer, *end;
+
+	if (sz < 3 || !colon) goto bad;
+	id = strtoul((char *)m + 1, &end, 10);
+	if ((unsigned char *)end != colon || id > UINT_MAX) goto bad;
+
+	colon++;
+	sz -= colon - m;
+	c = muxfind(id);
+
+	switch (*m) {
+	default: goto bad;
+	case 'd':
+		if (c) full_write(&(struct wrides){c->fd}, colon, sz);
+		return;
+	case 'c':
+		if (c) muxclose(c);
+		return;
+	case 'k':
+		muxsend('k', 0);
+		return;
+	case 'o':
+		quer = strndup((char *)colon, sz);
+		muxopen(id, quer);
+		free(quer);
+		return;
 	}
 
-	dtach_main(prepfordtach());
+bad:
+	fprintf(stderr, "invalid mux message: %.*s\n", (int)(sz < 40 ? sz : 40),
+		(char *)m);
+}
+
+static _Noreturn void becomemux(void)
+{
+	unsigned char buf[BUFSIZE];
+	fd_set rfds;
+	ssize_t redn;
+	int i, hi, ready;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Channels are opened one at a time, so only the upgrade needed
+	   admitting. */
+	admit_done();
+
+	for (;;) {
+		FD_ZERO(&rfds);
+		FD_SET(0, &rfds);
+		hi = 0;
+		for (i = 0; i < nmuxch; i++) {
+			FD_SET(muxchs[i].fd, &rfds);
+			if (muxchs[i].fd > hi) hi = muxchs[i].fd;
+		}
+
+		ready = inbound_pending() ? 0 : select(hi + 1, &rfds, 0, 0, 0);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			err(1, "select for mux");
+		}
+
+		/* Read the masters before the client, which may close and
+		   reopen channels, so the fds that were ready are still the
+		   ones read. */
+		for (i = 0; ready > 0 && i < nmuxch; i++) {
+			if (!FD_ISSET(muxchs[i].fd, &rfds)) continue;
+
+			redn = read(muxchs[i].fd, buf, sizeof(buf));
+			if (redn < 0 && errno == EINTR) continue;
+			if (redn <= 0) {
+				/* The last channel moves to this spot, and has
+				   not been checked. */
+				FD_CLR(muxchs[i].fd, &rfds);
+				muxclose(muxchs + i--);
+				continue;
+			}
+
+			wbsoc_channel(muxchs[i].id);
+			write_wbsoc_frame(buf, redn);
+			wbsoc_channel(-1);
+		}
+
+		if ((ready <= 0 || FD_ISSET(0, &rfds)) && !inbound_msgs(muxmsg))
+			exit(0);
+	}
 }
 
 static void begnsesnlis(struct wrides *de)
@@ -1767,47 +4097,250 @@ static void begnsesnlis(struct wrides *de)
 
 static void externalcgi(struct wrides *de, char hdr, Httpreq *rq)
 {
-	char *binp;
-	struct fdbuf b = {0};
-	int p[2];
-	pid_t cpid;
-	ssize_t redn;
-	unsigned char inb[4096];
+	char *cachedir;
 
-	if (0>pipe(p))			{ perror("pipe cgi"	); exit(1); }
-	if (0>(cpid=fork()))		{ perror("fork cgi"	); exit(1); }
-	if (!cpid && 0>dup2(p[1], 1))	{ perror("dup p1"	); exit(1); }
-	if (0>close(p[1]))		{ perror("close p1"	); exit(1); }
+	xasprintf(&cachedir, "%s/cgicache", state_dir());
+	cgiresp(de, hdr, rq, cachedir);
+	free(cachedir);
+}
 
-	if (!cpid) {
-		close(p[0]);
+static void logsearchreq(struct wrides *out, Httpreq *rq)
+{
+	char *q = 0, *mx = 0, *c;
+	int max = 0;
+
+	qs = rq->query;
+	while (*qs) {
+		if (*qs == '&')				{ qs++;		continue; }
+		if (parsequeryarg("q=",		&q	))		continue;
+		if (parsequeryarg("max=",	&mx	))		continue;
+		qs = strchrnul(qs, '&');
+	}
 
-		xasprintf(&binp, "%s/cgi%s",
-			  getenv("WERMSRCDIR"), rq->resource);
-		setenv("QUERY_STRING", rq->query, 1);
-		execl(binp, binp, NULL);
-		perror("execl for external cgi");
+	if (mx) max = atoi(mx);
+	if (q) for (c = q; *c; c++) if (*c == '+') *c = ' ';
+
+	if (max <= 0) max = 200;
+
+	if (!q || !*q)	resp_dynamc(out, 't', 400, "missing q=\n", 11);
+	else		logsearch(out, q, max);
+
+	free(q);
+	free(mx);
+}
+
+static long long numarg(const char *v, long long dflt)
+{
+	return v && *v ? strtoll(v, 0, 10) : dflt;
+}
+
+static void sbpagereq(struct wrides *out, Httpreq *rq)
+{
+	char *tid = 0, *off = 0, *end = 0, *len = 0;
+
+	qs = rq->query;
+	while (*qs) {
+		if (*qs == '&')				{ qs++;		continue; }
+		if (parsequeryarg("termid=",	&tid	))		continue;
+		if (parsequeryarg("off=",	&off	))		continue;
+		if (parsequeryarg("end=",	&end	))		continue;
+		if (parsequeryarg("len=",	&len	))		continue;
+		qs = strchrnul(qs, '&');
+	}
+
+	if (!tid)	resp_dynamc(out, 't', 400, "missing termid=\n", 16);
+	else		sbview_page(out, tid, numarg(off, -1), numarg(end, -1),
+				    numarg(len, 0));
+
+	free(tid);
+	free(off);
+	free(end);
+	free(len);
+}
+
+static void sbfindreq(struct wrides *out, Httpreq *rq)
+{
+	char *tid = 0, *q = 0, *from = 0, *back = 0, *c;
+
+	qs = rq->query;
+	while (*qs) {
+		if (*qs == '&')				{ qs++;		continue; }
+		if (parsequeryarg("termid=",	&tid	))		continue;
+		if (parsequeryarg("q=",		&q	))		continue;
+		if (parsequeryarg("from=",	&from	))		continue;
+		if (parsequeryarg("back=",	&back	))		continue;
+		qs = strchrnul(qs, '&');
+	}
+
+	if (q) for (c = q; *c; c++) if (*c == '+') *c = ' ';
+
+	if (!tid || !q)	resp_dynamc(out, 't', 400, "missing termid= or q=\n", 22);
+	else		sbview_find(out, tid, q, numarg(from, 0),
+				    numarg(back, 0));
+
+	free(tid);
+	free(q);
+	free(from);
+	free(back);
+}
+
+/* ./run replay LOG [AT [SPEED]]
+   Prints the screen at time AT in a timed raw log, or at its end if AT is
+   omitted. If SPEED is given, the screen is drawn on the terminal and the output
+   after AT is played back at SPEED times real time. */
+static _Noreturn void replaytool(int argc, char **argv)
+{
+	struct replay rp = {0};
+	unsigned long long at, last;
+	double speed;
+	int y, td;
+	size_t pl = strlen(argv[0]);
+
+	at = argc > 1 ? rec_parsetime(argv[1], argv[0]) : -1ULL;
+	speed = argc > 2 ? strtod(argv[2], 0) : 0;
+
+	/* A screen image (see restore_screen) has no output to play back. */
+	if (pl > 4 && !strcmp(argv[0] + pl - 4, ".tmi")) {
+		if (!(wts.t = tmimgload(argv[0]))) exit(1);
+		speed = 0;
+	}
+	else if (!replayseek(&rp, argv[0], at)) {
 		exit(1);
 	}
+	else {
+		fprintf(stderr, "replay: %s checkpoint, %llu records after it\n",
+			rp.ck.magic[0] ? "from" : "no", rp.nrec);
+	}
 
-	for (;;) {
-		redn = read(p[0], inb, sizeof(inb));
-		if (!redn)	break;
-		if (0<redn)	fdb_apnd(&b, inb, redn);
-		if (0>redn && errno != EINTR)	{ perror("read"); goto er; }
+	if (speed > 0) fputs("\033[H\033[2J", stdout);
+	for (y = 0; wts.t && y < term(wts.t,row); y++) {
+		td = tpushlinestr(wts.t, deqmk(), y);
+		fwrite(deqtostring(td, 0), 1, deqbytsiz(td), stdout);
+		fputs(speed > 0 && y + 1 < term(wts.t,row) ? "\r\n" : "\n",
+		      stdout);
+		tmfree(td);
+	}
+	if (speed <= 0) exit(0);
+
+	if (wts.t) printf("\033[%d;%dH", curs_y(term(wts.t,curs)) + 1,
+					 curs_x(term(wts.t,curs)) + 1);
+
+	last = at ? at : rp.ev.ms;
+	for (; rp.ev.tag; recrd_next(rp.rd, &rp.ev)) {
+		if (rp.ev.ms > last) replaywait(rp.ev.ms - last, speed);
+		last = rp.ev.ms;
+		if (rp.ev.tag == 'o') fwrite(rp.ev.dat.bf, 1, rp.ev.dat.len,
+					     stdout);
 	}
 
-	resp_dynamc(de, hdr, 200, b.bf, b.len);
+	replayend(&rp);
+	exit(0);
+}
 
-	if (0>waitpid(cpid, 0, 0)) { perror("waitpid"); goto er; }
+/* Serves the screen image of a session (see restore_screen), which the client
+   can load with tmimgload. */
+static void screenreq(struct wrides *out, Httpreq *rq)
+{
+	char *tid = 0, *path = 0;
+	struct stat sb;
+	void *m = MAP_FAILED;
+	int fd = -1;
+
+	qs = rq->query;
+	while (*qs) {
+		if (*qs == '&')				{ qs++;		continue; }
+		if (parsequeryarg("termid=",	&tid	))		continue;
+		qs = strchrnul(qs, '&');
+	}
 
-	goto cleanup;
+	if (!tid || !*tid || strpbrk(tid, ILLEGALTERMIDCHARS)) {
+		resp_dynamc(out, 't', 400, "bad termid=\n", 12);
+		goto cleanup;
+	}
 
-er:
-	resp_dynamc(de, 't', 403, 0, 0);
+	xasprintf(&path, "%s/screens/%s.tmi", state_dir(), tid);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0 && !fstat(fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size)
+		m = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED) {
+		resp_dynamc(out, 't', 404, "no screen image\n", 16);
+		goto cleanup;
+	}
+
+	resp_dynamc(out, 'b', 200, m, sb.st_size);
+
+cleanup:
+	if (m != MAP_FAILED) munmap(m, sb.st_size);
+	if (fd >= 0) close(fd);
+	free(path);
+	free(tid);
+}
+
+/* Streams the state of a session at a time in its timed raw log as a \\@state
+   message, followed by the output after that time as an attached client would
+   get it, paced at speed times real time. Changes other than output are sent as
+   new states. */
+static void replayreq(struct wrides *out, Httpreq *rq)
+{
+	char *tid = 0, *at = 0, *speed = 0, *path = 0;
+	struct replay rp = {0};
+	struct fdbuf b = {0};
+	unsigned long long last = 0;
+	double spd;
+	int t;
+
+	qs = rq->query;
+	while (*qs) {
+		if (*qs == '&')				{ qs++;		continue; }
+		if (parsequeryarg("termid=",	&tid	))		continue;
+		if (parsequeryarg("at=",	&at	))		continue;
+		if (parsequeryarg("speed=",	&speed	))		continue;
+		qs = strchrnul(qs, '&');
+	}
+
+	if (!tid) {
+		resp_dynamc(out, 't', 400, "missing termid=\n", 16);
+		goto cleanup;
+	}
+	path = rec_find(state_dir(), tid);
+	if (path) last = rec_parsetime(at, path);
+	if (!path || !replayseek(&rp, path, last)) {
+		resp_dynamc(out, 't', 404, "no timed raw log\n", 17);
+		goto cleanup;
+	}
+
+	resp_chunkd(out, 't', 200);
+	if (wts.t) tmstatemsg(&b);
+	resp_chunk(out, b.bf, b.len);
+
+	spd = speed ? strtod(speed, 0) : 0;
+	if (!last) last = rp.ev.ms;
+	for (; spd > 0 && rp.ev.tag; recrd_next(rp.rd, &rp.ev)) {
+		if (rp.ev.ms > last) replaywait(rp.ev.ms - last, spd);
+		last = rp.ev.ms;
+
+		t = wts.t;
+		replayrec(&rp);
+
+		b.len = 0;
+		if (rp.ev.tag == 'o' && t == wts.t) {
+			fdb_routs(&b, (char *)rp.ev.dat.bf, rp.ev.dat.len);
+			fdb_apnc(&b, '\n');
+		}
+		else if (wts.t) {
+			tmstatemsg(&b);
+		}
+		resp_chunk(out, b.bf, b.len);
+	}
+	resp_chunk(out, 0, 0);
 
 cleanup:
+	replayend(&rp);
 	fdb_finsh(&b);
+	free(path);
+	free(tid);
+	free(at);
+	free(speed);
 }
 
 static void authnstatus(struct wrides *out, Httpreq *rq)
@@ -1891,6 +4424,7 @@ static void httpgethandlers(struct wrides *out, Httpreq *rq)
 	if (svbuf('c',rs,"/common.css",	common_css,COMMON_CSS_LEN, out)) return;
 	if (svbuf('c',rs,"/readme.css",	readme_css,README_CSS_LEN, out)) return;
 	if (svbuf('j',rs,"/st",		mainjs_etc,MAINJS_ETC_LEN, out)) return;
+	if (svbuf('j',rs,"/mux.js",	muxjs_etc,MUXJS_ETC_LEN, out)) return;
 
 	if (!strcmp(rs, "/readme"))	{ servereadme(out);		return;}
 	if (!strcmp(rs, "/share"))	{ servsharejs(out);		return;}
@@ -1898,10 +4432,17 @@ static void httpgethandlers(struct wrides *out, Httpreq *rq)
 	if (rq->pendauth)		{ resp_dynamc(out, 't', 401, 0, 0);
 									return;}
 	if (!strcmp(rs, "/aux.js"))	{ externalcgi(out, 'j', rq);	return;}
-	if (!strcmp(rs, "/scrollback"))	{ externalcgi(out, 'h', rq);	return;}
+	if (svbuf('h',rs,"/scrollback",	scrlb_html,SCRLB_HTML_LEN, out)) return;
+	if (!strcmp(rs, "/sbpage"))	{ sbpagereq(out, rq);		return;}
+	if (!strcmp(rs, "/sbfind"))	{ sbfindreq(out, rq);		return;}
 	if (!strcmp(rs, "/showenv"))	{ externalcgi(out, 't', rq);	return;}
 	if (!strcmp(rs, "/atchses"))	{ atchsesnlis(out);		return;}
+	if (!strcmp(rs, "/atchevents"))	{ atchevents(out);
+					  rq->keepaliv = 0;		return;}
 	if (!strcmp(rs, "/newsess"))	{ begnsesnlis(out);		return;}
+	if (!strcmp(rs, "/logsearch"))	{ logsearchreq(out, rq);	return;}
+	if (!strcmp(rs, "/replay"))	{ replayreq(out, rq);		return;}
+	if (!strcmp(rs, "/screen"))	{ screenreq(out, rq);		return;}
 
 	resp_dynamc(out, 't', 404, 0, 0);
 }
@@ -1910,11 +4451,14 @@ static int matchchaln(Httpreq *hr, const char *clid)
 {
 	#define CHALPROPNAME "\"challenge\":\""
 
+	static const unsigned char nochal[CHALLN_BYTESZ];
 	const char *pen, *prop = strstr(clid, CHALPROPNAME);
 	char *val;
 	unsigned clen;
 	int fon = 0;
 
+	/* A zeroed challenge means none could be kept for the session. */
+	if (!memcmp(hr->chal, nochal, CHALLN_BYTESZ)) return 0;
 	if (!prop) return 0;
 	prop += sizeof(CHALPROPNAME) - 1;
 
@@ -1948,7 +4492,7 @@ static void authentreq(struct wrides *out, Httpreq *hr)
 	es256_pk_t *fpkey = 0;
 	int foi = -1, fern;
 
-	while (*qc && qc - hr->query < sizeof(hr->query)) {
+	while (*qc) {
 		end = strchr(qc, '&');
 		if (!end) end = qc + strlen(qc);
 
@@ -1994,7 +4538,7 @@ static void authentreq(struct wrides *out, Httpreq *hr)
 		fdb_apnc(&erm, '\n');
 		goto badreq;
 	}
-	if (!inauthkeys(keyv.s)) {
+	if (!authkeys_has(authkeys_path(), keyv.s)) {
 		fdb_apnd(&erm, "this key is not authorized. to authorize,", -1);
 		fdb_apnd(&erm, " on the server run:\n", -1);
 		fdb_apnd(&erm, "  echo ", -1);
@@ -2002,7 +4546,7 @@ static void authentreq(struct wrides *out, Httpreq *hr)
 		fdb_hexs(&erm, keyv.s, PUBKEY_BYTESZ);
 
 		fdb_apnd(&erm, " >> ", -1);
-		fdb_apnd(&erm, wermauthkeys(), -1);
+		fdb_apnd(&erm, authkeys_path(), -1);
 		fdb_apnc(&erm, '\n');
 		goto badreq;
 	}
@@ -2079,11 +4623,20 @@ int http_serv(void)
 	struct fdbuf b = {0};
 	struct wrides out = {1};
 	Httpreq rq = {0};
-	const char *rs = rq.resource;
+	const char *rs;
 
-	http_read_req(stdin, &rq, &out);
+	/* Requests after this one on the connection may already be buffered,
+	   so it is kept for the next call. */
+	static struct httpconn conn = {0};
+
+	http_read_req(&conn, &rq, &out);
 	if (rq.error) return 0;
-	if (rq.validws) becomewebsocket(rq.query);
+	if (rq.validws) {
+		inbound_prime(conn.b + conn.off, conn.len - conn.off);
+		if (!strcmp(rq.resource, "/mux")) becomemux();
+		becomewebsocket(rq.query);
+	}
+	rs = rq.resource;
 
 	/* TODO(github.com/google/werm/issues/1) will it be more secure to also
 	   verify Origin/Host are consistent? */
@@ -2149,6 +4702,11 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 	if (1 == argc && !strcmp(*argv, "test"))	testmain();
+	if (1 == argc && !strcmp(*argv, "logindex"))	{ logindex_backfill();
+							  exit(0); }
+	if (2 <= argc && !strcmp(*argv, "replay"))	replaytool(argc-1, argv+1);
+	if (1 == argc && !strcmp(*argv, "bench"))	{ inbound_bench();
+							  exit(0); }
 
 	wts.allowtmstate = 1;
 
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/select.h>
 
 #include "dtachctx.h"
 #include "outstreams.h"
@@ -28,6 +29,24 @@ struct clistate {
 	/* Whether the client wants to receive terminal output and state
 	   updates. */
 	unsigned wantsoutput : 1;
+
+	/* Whether the client is hidden and has asked to be sent no output
+	   until it is shown again. */
+	unsigned paused : 1;
+
+	/* Sequence number of the next byte of output to send the client */
+	unsigned long long outseq;
+
+	/* Whether the client is sent screen diffs rather than output; the
+	   change count of the last diff sent; and when it was sent, in
+	   milliseconds of the monotonic clock */
+	unsigned diff : 1;
+	unsigned long long dgen, dms;
+
+	/* What the client's socket did not take at once, which is sent before
+	   anything else: the rest of a diff, a state that replaced output it
+	   fell too far behind on, or replies behind output it was owed */
+	struct fdbuf tail;
 };
 
 /* Whether the dtach component is logging. */
@@ -40,6 +59,52 @@ void _Noreturn subproc_main(Dtachctx dc);
 extern struct fdbuf therout;
 void process_tty_out(void *buf, ssize_t len);
 
+/* Called by the master before process_tty_out with whether no client is
+ * receiving output. If so, the engine may put off processing it until its
+ * state is needed. */
+void tty_out_lazy(int lazy);
+
+/* Claims an entry in the session registry for this master, and updates it with
+ * the clients receiving output, the title, and output counts. The master calls
+ * register_session when it starts and publish_session after handling activity.
+ * See sesreg.h. */
+void register_session(void);
+void publish_session(Dtachctx dc);
+
+/* Starts idle masters for the pool of new sessions if it is short. Called
+ * periodically by the spawner. */
+void pool_maint(void);
+
+/* Reads the profile definitions, or rereads them if they changed, for children
+ * of the calling process to use. Called periodically by the spawner. */
+void prof_maint(void);
+
+/* Each byte of client output is numbered, and outseq is the number of the next.
+ * The master keeps recent output in a ring so that a client that falls behind,
+ * or reconnects with the number it has reached, is sent only what it missed.
+ * outpending returns the output the client has yet to be sent that is stored
+ * contiguously, putting its size in len, or null if there is none. If what the
+ * client missed has left the ring, the state is put in cls->tail instead and it
+ * is moved to outseq. outring_start is called by the master when it starts.
+ *
+ * tail4cli writes as much of cls->tail to clifd as it takes without blocking,
+ * returning whether all of it is sent. The master calls it when clifd is
+ * writable and before sending the client anything else. */
+extern unsigned long long outseq;
+const void *outpending(int clifd, struct clistate *cls, size_t *len);
+int tail4cli(int clifd, struct clistate *cls);
+void outring_start(void);
+
+/* A client in diff mode is sent the rows of the screen that changed, at most
+ * DIFFFPS times a second, rather than output. diffwait returns how many
+ * milliseconds until the client should be sent a diff, 0 if it should be sent
+ * one now, or -1 if it has none coming. diff4cli sends one without blocking. A
+ * client that cannot keep up is sent fewer diffs, each with all rows that
+ * changed since its last, and one whose socket is full is sent every row once
+ * it has room. */
+int diffwait(struct clistate *cls);
+void diff4cli(int clifd, struct clistate *cls);
+
 /* ptyfd is the pseudo-terminal that controls the terminal-enabled process.
  * There is only one per master. vt100 keyboard input data is sent to this fd.
  * clioutfd is where output is sent to the attached client. This is used for
@@ -57,7 +122,26 @@ void send_pream(int fd);
 /* Called by master process. This must only be called by master, and never by
  * the attaching process, as the attaching process may have a later date on it
  * and thus create a new log file that doesn't get written to. */
-void open_logs(void);
+void open_logs(Dtachctx dc);
+
+/* Called by master process after open_logs. Loads the screen image left by an
+ * earlier master of the same terminal, if any, and keeps one up to date for
+ * the next. */
+void restore_screen(Dtachctx dc);
+
+/* Some work of the master is put off so that it is done at most every second
+ * or few: writing the screen image and publishing the title. duewait returns
+ * how many milliseconds until it should be done, 0 if it should be done now, or
+ * -1 if none is put off. duework writes the screen image if it is due, and
+ * publish_session publishes the title. */
+int duewait(void);
+void duework(void);
+
+/* Adds log pipes with pending output to wfds, for the master's select loop. */
+void logs_fdset(fd_set *wfds, int *highest_fd);
+
+/* Sends pending log output whose pipes are marked writable in wfds. */
+void logs_pump(fd_set *wfds);
 
 /* Allocates a new string of sufficient size and prints a formatted string to
  * it. Returns the length of the new string. */
@@ -71,6 +155,7 @@ const char *state_dir(void);
 /* Returns the next unique terminal ID suffix to use, not including the first
  * dot, e.g. "abc" */
 char *next_uniqid(void);
+void test_uniqid(void);
 
 /* Serves http over stdin/stdout. Returns 1 if the connection can be used to
    continue serving requests. */
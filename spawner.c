@@ -5,8 +5,10 @@
  * https://developers.google.com/open-source/licenses/bsd */
 
 #include "http.h"
+#include "logidx.h"
 #include "spawner.h"
 #include "shared.h"
+#include "tls.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -25,6 +27,7 @@ struct sock {
 	char *arg;
 
 	unsigned reus : 1;
+	unsigned tls : 1;
 
 	int fd;
 };
@@ -32,6 +35,9 @@ struct sock {
 struct subproc_args {
 	struct sock sk[FD_SETSIZE];
 	unsigned nr, maxsfd;
+
+	/* TLS context for [tls] addresses */
+	void *tlsctx;
 };
 
 static int setreuse(struct sock *s)
@@ -133,6 +139,22 @@ static int addip6(const char *a, Ports ps)
 	return 1;
 }
 
+static int addtls(const char *a, Ports ps)
+{
+	const char pref[] = "[tls]";
+	int preflen = 5;
+
+	if (strncmp(pref, a, preflen)) return 0;
+	a += preflen;
+
+	if (!adduds(a, ps) && !addip4(a, ps) && !addip6(a, ps)) return 0;
+
+	ps->sk[ps->nr - 1].tls = 1;
+	if (!ps->tlsctx) ps->tlsctx = tls_ctx();
+
+	return 1;
+}
+
 static void closeports(Ports ps)
 {
 	struct sock *sk = ps->sk + ps->nr;
@@ -179,6 +201,8 @@ static void handlreq(Ports ps, struct sock *s)
 
 	closeports(ps);
 
+	if (s->tls && 0 > (fd = tls_accept(ps->tlsctx, fd))) goto er;
+
 	if (0 > dup2(fd, 0))		{ perror("dup2 stdin"	); goto er; }
 	if (0 > dup2(fd, 1))		{ perror("dup2 stdout"	); goto er; }
 
@@ -229,6 +253,7 @@ Ports parse_spawner_ports(char **argv)
 	Ports ps = calloc(sizeof(*ps), 1);
 
 	for (; *argv; argv++) {
+		if (addtls(*argv, ps)) continue;
 		if (adduds(*argv, ps)) continue;
 		if (addip4(*argv, ps)) continue;
 		if (addip6(*argv, ps)) continue;
@@ -254,5 +279,12 @@ void _Noreturn spawner(Ports ps)
 		if (prepsock(sk) && ps->maxsfd < sk->fd) ps->maxsfd = sk->fd;
 	}
 
-	for (;;) { auth_maint(); acceptnext(ps); }
+	for (;;) {
+		auth_maint();
+		admit_maint();
+		logindex_maint();
+		pool_maint();
+		prof_maint();
+		acceptnext(ps);
+	}
 }
@@ -18,6 +18,14 @@
 
 /* WERM-SPECIFIC MODIFICATIONS
 
+ OCT 2026
+
+ - send the attach escape chosen by Werm, which may resume output from where a
+   reconnecting client left off
+
+ - make connecting and sending the attach escape a separate function, which
+   frees the websocket admission slot once the master has the request
+
  JAN 2024
 
  - attach_main takes Dtachctx as an argument
@@ -53,6 +61,7 @@
 
 #include "third_party/dtach/dtach.h"
 #include "outstreams.h"
+#include "http.h"
 #include "inbound.h"
 #include "shared.h"
 
@@ -158,6 +167,28 @@ die(int sig)
 		exit_msg("e", "unexpected signal: ", sig);
 }
 
+int attach_connect(Dtachctx dc)
+{
+	const char *atchesc = dc->atchesc ? dc->atchesc : "\\N";
+	int s, ern;
+
+	s = connect_uds_as_client(dc->sockpath);
+	if (s < 0) return -1;
+
+	/* Tell the master that we want to attach by sending a no-op signal, or
+	   where to resume from. The session may send nothing for a while after,
+	   so let another client connect once the master has this. */
+	if (send(s, atchesc, strlen(atchesc), MSG_NOSIGNAL) < 0) {
+		ern = errno;
+		close(s);
+		errno = ern;
+		return -1;
+	}
+	admit_done();
+
+	return s;
+}
+
 void attach_main(Dtachctx dc, int noerror)
 {
 	unsigned char buf[BUFSIZE];
@@ -166,7 +197,7 @@ void attach_main(Dtachctx dc, int noerror)
 
 	set_argv0(dc, 'a');
 
-	s = connect_uds_as_client(dc->sockpath);
+	s = attach_connect(dc);
 	if (s < 0) {
 		if (noerror) return;
 		exit_msg("es", "dtach connect_socket errno: ", errno);
@@ -180,8 +211,8 @@ void attach_main(Dtachctx dc, int noerror)
 	signal(SIGINT, die);
 	signal(SIGQUIT, die);
 
-	/* Tell the master that we want to attach by sending a no-op signal. */
-	write(s, "\\N", 2);
+	/* Frames may have been read along with the upgrade request. */
+	if (inbound_pending() && !fwrd_inbound_frames(s)) exit(0);
 
 	/* Wait for things to happen */
 	while (1)
@@ -212,7 +243,7 @@ void attach_main(Dtachctx dc, int noerror)
 		/* stdin activity */
 		if (n > 0 && FD_ISSET(0, &readfds))
 		{
-			fwrd_inbound_frames(s);
+			if (!fwrd_inbound_frames(s)) exit(0);
 			n--;
 		}
 	}
@@ -115,6 +115,11 @@
 
 struct dtach_ctx;
 void attach_main(struct dtach_ctx *dc, int noerror);
+
+/* Connects to the master at dc->sockpath and sends it dc->atchesc, or a plain
+   attach request, then frees this process's admission slot (see admit_done).
+   Returns the socket, or -1 with errno set. */
+int attach_connect(struct dtach_ctx *dc);
 void _Noreturn dtach_main(struct dtach_ctx *dc);
 int dtach_master(struct dtach_ctx *dc);
 
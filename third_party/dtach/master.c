@@ -18,6 +18,30 @@
 
 /* WERM-SPECIFIC MODIFICATIONS
 
+ OCT 2026
+
+ - let a master be started before its termid is known, for Werm's pool of
+   idle masters, and put off opening logs and registering it until it is
+   claimed
+
+ - publish the attached clients, title and output counts of the session to
+   Werm's session registry, for the attach page to read, rather than have it
+   connect to each master
+
+ - send each client output from Werm's output ring starting where that client
+   left off, rather than therout to whichever clients are writable, so a client
+   that blocks is caught up later instead of missing output
+
+ - do not send output to clients that are paused, and tell Werm whether any
+   client is receiving output before passing it pty output
+
+ - send clients in diff mode screen diffs when they are due and writable,
+   waiting in select no longer than until the next one is due
+
+ - pass Dtachctx to open_logs, and wait for log pipes to become writable in
+   the master loop so log output queued by the master is flushed to the log
+   writer process
+
  JAN 2024
 
  - move ownership of clients linked list to Dtachctx and refactor references to
@@ -92,6 +116,7 @@
 #include "third_party/dtach/dtach.h"
 #include "outstreams.h"
 #include "shared.h"
+#include "sesreg.h"
 #include <sys/wait.h>
 
 /* A connected client */
@@ -191,28 +216,45 @@ create_socket(char *name)
    'b' if writing would block
    'e' if unexpected error
    'o' if all written OK */
-static int cliwrite(int fd, const unsigned char *b, size_t sz)
+static int cliwrite(struct client *p)
 {
+	const void *b;
+	size_t sz;
 	ssize_t writn;
 
-	while (sz) {
-		writn = write(fd, b, sz);
+	if (!tail4cli(p->fd, &p->cls)) return 'b';
 
-		if (writn > 0) {
-			sz -= writn;
-			b += writn;
+	if (p->cls.diff) {
+		if (!diffwait(&p->cls)) diff4cli(p->fd, &p->cls);
+		return 'o';
+	}
+	if (!p->cls.wantsoutput || p->cls.paused) return 'o';
+
+	for (;;) {
+		b = outpending(p->fd, &p->cls, &sz);
+		if (!b && !p->cls.tail.len) return 'o';
+		if (!b) {
+			/* The client was sent the state in place of output. */
+			if (!tail4cli(p->fd, &p->cls)) return 'b';
+			continue;
 		}
+
+		writn = write(p->fd, b, sz);
+
+		if (writn > 0)
+			p->cls.outseq += writn;
 		else if (errno == EAGAIN || errno == EWOULDBLOCK)
 			return 'b';
 		else {
 			perror("writing to client");
-			fprintf(stderr, "  fd: %d\n", fd);
+			fprintf(stderr, "  fd: %d\n", p->fd);
 			fprintf(stderr, "  size: %zu\n", sz);
+
+			/* Do not retry until the client is closed. */
+			p->cls.outseq = outseq;
 			return 'e';
 		}
 	}
-
-	return 'o';
 }
 
 static int sendrout(Dtachctx dc, fd_set *writabl)
@@ -222,9 +264,11 @@ static int sendrout(Dtachctx dc, fd_set *writabl)
 
 	/* Send the data out to the clients. */
 	for (p = dc->cls, nclients = 0; p; p = p->next) {
-		if (!FD_ISSET(p->fd, writabl)) continue;
+		if (!FD_ISSET(p->fd, writabl))			continue;
+		if (	(!p->cls.wantsoutput || p->cls.paused)
+		&&	!p->cls.tail.len)			continue;
 
-		switch (cliwrite(p->fd, therout.bf, therout.len)) {
+		switch (cliwrite(p)) {
 		default: abort();
 		case 'b': break;
 		case 'e': nclients = -1;
@@ -254,8 +298,13 @@ pty_activity(Dtachctx dc, int s)
 		abort();
 	}
 
+	for (p = dc->cls, nclients = 0; p; p = p->next)
+		if (p->cls.wantsoutput && !p->cls.paused)
+			nclients++;
+
 	therout.len = 0;
 	if (!therout.cap) therout.cap = 1024;
+	tty_out_lazy(!nclients);
 	process_tty_out(preprocb, preproclen);
 
 	do {
@@ -269,7 +318,7 @@ pty_activity(Dtachctx dc, int s)
 		highest_fd = s;
 		for (p = dc->cls, nclients = 0; p; p = p->next)
 		{
-			if (!p->cls.wantsoutput)
+			if (!p->cls.wantsoutput || p->cls.paused)
 				continue;
 			FD_SET(p->fd, &writefds);
 			if (p->fd > highest_fd)
@@ -330,6 +379,17 @@ void print_atch_clis(Dtachctx dc, struct fdbuf *b)
 	fdb_apnc(b, ']');
 }
 
+void put_atch_clis(Dtachctx dc, struct sesent *e)
+{
+	struct client *q;
+
+	e->ncli = 0;
+	for (q = dc->cls; q && e->ncli < SESREGCLIS; q = q->next) {
+		if (!q->cls.wantsoutput) continue;
+		memcpy(e->clis[e->ncli++], q->cls.endpnt, sizeof e->clis[0]);
+	}
+}
+
 /* Process activity from a client. */
 static void
 client_activity(Dtachctx dc, struct client *p)
@@ -349,6 +409,7 @@ client_activity(Dtachctx dc, struct client *p)
 		if (p->next)
 			p->next->pprev = p->pprev;
 		*(p->pprev) = p->next;
+		fdb_finsh(&p->cls.tail);
 		free(p);
 		return;
 	}
@@ -378,8 +439,9 @@ static _Noreturn void
 masterprocess(Dtachctx dc, int s)
 {
 	struct client *p, *next;
-	fd_set readfds;
-	int highest_fd, nullfd;
+	fd_set readfds, writefds;
+	int highest_fd, nullfd, wait, minwait;
+	struct timeval tv;
 
 	/* Okay, disassociate ourselves from the original terminal, as we
 	** don't care what happens to it. */
@@ -399,12 +461,20 @@ masterprocess(Dtachctx dc, int s)
 		subproc_main(dc);
 	}
 	set_argv0(dc, 'm');
+	outring_start();
 
 	/* Do not save scrollbacks for ephemeral terminals, as these are
 	   used for grepping scrollback logs, so they can be very large
 	   and included redundant data that will be confusing to see in
-	   some recursive analysis of scrollbacks. */
-	if (!dc->isephem) open_logs();
+	   some recursive analysis of scrollbacks. A pooled master does this
+	   once it is claimed and knows its termid. */
+	if (!dc->pooled) {
+		register_session();
+		if (!dc->isephem) {
+			open_logs(dc);
+			restore_screen(dc);
+		}
+	}
 
 	/* Set up some signals. */
 	signal(SIGPIPE, SIG_IGN);
@@ -430,8 +500,10 @@ masterprocess(Dtachctx dc, int s)
 	{
 		/* Re-initialize the file descriptor set for select. */
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
 		FD_SET(s, &readfds);
 		highest_fd = s;
+		logs_fdset(&writefds, &highest_fd);
 
 		/*
 		** When first_attach is unset, wait until the client attaches
@@ -448,18 +520,43 @@ masterprocess(Dtachctx dc, int s)
 				highest_fd = dc->the_pty.fd;
 		}
 
+		minwait = -1;
 		for (p = dc->cls; p; p = p->next)
 		{
 			FD_SET(p->fd, &readfds);
+
+			/* Wait to write clients with output or a diff due, and
+			   no longer than until the next diff is due. */
+			wait = diffwait(&p->cls);
+			if (!wait)
+				FD_SET(p->fd, &writefds);
+			else if (wait > 0 && (minwait < 0 || wait < minwait))
+				minwait = wait;
+			else if (	p->cls.wantsoutput && !p->cls.paused
+				&&	!p->cls.diff && p->cls.outseq != outseq)
+				FD_SET(p->fd, &writefds);
+			else if (p->cls.tail.len)
+				FD_SET(p->fd, &writefds);
+
 			if (p->fd > highest_fd)
 				highest_fd = p->fd;
 		}
+		wait = duewait();
+		if (wait >= 0 && (minwait < 0 || wait < minwait))
+			minwait = wait;
+		tv.tv_sec = minwait / 1000;
+		tv.tv_usec = minwait % 1000 * 1000;
 
 		/* Wait for something to happen. */
-		if (select(highest_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
+		if (select(highest_fd + 1, &readfds, &writefds, NULL,
+			   minwait < 0 ? NULL : &tv) < 0) {
 			handleselecterr(dc->the_pty.pid);
 			continue;
 		}
+		logs_pump(&writefds);
+
+		/* Catch up clients that were behind. */
+		sendrout(dc, &writefds);
 
 		/* New client? */
 		if (FD_ISSET(s, &readfds))
@@ -475,6 +572,9 @@ masterprocess(Dtachctx dc, int s)
 		/* pty activity? */
 		if (FD_ISSET(dc->the_pty.fd, &readfds))
 			pty_activity(dc, s);
+
+		duework();
+		publish_session(dc);
 	}
 }
 
@@ -0,0 +1,165 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "tls.h"
+
+#include <err.h>
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void sslerrs(const char *what)
+{
+	unsigned long e;
+	char b[256];
+
+	fprintf(stderr, "%s\n", what);
+	while ((e = ERR_get_error())) {
+		ERR_error_string_n(e, b, sizeof(b));
+		fprintf(stderr, "  openssl error: %s\n", b);
+	}
+}
+
+void *tls_ctx(void)
+{
+	const char *cert = getenv("WERMTLSCERT"), *key = getenv("WERMTLSKEY");
+	SSL_CTX *ctx;
+
+	if (!cert || !*cert || !key || !*key)
+		errx(1, "[tls] address needs $WERMTLSCERT and $WERMTLSKEY");
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx) { sslerrs("making TLS context"); exit(1); }
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	if (1 != SSL_CTX_use_certificate_chain_file(ctx, cert)) {
+		sslerrs(cert);
+		exit(1);
+	}
+	if (1 != SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) ||
+	    1 != SSL_CTX_check_private_key(ctx)) {
+		sslerrs(key);
+		exit(1);
+	}
+
+	/* A session cache would only live in the process handling one
+	   connection, so rely on tickets alone. */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	return ctx;
+}
+
+static int writeall(int fd, const char *b, int sz)
+{
+	ssize_t writn;
+
+	while (sz) {
+		writn = write(fd, b, sz);
+		if (writn < 0 && errno == EINTR) continue;
+		if (writn <= 0) return 0;
+		b += writn;
+		sz -= writn;
+	}
+
+	return 1;
+}
+
+static void _Noreturn relay(SSL *ssl, int net, int pl)
+{
+	char b[16384];
+	fd_set fds;
+	int n, netrd;
+
+	for (;;) {
+		/* Records already read from net may hold more data. */
+		netrd = SSL_has_pending(ssl);
+
+		FD_ZERO(&fds);
+		FD_SET(net, &fds);
+		FD_SET(pl, &fds);
+		if (!netrd && 0 > select((net > pl ? net : pl) + 1, &fds, 0, 0, 0)) {
+			if (errno == EINTR) continue;
+			perror("select for TLS relay");
+			break;
+		}
+
+		if (netrd || FD_ISSET(net, &fds)) {
+			n = SSL_read(ssl, b, sizeof(b));
+			if (n <= 0) {
+				if (SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ)
+					continue;
+				break;
+			}
+			if (!writeall(pl, b, n)) break;
+		}
+
+		if (!netrd && FD_ISSET(pl, &fds)) {
+			n = read(pl, b, sizeof(b));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			if (0 >= SSL_write(ssl, b, n)) break;
+		}
+	}
+
+	SSL_shutdown(ssl);
+	exit(0);
+}
+
+int tls_accept(void *ctx, int fd)
+{
+	SSL *ssl = SSL_new(ctx);
+	int sp[2];
+	pid_t cpid;
+
+	if (!ssl || !SSL_set_fd(ssl, fd)) {
+		sslerrs("preparing TLS connection");
+		goto er;
+	}
+	if (1 != SSL_accept(ssl)) {
+		sslerrs("TLS handshake");
+		goto er;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* The kernel now handles records, so nothing else need go through ssl,
+	   which is left unfreed so it does not touch the socket again. */
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+	    BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+	    !SSL_has_pending(ssl))
+		return fd;
+#endif
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp)) {
+		perror("socketpair for TLS relay");
+		goto er;
+	}
+	if (0 > (cpid = fork())) {
+		perror("fork for TLS relay");
+		goto er;
+	}
+	if (!cpid) {
+		close(sp[0]);
+		close(fd);
+		return sp[1];
+	}
+
+	close(sp[1]);
+	relay(ssl, fd, sp[0]);
+
+er:
+	if (ssl) SSL_free(ssl);
+	return -1;
+}
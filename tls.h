@@ -0,0 +1,27 @@
+/* Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef TLS_H
+#define TLS_H
+
+/* Returns a context for serving TLS with the certificate chain in the PEM file
+ * $WERMTLSCERT and the private key in $WERMTLSKEY, or terminates the process if
+ * they cannot be loaded. Sessions are resumed with tickets encrypted with a key
+ * made here, so a client can resume a session with any process forked after
+ * this is called. */
+void *tls_ctx(void);
+
+/* Completes a TLS handshake with ctx on the accepted socket fd and returns an
+ * fd on which to read and write the connection in the clear, or -1 if the
+ * handshake failed.
+ *
+ * If the kernel can encrypt and decrypt records on the socket itself (kTLS),
+ * this is fd. Otherwise it is one end of a socket pair, and the calling process
+ * is forked so that the parent relays the other end over TLS until either side
+ * closes and then exits. Only the child returns. */
+int tls_accept(void *ctx, int fd);
+
+#endif
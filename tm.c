@@ -4,10 +4,17 @@
  * license that can be found in the LICENSE file or at
  * https://developers.google.com/open-source/licenses/bsd */
 
+#include "tmconst"
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef int32_t		TMint;
 typedef void	*	TMany;
@@ -51,6 +58,38 @@ int32_t tmalloc(int32_t nfct);
 int32_t tmlen(int32_t id);
 void tmfree(int32_t id);
 
+/* An image of all objects is tmobjs.capac and bufsfreehead, then for each
+ * slot its fct and, if it is allocated, its fields. tmimgsz gives its size in
+ * bytes and tmsave writes it. tmload replaces all objects with those in an
+ * image, returning 0 and leaving no objects if the image is malformed. */
+size_t tmimgsz(void);
+void tmsave(void *img);
+int tmload(const void *img, size_t sz);
+
+/* A screen image file is this header and then an image of all objects, in host
+ * byte order. Since a browser reads them with its own byte order, they are
+ * only portable between little-endian hosts, which is all of the common ones.
+ * tmimgwrite writes one to a temporary file and renames it to path, so a
+ * reader never sees a partial image. It returns 0 on failure. tmimgload maps
+ * one and loads it in place of all objects, as tmload, returning the ID of the
+ * terminal, or 0 if the file is missing or malformed. */
+struct tmimghdr {
+	/* TMIMGMAGIC */
+	char magic[4];
+	uint32_t version;
+
+	/* Size of this header, which is where the image starts */
+	uint32_t hdrsz;
+
+	/* ID of the terminal in the image */
+	int32_t t;
+
+	uint64_t imgsz;
+};
+
+int tmimgwrite(const char *path, int32_t t);
+int32_t tmimgload(const char *path);
+
 #define tmlog(...) do {				\
 	fflush(stdout);				\
 	fprintf(stderr,	"%s: ", __FILE__);	\
@@ -200,3 +239,149 @@ void tmfree(int32_t id)
 
 	tmobjs.bufsfreehead = ~id;
 }
+
+size_t tmimgsz(void)
+{
+	size_t sz = 2 + tmobjs.capac;
+	uint32_t i;
+
+	for (i = 0; i < tmobjs.capac; i++)
+		if (tmobjs.objel[i].fct > 0) sz += tmobjs.objel[i].fct;
+
+	return sz * sizeof(int32_t);
+}
+
+void tmsave(void *img_)
+{
+	int32_t *img = img_;
+	struct tmobj *o;
+	uint32_t i;
+
+	*img++ = tmobjs.capac;
+	*img++ = tmobjs.bufsfreehead;
+	for (i = 0; i < tmobjs.capac; i++) {
+		o = tmobjs.objel + i;
+		*img++ = o->fct;
+		if (o->fct <= 0) continue;
+
+		memcpy(img, o->fs, o->fct * sizeof(int32_t));
+		img += o->fct;
+	}
+}
+
+int tmload(const void *img_, size_t sz)
+{
+	const int32_t *img = img_, *end = img + sz / sizeof(int32_t);
+	struct tmobj *o;
+	uint32_t i, capac;
+
+	if (end - img < 2) return 0;
+	capac = img[0];
+	if ((size_t)(end - img) < 2 + (size_t)capac) return 0;
+
+	for (i = 0; i < tmobjs.capac; i++) free(tmobjs.objel[i].fs);
+	free(tmobjs.objel);
+
+	tmobjs.capac = capac;
+	tmobjs.bufsfreehead = img[1];
+	tmobjs.objel = calloc(capac ? capac : 1, sizeof(*tmobjs.objel));
+	if (!tmobjs.objel) sriously("calloc for %"PRIu32" objects", capac);
+	img += 2;
+
+	for (i = 0; i < capac; i++) {
+		o = tmobjs.objel + i;
+		if (img == end) goto bad;
+		o->fct = *img++;
+		if (o->fct < 0) continue;
+
+		if (end - img < o->fct) goto bad;
+		o->fs = calloc(o->fct ? o->fct : 1, sizeof(int32_t));
+		if (!o->fs) sriously("calloc for obj of field cnt %"PRId32, o->fct);
+		memcpy(o->fs, img, o->fct * sizeof(int32_t));
+		img += o->fct;
+	}
+
+	return 1;
+
+bad:
+	/* Leave an empty heap rather than a partial one. */
+	while (i--) free(tmobjs.objel[i].fs);
+	free(tmobjs.objel);
+	memset(&tmobjs, 0, sizeof(tmobjs));
+	return 0;
+}
+
+int tmimgwrite(const char *path, int32_t t)
+{
+	struct tmimghdr h = {TMIMGMAGIC, TMIMGVERSION, sizeof(h), t};
+	char *tmp = 0, *img = 0, *p;
+	size_t left;
+	ssize_t wr;
+	int fd = -1, ok = 0;
+
+	h.imgsz = tmimgsz();
+	img = malloc(sizeof(h) + h.imgsz);
+	tmp = malloc(strlen(path) + 32);
+	if (!img || !tmp) { perror("malloc screen image"); goto cleanup; }
+	memcpy(img, &h, sizeof(h));
+	tmsave(img + sizeof(h));
+
+	sprintf(tmp, "%s.%lld.tmp", path, (long long)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) { perror("open screen image"); goto cleanup; }
+
+	for (p = img, left = sizeof(h) + h.imgsz; left; p += wr, left -= wr) {
+		wr = write(fd, p, left);
+		if (wr < 0 && errno == EINTR) { wr = 0; continue; }
+		if (wr <= 0) { perror("write screen image"); goto cleanup; }
+	}
+
+	if (close(fd)) { fd = -1; perror("close screen image"); goto cleanup; }
+	fd = -1;
+	if (rename(tmp, path)) { perror("rename screen image"); goto cleanup; }
+	ok = 1;
+
+cleanup:
+	if (fd >= 0) close(fd);
+	if (!ok && tmp) unlink(tmp);
+	free(tmp);
+	free(img);
+	return ok;
+}
+
+int32_t tmimgload(const char *path)
+{
+	const struct tmimghdr *h;
+	struct stat sb;
+	void *m = MAP_FAILED;
+	int fd;
+	int32_t t = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+
+	if (fstat(fd, &sb) || sb.st_size < sizeof(*h)) goto bad;
+	m = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED) goto bad;
+
+	h = m;
+	if (memcmp(h->magic, TMIMGMAGIC, sizeof(h->magic)))	goto bad;
+	if (h->version != TMIMGVERSION)				goto bad;
+	if (h->hdrsz < sizeof(*h) || h->hdrsz > sb.st_size)	goto bad;
+	if (h->imgsz > sb.st_size - h->hdrsz)			goto bad;
+	if (!tmload((char *)m + h->hdrsz, h->imgsz))		goto bad;
+
+	/* The terminal must be an allocated object. */
+	if (h->t >= 0 || ~h->t >= tmobjs.capac)			goto bad;
+	if (tmobjs.objel[~h->t].fct < 0)			goto bad;
+	t = h->t;
+	goto cleanup;
+
+bad:
+	tmlog("bad screen image: %s", path);
+
+cleanup:
+	if (m != MAP_FAILED) munmap(m, sb.st_size);
+	close(fd);
+	return t;
+}
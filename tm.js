@@ -4,6 +4,8 @@
  * license that can be found in the LICENSE file or at
  * https://developers.google.com/open-source/licenses/bsd */
 
+#include "tmconst"
+
 #define TMint var
 #define fn0(name)			function name()
 #define fn1(name, a0)			function name(a0)
@@ -55,6 +57,42 @@ function tmfree(bref)
 
 function sriously(...a) { throw a; }
 
+/* Loads a screen image written by tmimgwrite in tm.c from the ArrayBuffer ab
+   in place of all objects, and returns the ID of the terminal in it, or 0 if
+   it is malformed. Objects are views into ab rather than copies. */
+function tmimgload(ab)
+{
+	var	dv = new DataView(ab), hsz, isz, w, ws, p, i, fct, objs = [],
+		mag = new TextDecoder().decode(new Uint8Array(ab, 0, 4)), t;
+
+	if (ab.byteLength < 24 || mag != TMIMGMAGIC)	return 0;
+	if (dv.getUint32(4, true) != TMIMGVERSION)	return 0;
+
+	hsz = dv.getUint32(8, true);
+	t = dv.getInt32(12, true);
+	isz = Number(dv.getBigUint64(16, true));
+	if (hsz % 4 || hsz < 24 || isz > ab.byteLength - hsz) return 0;
+
+	w = new Int32Array(ab, hsz, isz >> 2);
+	ws = w.length;
+	if (ws < 2 || ws < 2 + w[0]) return 0;
+
+	for (i = 0, p = 2; i < w[0]; i++) {
+		if (p == ws) return 0;
+		fct = w[p++];
+		if (fct < 0) { objs.push(fct); continue; }
+		if (ws - p < fct) return 0;
+		objs.push(new Int32Array(ab, hsz + p * 4, fct));
+		p += fct;
+	}
+	if (t >= 0 || ~t >= objs.length || typeof objs[~t] != 'object')
+		return 0;
+
+	bufsa = objs;
+	bufsfreehead = w[1];
+	return t;
+}
+
 function deqtostring(deq, byti)
 {
 	var ar = [], b;
@@ -107,3 +145,34 @@ function fldcpy(dobj, dndx, sobj, sndx, qwc)
 #define HEXARG(a)	(a).toString(16)
 
 #include "teng"
+
+/* Replaces the contents of the byte deq dq with the first n bytes of the
+   Uint8Array u8, packing four bytes to a field in the order deqpushbyt uses.
+   The deq is reallocated if it is too small, so the returned id must be used
+   in place of dq. */
+function deqldbyts(dq, u8, n)
+{
+	var qwc = (n + 3) >> 2, cap = deqbasicflds + qwc + 1, f, qi, bi;
+
+	if (deqcap(dq) < cap) {
+		tmfree(dq);
+		dq = tmalloc(cap);
+		deqcap(dq) = cap;
+	}
+
+	deqclear(dq);
+	if (!n) return dq;
+
+	f = jsobj(dq);
+	for (qi = deqbasicflds, bi = 0; bi < n; bi += 4)
+		f[qi++] =	u8[bi]		| u8[bi+1] << 8 |
+				u8[bi+2] << 16	| u8[bi+3] << 24;
+
+	if (n & 3) f[qi-1] &= (1 << 8 * (n & 3)) - 1;
+
+	deqhd(dq)	= deqbasicflds;
+	deqtl(dq)	= qi - 1;
+	deqtlbytes(dq)	= (4 - (n & 3)) & 3;
+
+	return dq;
+}
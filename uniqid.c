@@ -5,18 +5,18 @@
  * https://developers.google.com/open-source/licenses/bsd */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "shared.h"
 
-#define STATEPREF "nextterid."
-#define PREFLEN (sizeof(STATEPREF) - 1)
-
 static char *increm(const char *cnm)
 {
 	int ci, maxlen = strlen(cnm) + 1;
@@ -49,72 +49,145 @@ static char *increm(const char *cnm)
 	}
 }
 
-struct pckd {
-	char *next, *oldpath;
-};
+/* The last ID given out is kept in the counter file, which is locked while it
+   is read and rewritten. IDs only get longer, so the new one always covers the
+   old one in the file. Older versions kept the last ID in the name of a file
+   starting with LEGACYPREF instead; that file is read and removed when the
+   counter file is new. */
+#define COUNTERFN	"nextterid"
+#define LEGACYPREF	COUNTERFN "."
+#define IDMAX		64
+
+/* The value of an ID digit in the order increm counts: a-z, then 2-9. */
+static int iddigit(char c)
+{
+	return c >= 'a' && c <= 'z' ? c - 'a' : c - '2' + 26;
+}
+
+/* Compares IDs by the count they stand for. The least significant digit comes
+   first, and increm only lengthens an ID when it carries out of its last
+   digit, so a longer ID is greater. */
+static int idcmp(const char *a, const char *b)
+{
+	size_t i = strlen(a);
+
+	if (i != strlen(b)) return i < strlen(b) ? -1 : 1;
+	while (i--) {
+		if (a[i] != b[i]) return iddigit(a[i]) - iddigit(b[i]);
+	}
+	return 0;
+}
 
-static void pickcand(struct pckd *c)
+static char *legacyid(void)
 {
 	DIR *sdfd;
 	struct dirent *sdde;
+	char *last = 0, *path;
+	const char *id;
 
 	sdfd = opendir(state_dir());
-	if (!sdfd) { perror("opendir"); abort(); }
-
-	c->next = 0;
-	c->oldpath = 0;
-	while (errno = 0, sdde = readdir(sdfd)) {
-		if (strncmp(sdde->d_name, STATEPREF, PREFLEN)) continue;
-
-		if (c->oldpath) {
-			fprintf(stderr,
-				"There is more than one file named %s/%s*!"
-				" Delete the extra ones.\n",
-				state_dir(), STATEPREF);
-			abort();
+	if (!sdfd) { perror("opendir"); return 0; }
+
+	while ((sdde = readdir(sdfd))) {
+		if (strncmp(sdde->d_name, LEGACYPREF, sizeof(LEGACYPREF) - 1))
+			continue;
+
+		id = sdde->d_name + sizeof(LEGACYPREF) - 1;
+		if (!last || idcmp(id, last) > 0) {
+			free(last);
+			last = strdup(id);
 		}
 
-		xasprintf(&c->oldpath, "%s/%s", state_dir(), sdde->d_name);
-		c->next = increm(sdde->d_name + PREFLEN);
+		xasprintf(&path, "%s/%s", state_dir(), sdde->d_name);
+		unlink(path);
+		free(path);
 	}
-	if (errno) { perror("readdir"); abort(); }
+	closedir(sdfd);
+
+	return last;
+}
 
-	if (!c->oldpath) {
-		fprintf(stderr,
-			"did not find curr ID file %s/%s*; will create\n",
-			state_dir(), STATEPREF);
-		c->next = strdup("a");
+/* Reads the last ID from the locked counter file fd, writes the next one and
+   returns it. */
+static char *nextid(int fd)
+{
+	char last[IDMAX + 1], *next;
+	ssize_t n;
+
+	n = pread(fd, last, IDMAX, 0);
+	if (n < 0) { perror("read ID counter"); return 0; }
+	while (n && (last[n-1] == '\n' || last[n-1] == 0)) n--;
+	last[n] = 0;
+
+	/* With no ID given out yet, the first is "a", as increm would not give
+	   it. */
+	next = n ? increm(last) : strdup("a");
+	if (strlen(next) > IDMAX) {
+		fprintf(stderr, "ran out of terminal IDs\n");
+		abort();
+	}
+	if ((ssize_t)strlen(next) != pwrite(fd, next, strlen(next), 0)) {
+		perror("write ID counter");
+		free(next);
+		return 0;
 	}
 
-	closedir(sdfd);
+	return next;
 }
 
 char *next_uniqid(void)
 {
-	char *newpath;
-	struct pckd c;
-	char er;
-	int raceno;
+	char *path, *legacy, *next = 0;
+	struct stat sb;
+	int fd;
 
-	pickcand(&c);
+	xasprintf(&path, "%s/%s", state_dir(), COUNTERFN);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) { perror("open ID counter"); goto cleanup; }
 
-	asprintf(&newpath, "%s/%s%s", state_dir(), STATEPREF, c.next);
-	if (c.oldpath) {
-		er = 0 > rename(c.oldpath, newpath);
-		raceno = ENOENT;
-	}
-	else {
-		er = 0 > mknod(newpath, S_IFREG | 0644, 0);
-		raceno = EEXIST;
+	if (flock(fd, LOCK_EX)) { perror("lock ID counter"); goto cleanup; }
+
+	if (!fstat(fd, &sb) && !sb.st_size && (legacy = legacyid())) {
+		if ((ssize_t)strlen(legacy) !=
+		    pwrite(fd, legacy, strlen(legacy), 0))
+			perror("write ID counter");
+		free(legacy);
 	}
 
-	if (er) {
-		if (raceno != errno) { perror("mknod/rename"); abort(); }
-		free(c.next);
-		c.next = 0;
+	next = nextid(fd);
+
+cleanup:
+	if (fd >= 0) close(fd);
+	free(path);
+	if (!next) abort();
+	return next;
+}
+
+void test_uniqid(void)
+{
+	static const char *const old[] = {"9", "ab", "zb", "2b", "bb", 0};
+	const char *const *o, *latest = 0;
+	FILE *f = tmpfile();
+	char *id;
+	int i;
+
+	puts("TERMINAL IDS");
+
+	for (i = 0; i < 36; i++) {
+		id = nextid(fileno(f));
+		printf("%s ", id);
+		free(id);
 	}
+	putchar('\n');
+
+	pwrite(fileno(f), "9z", 2, 0);
+	id = nextid(fileno(f));	printf("after 9z: %s\n", id);	free(id);
+	pwrite(fileno(f), "99", 2, 0);
+	id = nextid(fileno(f));	printf("after 99: %s\n", id);	free(id);
+	id = nextid(fileno(f));	printf("then: %s\n", id);	free(id);
+
+	for (o = old; *o; o++) if (!latest || idcmp(*o, latest) > 0) latest = *o;
+	printf("latest of 9 ab zb 2b bb: %s\n", latest);
 
-	free(c.oldpath);
-	free(newpath);
-	return c.next;
+	fclose(f);
 }
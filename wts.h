@@ -4,21 +4,37 @@
  * license that can be found in the LICENSE file or at
  * https://developers.google.com/open-source/licenses/bsd */
 
+#include "rawrec.h"
+
+#include <time.h>
+
 /* Name is based on Write To Subproc but this contains process_kbd state too.
  * We put this in a single struct so all logic state can be reset with a single
  * memset call. */
 typedef struct {
 	unsigned short swrow, swcol;
-	/* chars read into either winsize, ttl, or client_state's endpnt,
-	   depending on value of escp */
+	/* chars read into either winsize, sbpgreq, resumereq, claimreq, ttl,
+	   or client_state's endpnt, depending on value of escp */
 	unsigned altbufsz;
 	char winsize[8];
 
+	/* number of the first scrollback line and number of lines requested */
+	char sbpgreq[14];
+
+	/* epoch and sequence number, in hex, of the output a reconnecting
+	   client received last */
+	char resumereq[32];
+
+	/* termid sent by the new session claiming a pooled master */
+	char claimreq[128];
+
 	int t;
 
 	/* 0: reading raw characters
 	 * '1': next char is escaped
 	 * 'w': reading window size
+	 * 'b': reading a request for scrollback lines into sbpgreq
+	 * 'R': reading a request to resume output into resumereq
 	 * 't': reading title into ttl
 	 * 'i': reading endpoint ID int client_state's endpnt
 	 */
@@ -37,9 +53,43 @@ typedef struct {
 	unsigned clnttl		: 1;
 
 	/* Logs (either text only, or raw subproc output) are written to these
-	 * fd's if writelg,writerawlg are 1. */
-	struct wrides logde, rawlogde;
-} Wts;
+	 * if writelg,writerawlg are 1. */
+	struct logsink lgsk, rawlgsk;
+
+	/* Timestamps the raw log and checkpoints t if the raw log is timed. */
+	struct recorder rec;
+
+	/* Path of the screen image kept for a later master of this terminal,
+	   or null if there is none; when it was last written; whether t has
+	   changed since; and the master and subprocess it belongs to. */
+	char *scrimg;
+	time_t scrimgtm;
+	unsigned scrimgdirty	: 1;
+	pid_t scrimgpid, subpid;
+
+	/* The last OUTRINGSZ bytes of client output, the byte numbered n at
+	   n % OUTRINGSZ, and the epoch that numbering belongs to, which is
+	   unique to the master. */
+	unsigned char *outring;
+	unsigned long long outep;
+
+	/* Count of changes to t, and for each of its rowgencap rows, the count
+	   when it last changed; see diffwait */
+	unsigned long long dgen, *rowgen;
+	int rowgencap;
+
+	/* Set while no client is receiving output, in which case output is
+	   kept in lazyb, up to LAZYMAX bytes, rather than run through t
+	   right away. */
+	unsigned lazy		: 1;
+	struct fdbuf lazyb;
+
+	/* This master's entry in the session registry, or null if it has
+	   none, and when the title in it was last found on the screen and the
+	   change count of t then. */
+	struct sesent *ses;
+	time_t sesttltm;
+	unsigned long long sesttlgen;} Wts;
 
 extern Wts wts;
 